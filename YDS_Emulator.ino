@@ -1,106 +1,401 @@
 #include <Arduino.h>
 
-#define STARTUP_BUFFER_SIZE 55
-uint8_t Startup_buf[STARTUP_BUFFER_SIZE];
+// YDS ECU emulator
+//
+// Plays scripted ride scenarios onto the K-line at a configurable frame rate,
+// with optional fault injection, and prints a ground truth line for every
+// frame on USB serial so the logger's output can be checked end to end.
+//
+// Serial commands (115200, newline terminated):
+//   <rpm> <speed> <error> <coolant>   Raw byte values, switches to MANUAL
+//   SCENARIO <IDLE|WARMUP|ACCEL|ERRORS|RIDE|SCRIPT|MANUAL>
+//   STEP <ms> <rpm> <gear> <coolantC> <error>   Append a SCRIPT step
+//   STEP CLEAR                        Empty the SCRIPT
+//   RATE <frames per second>          Clamped to the line limit
+//   FAULT <CHECKSUM|DROP|DUP|NOISE> <per mille>
+//   FAULT OFF                         Clear all faults
+//   START <NORMAL|DIAG|LATE <ms>|NONE>  Preamble sent on the next RESTART
+//   RESTART                           Line silence, preamble, scenario from 0
+//   GT <ON|OFF>                       Ground truth output
+//
+// Ground truth: GT,<us>,<seq>,<rpm>,<kmh>,<gear>,<coolantC>,<error>,<fault>
 
-bool startupSent = false;
-bool ecuRespondReady = false;
+#define KLINE_BAUD 16040
+#define KLINE_RX 7
+#define KLINE_TX 8
 
-// Default values for RPM, Speed, and Coolant Temperature
+// The logger treats the 61st byte from 0x3E on as the end of the startup
+// sequence (processIMMOSequence, now XT660Profile::IMMO_LENGTH). The old
+// 55 byte preamble was short, the logger took the first frame as its tail.
+#define IMMO_LENGTH 61
+#define FRAME_BYTES 6  // Lead byte + 4 data bytes + checksum
+#define RPM_SCALE 50
+#define COOLANT_OFFSET 30
+#define SPEED_FRAMES 8 // Logger sums speed over 8 frames
+#define SILENCE_MS 500 // Line silence before a preamble
+
+// Max frames per second the line can carry
+const uint32_t LINE_LIMIT_FPS = KLINE_BAUD / 10 / FRAME_BYTES;
+
+// RPM per km/h in each gear, the same units the logger learns. Illustrative
+// values with a plausible spread, not measured on a bike
+const float gearRatios[] = {0.0f, 120.0f, 80.0f, 62.0f, 51.0f, 44.0f};
+const uint8_t MAX_GEARS = 5;
+
+// Yamaha fault codes cycled by the ERRORS scenario
+const uint8_t errorCodes[] = {0, 12, 13, 15, 21, 22, 30, 33, 41, 42, 44, 46, 0};
+
+enum Scenario { IDLE, WARMUP, ACCEL, ERRORS, RIDE, SCRIPT, MANUAL };
+const char *scenarioNames[] = {"IDLE", "WARMUP", "ACCEL", "ERRORS", "RIDE", "SCRIPT", "MANUAL"};
+
+enum StartMode { START_NORMAL, START_DIAG, START_LATE, START_NONE };
+
+enum Fault { FAULT_NONE, FAULT_CHECKSUM, FAULT_DROP, FAULT_DUP, FAULT_NOISE };
+const char *faultNames[] = {"NONE", "CHECKSUM", "DROP", "DUP", "NOISE"};
+
+struct Step {
+  uint16_t durationMs;
+  uint16_t rpm;
+  uint8_t gear;
+  uint8_t coolant;
+  uint8_t error;
+};
+
+#define MAX_STEPS 32
+Step script[MAX_STEPS];
+uint8_t scriptLength = 0;
+
+// Vehicle state for the current frame
+struct State {
+  uint16_t rpm;
+  uint16_t kmh;
+  uint8_t gear;
+  uint8_t coolant; // Celsius
+  uint8_t error;
+};
+
+Scenario scenario = IDLE;
+StartMode startMode = START_NORMAL;
+uint32_t lateStartMs = 2000;
+uint32_t frameRate = 70;
+uint16_t faultRate[5] = {0, 0, 0, 0, 0}; // Per mille, indexed by Fault
+bool groundTruth = true;
+
+// Manual values, raw bytes like the original emulator
 uint8_t rpm = 0;
 uint8_t speed = 0;
 uint8_t errorCode = 0;
 uint8_t coolantTemp = 0;
 
-// Fake IMMO/ Normal Boot mode
-void sendStartupMessages() {
-  if (!startupSent) {
-    // Fill Startup_buf with startup messages
-    Startup_buf[0] = 0x3E; // 0x3E message
+// Run state
+uint32_t scenarioStartMs = 0;
+uint32_t nextFrameUs = 0;
+uint32_t frameSeq = 0;
+uint32_t silentUntilMs = 0;
+bool preambleDue = true;
+bool preambleSent = false;
 
-    // Fill IMMO sequence bytes (all but the last byte)
-    for (int i = 1; i < STARTUP_BUFFER_SIZE - 1; ++i) {
-      Startup_buf[i] = 0x00; // Default value set to 0x00
-    }
+void sendPreamble(uint8_t lastByte) {
+  uint8_t immo[IMMO_LENGTH];
+  immo[0] = 0x3E;
+  for (int i = 1; i < IMMO_LENGTH - 1; ++i) {
+    immo[i] = 0x00;
+  }
+  immo[IMMO_LENGTH - 1] = lastByte;
+  Serial1.write(immo, IMMO_LENGTH);
+}
+
+// Smooth warm up curve from 20C towards 90C
+uint8_t warmupCoolant(uint32_t ms) {
+  float t = ms / 1000.0f;
+  return 90 - (uint8_t)(70.0f * expf(-t / 60.0f));
+}
 
-    // Set the last byte to 0xFE
-    Startup_buf[STARTUP_BUFFER_SIZE - 1] = 0xFE;
+// Accelerate 3000 -> 7500 rpm through every gear, then coast down
+void accelRun(uint32_t ms, State &s) {
+  const uint32_t gearMs = 2500;
+  const uint32_t coastMs = 8000;
+  uint32_t runMs = gearMs * MAX_GEARS + coastMs;
+  ms %= runMs;
 
-    // Send Startup_buf over Serial1
-    Serial1.write(Startup_buf, STARTUP_BUFFER_SIZE);
-    //Serial.println("Startup messages sent");
-    startupSent = true;
-    ecuRespondReady = true; // Set ECU response ready flag
+  if (ms < gearMs * MAX_GEARS) {
+    s.gear = 1 + ms / gearMs;
+    float progress = (ms % gearMs) / (float)gearMs;
+    s.rpm = 3000 + progress * 4500;
+  } else {
+    float progress = (ms - gearMs * MAX_GEARS) / (float)coastMs;
+    s.gear = MAX_GEARS;
+    s.rpm = 7500 - progress * 5500;
   }
+  s.kmh = s.rpm / gearRatios[s.gear];
 }
 
-void ecuRespond() {
-  static unsigned long lastResponseTime = 0;
-  const unsigned long responseInterval = 7; // Interval for sending the ECU response in milliseconds
+void scriptRun(uint32_t ms, State &s) {
+  if (scriptLength == 0) {
+    return;
+  }
 
-  unsigned long currentMillis = millis();
-  // Check if enough time has elapsed since the last response and the ecuRespondReady flag is set
-  if (ecuRespondReady && currentMillis - lastResponseTime >= responseInterval) {
-    // Fill ecuRespond_buf with ECU response
-    uint8_t ecuRespond_buf[6];
-    ecuRespond_buf[0] = 0x01;
-    ecuRespond_buf[1] = rpm; // Update RPM value
-    ecuRespond_buf[2] = speed; // Update Speed value
-    ecuRespond_buf[3] = errorCode; // Update Error Code value
-    ecuRespond_buf[4] = coolantTemp; // Update Coolant Temperature value
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < scriptLength; ++i) {
+    total += script[i].durationMs;
+  }
+  ms %= total ? total : 1;
 
-    // Calculate checksum
-    uint8_t checksum = ecuRespond_buf[1] + ecuRespond_buf[2] + ecuRespond_buf[3] + ecuRespond_buf[4];
-    ecuRespond_buf[5] = checksum;
+  // Find the step and interpolate rpm towards the next one
+  for (uint8_t i = 0; i < scriptLength; ++i) {
+    const Step &step = script[i];
+    if (ms < step.durationMs) {
+      const Step &next = script[(i + 1) % scriptLength];
+      float progress = ms / (float)step.durationMs;
+      s.rpm = step.rpm + (next.rpm - (int)step.rpm) * progress;
+      s.gear = step.gear > MAX_GEARS ? MAX_GEARS : step.gear;
+      s.coolant = step.coolant;
+      s.error = step.error;
+      s.kmh = s.gear ? s.rpm / gearRatios[s.gear] : 0;
+      return;
+    }
+    ms -= step.durationMs;
+  }
+}
 
-    // Send ecuRespond_buf over Serial1
-    Serial1.write(ecuRespond_buf, sizeof(ecuRespond_buf));
+State scenarioState(uint32_t ms) {
+  State s = {1300, 0, 0, 85, 0};
+  s.rpm += (frameSeq * 37) % 100; // Idle hunting
 
-    // Update lastResponseTime
-    lastResponseTime = currentMillis;
+  switch (scenario) {
+  case IDLE:
+    break;
+  case WARMUP:
+    s.rpm = 1500 - min<uint32_t>(ms / 200, 200);
+    s.coolant = warmupCoolant(ms);
+    break;
+  case ACCEL:
+    accelRun(ms, s);
+    break;
+  case ERRORS:
+    s.error = errorCodes[(ms / 5000) % sizeof(errorCodes)];
+    break;
+  case RIDE:
+    s.coolant = warmupCoolant(ms);
+    if (ms > 30000) {
+      accelRun(ms - 30000, s);
+    }
+    if ((ms / 45000) % 4 == 3) {
+      s.error = 21; // Periodic coolant sensor fault
+    }
+    break;
+  case SCRIPT:
+    scriptRun(ms, s);
+    break;
+  case MANUAL:
+    s.rpm = rpm * RPM_SCALE;
+    s.kmh = speed * SPEED_FRAMES;
+    s.error = errorCode;
+    s.coolant = coolantTemp - COOLANT_OFFSET;
+    break;
+  }
+  return s;
+}
 
-    // Introduce a delay of 7 milliseconds
-    delay(responseInterval);
+Fault pickFault() {
+  for (uint8_t f = FAULT_CHECKSUM; f <= FAULT_NOISE; ++f) {
+    if (faultRate[f] && (uint32_t)random(1000) < faultRate[f]) {
+      return (Fault)f;
+    }
   }
+  return FAULT_NONE;
 }
 
-void setup() {
-  Serial.begin(115200);
-  // Print the message along with the initial values for RPM, Speed, Error Code, and Coolant Temp. 
-  Serial.println("Hi, Pick your ECU Values, in decmimal with spaces between values then press enter to dynamically change them\n"
-                 "RPM: 0\n"
-                 "Speed: 0\n"
-                 "Error Code: 0\n" // Added Error Code line
-                 "Coolant Temp: 0");
-  Serial1.begin(16040, SERIAL_8N1, 7, 8); // Using pins 7 (RX) and 8 (TX) for Serial1
+void sendFrame(const State &s) {
+  uint8_t frame[FRAME_BYTES + 1];
+  frame[0] = 0x01;
+  frame[1] = min(s.rpm / RPM_SCALE, 255);
+  // Spread km/h over 8 frames so any 8 consecutive frames sum to it
+  frame[2] = (s.kmh + frameSeq % SPEED_FRAMES) / SPEED_FRAMES;
+  frame[3] = s.error;
+  frame[4] = s.coolant + COOLANT_OFFSET;
+  frame[5] = frame[1] + frame[2] + frame[3] + frame[4];
+  size_t length = FRAME_BYTES;
+  uint16_t sentRpm = frame[1] * RPM_SCALE; // Before any fault touches it
+
+  Fault fault = pickFault();
+  switch (fault) {
+  case FAULT_CHECKSUM:
+    frame[5] ^= 0x5A;
+    break;
+  case FAULT_DROP: {
+    uint8_t drop = 1 + random(FRAME_BYTES - 1);
+    memmove(frame + drop, frame + drop + 1, FRAME_BYTES - drop - 1);
+    length--;
+    break;
+  }
+  case FAULT_DUP: {
+    uint8_t dup = 1 + random(FRAME_BYTES - 1);
+    memmove(frame + dup + 1, frame + dup, FRAME_BYTES - dup);
+    length++;
+    break;
+  }
+  case FAULT_NOISE:
+    frame[1 + random(FRAME_BYTES - 1)] = random(256);
+    break;
+  default:
+    break;
+  }
+
+  Serial1.write(frame, length);
+
+  if (groundTruth) {
+    char line[80];
+    snprintf(line, sizeof(line), "GT,%lu,%lu,%u,%u,%u,%u,%u,%s", (unsigned long)micros(), (unsigned long)frameSeq,
+             sentRpm, s.kmh, s.gear, s.coolant, s.error, faultNames[fault]);
+    Serial.println(line);
+  }
+  frameSeq++;
 }
 
-void loop() {
-  sendStartupMessages(); // Run once at the beginning
-  ecuRespond(); // Run continuously after startup messages are sent
+void restart() {
+  scenarioStartMs = millis();
+  silentUntilMs = scenarioStartMs + SILENCE_MS;
+  preambleDue = startMode != START_NONE;
+  preambleSent = false;
+  frameSeq = 0;
+  Serial.print("RESTART scenario ");
+  Serial.println(scenarioNames[scenario]);
+}
 
-  if (Serial.available() > 0) {
-    // Read user input from the serial monitor
-    String userInput = Serial.readStringUntil('\n');
+void ecuRespond() {
+  uint32_t nowMs = millis();
+  if ((int32_t)(nowMs - silentUntilMs) < 0) {
+    return;
+  }
 
-    // Convert the strings to integers
-    int rpmInput, speedInput, errorCodeInput, coolantTempInput;
-    sscanf(userInput.c_str(), "%d %d %d %d", &rpmInput, &speedInput, &errorCodeInput, &coolantTempInput);
+  // Late start: run frames first, go silent, then send the preamble
+  if (preambleDue && !preambleSent) {
+    if (startMode == START_LATE && nowMs - silentUntilMs < lateStartMs) {
+      // Fall through and send frames without a preamble
+    } else if (startMode == START_LATE && nowMs - silentUntilMs < lateStartMs + SILENCE_MS) {
+      return;
+    } else {
+      sendPreamble(startMode == START_DIAG ? 0xCD : 0xFE);
+      preambleSent = true;
+      Serial.println(startMode == START_DIAG ? "PREAMBLE DIAG" : "PREAMBLE NORMAL");
+      nextFrameUs = micros();
+      return;
+    }
+  }
+
+  // Non-blocking frame pacing
+  uint32_t nowUs = micros();
+  if ((int32_t)(nowUs - nextFrameUs) < 0) {
+    return;
+  }
+  nextFrameUs += 1000000UL / frameRate;
+  if ((int32_t)(nowUs - nextFrameUs) > 100000) {
+    nextFrameUs = nowUs; // Don't burst after a stall
+  }
 
-    // Convert the values to uint8_t and update RPM, Speed, Error Code, and Coolant Temperature values
+  sendFrame(scenarioState(nowMs - scenarioStartMs));
+}
+
+void handleCommand(String line) {
+  line.trim();
+  line.toUpperCase();
+
+  int rpmInput, speedInput, errorCodeInput, coolantTempInput;
+  if (sscanf(line.c_str(), "%d %d %d %d", &rpmInput, &speedInput, &errorCodeInput, &coolantTempInput) == 4) {
     rpm = (uint8_t)rpmInput;
     speed = (uint8_t)speedInput;
     errorCode = (uint8_t)errorCodeInput;
     coolantTemp = (uint8_t)coolantTempInput;
+    scenario = MANUAL;
+    Serial.printf("MANUAL RPM: %d Speed: %d Error Code: %d Coolant Temp: %d\n", rpm * RPM_SCALE, speed * SPEED_FRAMES,
+                  errorCode, coolantTemp - COOLANT_OFFSET);
+    return;
+  }
 
-    // Print updated values
-    Serial.print("RPM: ");
-    Serial.println(rpm * 50);
-    Serial.print("Speed: ");
-    Serial.println(speed * 8);
-    Serial.print("Error Code: ");
-    Serial.println(errorCode);
-    Serial.print("Coolant Temp: ");
-    Serial.println(coolantTemp);
+  if (line.startsWith("SCENARIO ")) {
+    String name = line.substring(9);
+    for (uint8_t i = 0; i <= MANUAL; ++i) {
+      if (name == scenarioNames[i]) {
+        scenario = (Scenario)i;
+        restart();
+        return;
+      }
+    }
+  } else if (line == "STEP CLEAR") {
+    scriptLength = 0;
+    Serial.println("SCRIPT cleared");
+    return;
+  } else if (line.startsWith("STEP ")) {
+    int ms, stepRpm, gear, coolant, error;
+    if (sscanf(line.c_str() + 5, "%d %d %d %d %d", &ms, &stepRpm, &gear, &coolant, &error) == 5 &&
+        scriptLength < MAX_STEPS) {
+      script[scriptLength++] = {(uint16_t)ms, (uint16_t)stepRpm, (uint8_t)gear, (uint8_t)coolant, (uint8_t)error};
+      Serial.printf("SCRIPT %u steps\n", scriptLength);
+      return;
+    }
+  } else if (line.startsWith("RATE ")) {
+    frameRate = constrain(line.substring(5).toInt(), 1, (long)LINE_LIMIT_FPS);
+    Serial.printf("RATE %lu fps (line limit %lu)\n", (unsigned long)frameRate, (unsigned long)LINE_LIMIT_FPS);
+    return;
+  } else if (line == "FAULT OFF") {
+    memset(faultRate, 0, sizeof(faultRate));
+    Serial.println("FAULTS off");
+    return;
+  } else if (line.startsWith("FAULT ")) {
+    int space = line.indexOf(' ', 6);
+    String name = line.substring(6, space);
+    for (uint8_t f = FAULT_CHECKSUM; f <= FAULT_NOISE; ++f) {
+      if (space > 0 && name == faultNames[f]) {
+        faultRate[f] = constrain(line.substring(space + 1).toInt(), 0, 1000);
+        Serial.printf("FAULT %s %u per mille\n", faultNames[f], faultRate[f]);
+        return;
+      }
+    }
+  } else if (line == "START NORMAL") {
+    startMode = START_NORMAL;
+  } else if (line == "START DIAG") {
+    startMode = START_DIAG;
+  } else if (line == "START NONE") {
+    startMode = START_NONE;
+  } else if (line.startsWith("START LATE")) {
+    startMode = START_LATE;
+    if (line.length() > 11) {
+      lateStartMs = line.substring(11).toInt();
+    }
+  } else if (line == "RESTART") {
+    restart();
+    return;
+  } else if (line == "GT ON" || line == "GT OFF") {
+    groundTruth = line == "GT ON";
+    return;
+  } else {
+    Serial.println("Unknown command");
+    return;
+  }
+
+  if (line.startsWith("START")) {
+    Serial.println("START mode set, applies on RESTART");
+  } else {
+    Serial.println("Bad arguments");
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+  Serial.println("YDS ECU emulator\n"
+                 "SCENARIO IDLE|WARMUP|ACCEL|ERRORS|RIDE|SCRIPT|MANUAL, STEP, RATE, FAULT, START, RESTART, GT\n"
+                 "Or type raw RPM Speed Error Coolant bytes in decimal with spaces between values");
+  Serial1.setTxBufferSize(1024);
+  Serial1.begin(KLINE_BAUD, SERIAL_8N1, KLINE_RX, KLINE_TX); // Using pins 7 (RX) and 8 (TX) for Serial1
+  randomSeed(micros());
+  restart();
+}
+
+void loop() {
+  ecuRespond();
+
+  if (Serial.available() > 0) {
+    handleCommand(Serial.readStringUntil('\n'));
   }
 }
@@ -0,0 +1,391 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <regex>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include <ecuprofile.h>
+
+// App profiles shipped in the repo
+//
+// Each loader turns one app config into the ELM command cycle that app sends
+// over and over, with every command repeated in proportion to its poll rate:
+//   RealDash   realdash/Realdashv1.xml        <rotation> commands, skipCount N = every Nth pass
+//   Torque     TorqueBHPexportedPIDsv2.csv    every ModeAndPID, minimumRefreshDelayMillis in frame periods
+//   RaceChrono RaceChrono/Yam_racechrono.rcz  selectedChannels per priority group, " 1" suffix
+
+struct PollMix
+{
+  std::string app;
+  std::vector<std::string> cycle;
+};
+
+inline bool readFile(const std::string &path, std::string &data)
+{
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file)
+  {
+    return false;
+  }
+
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+  {
+    data.append(buffer, n);
+  }
+  fclose(file);
+  return true;
+}
+
+inline std::string upperHex(std::string text)
+{
+  for (char &c : text)
+  {
+    c = toupper((unsigned char)c);
+  }
+  return text;
+}
+
+inline bool loadRealDash(const std::string &path, PollMix &mix)
+{
+  std::string xml;
+  if (!readFile(path, xml))
+  {
+    return false;
+  }
+
+  size_t begin = xml.find("<rotation>");
+  size_t end = xml.find("</rotation>");
+  if (begin == std::string::npos || end == std::string::npos)
+  {
+    return false;
+  }
+  std::string rotation = xml.substr(begin, end - begin);
+
+  struct Entry
+  {
+    std::string command;
+    int skip;
+  };
+  std::vector<Entry> entries;
+  std::regex tag("<command([^>]*)>");
+  std::regex send("send=\"([^\"]+)\"");
+  std::regex skip("skipCount=\"([0-9]+)\"");
+  int passes = 1;
+  for (std::sregex_iterator it(rotation.begin(), rotation.end(), tag), last; it != last; ++it)
+  {
+    std::string attributes = (*it)[1];
+    std::smatch m;
+    if (!std::regex_search(attributes, m, send))
+    {
+      continue;
+    }
+    Entry entry = {upperHex(m[1]), 1};
+    if (std::regex_search(attributes, m, skip))
+    {
+      entry.skip = std::max(1, atoi(m[1].str().c_str()));
+    }
+    passes = std::max(passes, entry.skip);
+    entries.push_back(entry);
+  }
+
+  mix.app = "RealDash";
+  for (int pass = 0; pass < passes; ++pass)
+  {
+    for (const Entry &entry : entries)
+    {
+      if (pass % entry.skip == 0)
+      {
+        mix.cycle.push_back(entry.command);
+      }
+    }
+  }
+  return !mix.cycle.empty();
+}
+
+inline bool loadTorque(const std::string &path, PollMix &mix)
+{
+  std::string csv;
+  if (!readFile(path, csv))
+  {
+    return false;
+  }
+
+  // "Name", "ShortName", "ModeAndPID", ... "minimumRefreshDelayMillis"
+  std::regex row("^\"[^\"]*\",\\s*\"[^\"]*\",\\s*\"0x([0-9A-Fa-f]+)\".*,\\s*([0-9]+)\\s*$");
+  struct Entry
+  {
+    std::string command;
+    int skip;
+  };
+  std::vector<Entry> entries;
+  int passes = 1;
+  size_t start = 0;
+  while (start < csv.size())
+  {
+    size_t end = csv.find('\n', start);
+    if (end == std::string::npos)
+    {
+      end = csv.size();
+    }
+    std::string line = csv.substr(start, end - start);
+    if (!line.empty() && line.back() == '\r')
+    {
+      line.pop_back();
+    }
+    std::smatch m;
+    if (std::regex_search(line, m, row))
+    {
+      // One pass per ECU frame, a refresh delay skips whole passes
+      int skip = std::max(1, atoi(m[2].str().c_str()) * 1000 / (int)EcuProfile::FRAME_PERIOD_US);
+      entries.push_back({upperHex(m[1]), skip});
+      passes = std::max(passes, skip);
+    }
+    start = end + 1;
+  }
+
+  for (int pass = 0; pass < passes; ++pass)
+  {
+    for (const Entry &entry : entries)
+    {
+      if (pass % entry.skip == 0)
+      {
+        mix.cycle.push_back(entry.command);
+      }
+    }
+  }
+
+  mix.app = "Torque";
+  return !mix.cycle.empty();
+}
+
+inline uint32_t le32(const uint8_t *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+inline uint16_t le16(const uint8_t *p)
+{
+  return p[0] | p[1] << 8;
+}
+
+// Central directory offset and entry count from the end record
+inline bool zipDirectory(const std::string &zip, size_t &entry, unsigned &count)
+{
+  const uint8_t *bytes = (const uint8_t *)zip.data();
+  if (zip.size() < 22)
+  {
+    return false;
+  }
+
+  // End of central directory, scanning back over the comment
+  size_t eocd = zip.size() - 22;
+  while (le32(bytes + eocd) != 0x06054b50)
+  {
+    if (eocd == 0)
+    {
+      return false;
+    }
+    eocd--;
+  }
+  entry = le32(bytes + eocd + 16);
+  count = le16(bytes + eocd + 10);
+  return true;
+}
+
+// Member names in directory order
+inline std::vector<std::string> zipMembers(const std::string &zip)
+{
+  std::vector<std::string> names;
+  const uint8_t *bytes = (const uint8_t *)zip.data();
+  size_t entry;
+  unsigned count;
+  if (!zipDirectory(zip, entry, count))
+  {
+    return names;
+  }
+  for (; count > 0 && entry + 46 <= zip.size() && le32(bytes + entry) == 0x02014b50; --count)
+  {
+    const uint8_t *central = bytes + entry;
+    names.emplace_back(zip, entry + 46, le16(central + 28));
+    entry += 46 + le16(central + 28) + le16(central + 30) + le16(central + 32);
+  }
+  return names;
+}
+
+// One member of a zip archive, stored or deflated
+inline bool zipExtract(const std::string &zip, const std::string &member, std::string &data)
+{
+  const uint8_t *bytes = (const uint8_t *)zip.data();
+  size_t entry;
+  unsigned count;
+  if (!zipDirectory(zip, entry, count))
+  {
+    return false;
+  }
+
+  for (; count > 0 && entry + 46 <= zip.size(); --count)
+  {
+    const uint8_t *central = bytes + entry;
+    if (le32(central) != 0x02014b50)
+    {
+      return false;
+    }
+    uint16_t method = le16(central + 10);
+    uint32_t packedSize = le32(central + 20);
+    uint32_t size = le32(central + 24);
+    uint16_t nameLength = le16(central + 28);
+    size_t localOffset = le32(central + 42);
+    std::string name(zip, entry + 46, nameLength);
+    entry += 46 + nameLength + le16(central + 30) + le16(central + 32);
+
+    if (name != member || localOffset + 30 > zip.size())
+    {
+      continue;
+    }
+
+    const uint8_t *local = bytes + localOffset;
+    size_t dataOffset = localOffset + 30 + le16(local + 26) + le16(local + 28);
+    if (dataOffset + packedSize > zip.size())
+    {
+      return false;
+    }
+
+    if (method == 0)
+    {
+      data.assign(zip, dataOffset, size);
+      return true;
+    }
+    if (method != 8)
+    {
+      return false;
+    }
+
+    data.resize(size);
+    z_stream stream = {};
+    stream.next_in = (Bytef *)bytes + dataOffset;
+    stream.avail_in = packedSize;
+    stream.next_out = (Bytef *)&data[0];
+    stream.avail_out = size;
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+    {
+      return false;
+    }
+    int result = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+    return result == Z_STREAM_END;
+  }
+  return false;
+}
+
+// RaceChrono pid numbers are mode 01 PIDs, 0x10C = 010C
+inline std::string raceChronoCommand(long pid)
+{
+  char command[16];
+  snprintf(command, sizeof(command), pid < 0x100 ? "01%02lX 1" : "%04lX 1", pid);
+  return command;
+}
+
+// Accepts the .rcz archive or an extracted vehicleProfile.json
+inline bool loadRaceChrono(const std::string &path, PollMix &mix)
+{
+  std::string json;
+  if (!readFile(path, json))
+  {
+    return false;
+  }
+  if (json.compare(0, 2, "PK") == 0)
+  {
+    std::string archive;
+    archive.swap(json);
+    if (!zipExtract(archive, "vehicleProfile.json", json))
+    {
+      return false;
+    }
+  }
+
+  // channelId -> pid from customChannels
+  std::vector<std::pair<long, long>> pids;
+  std::regex custom("\"channelId\"\\s*:\\s*([0-9]+)\\s*,\\s*\"pid\"\\s*:\\s*([0-9]+)");
+  for (std::sregex_iterator it(json.begin(), json.end(), custom), last; it != last; ++it)
+  {
+    pids.push_back({atol((*it)[1].str().c_str()), atol((*it)[2].str().c_str())});
+  }
+
+  // Every priority group is polled in turn
+  std::regex group("\"channelIds\"\\s*:\\s*\\[([^\\]]*)\\]");
+  std::regex number("[0-9]+");
+  for (std::sregex_iterator it(json.begin(), json.end(), group), last; it != last; ++it)
+  {
+    std::string ids = (*it)[1];
+    for (std::sregex_iterator id(ids.begin(), ids.end(), number); id != last; ++id)
+    {
+      long channel = atol(id->str().c_str());
+      for (const auto &pid : pids)
+      {
+        if (pid.first == channel)
+        {
+          mix.cycle.push_back(raceChronoCommand(pid.second));
+        }
+      }
+    }
+  }
+
+  mix.app = "RaceChrono";
+  return !mix.cycle.empty();
+}
+
+// Single member zip archive, stored uncompressed
+inline std::string zipStore(const std::string &member, const std::string &data)
+{
+  uint32_t crc = crc32(0, (const Bytef *)data.data(), data.size());
+  auto put16 = [](std::string &out, uint16_t v) { out += (char)(v & 0xFF); out += (char)(v >> 8); };
+  auto put32 = [&](std::string &out, uint32_t v) { put16(out, v & 0xFFFF); put16(out, v >> 16); };
+
+  std::string zip;
+  put32(zip, 0x04034b50);
+  put16(zip, 20); // Version needed
+  put16(zip, 0);  // Flags
+  put16(zip, 0);  // Stored
+  put32(zip, 0);  // DOS time and date
+  put32(zip, crc);
+  put32(zip, data.size());
+  put32(zip, data.size());
+  put16(zip, member.size());
+  put16(zip, 0);
+  zip += member + data;
+
+  size_t central = zip.size();
+  put32(zip, 0x02014b50);
+  put16(zip, 20); // Version made by
+  put16(zip, 20);
+  put16(zip, 0);
+  put16(zip, 0);
+  put32(zip, 0);
+  put32(zip, crc);
+  put32(zip, data.size());
+  put32(zip, data.size());
+  put16(zip, member.size());
+  put16(zip, 0); // Extra
+  put16(zip, 0); // Comment
+  put16(zip, 0); // Disk
+  put16(zip, 0); // Internal attributes
+  put32(zip, 0); // External attributes
+  put32(zip, 0); // Local header offset
+  zip += member;
+
+  size_t centralSize = zip.size() - central;
+  put32(zip, 0x06054b50);
+  put16(zip, 0);
+  put16(zip, 0);
+  put16(zip, 1);
+  put16(zip, 1);
+  put32(zip, centralSize);
+  put32(zip, central);
+  put16(zip, 0);
+  return zip;
+}
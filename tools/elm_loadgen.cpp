@@ -0,0 +1,358 @@
+// elm_loadgen - ELM capacity per app, from the app profiles shipped in the repo
+//
+// Loads the poll mix of RealDash, Torque and RaceChrono (appprofiles.h) and
+// drives it through the native ELM command path at increasing request rates.
+// A client that waits for each prompt (window 1, what the apps do) is bound by
+// the round trip, not by the offered rate, so window 1 runs once as fast as
+// the prompts come back. The rate sweep is run for each pipelining window
+// above 1, by default 2, 4, 8 and 64 requests in flight. The reply queue can
+// only drop once more requests are in flight than ELM_TX_QUEUE_LIMIT, so the
+// last window is past the cap to show where that happens.
+// The run is a discrete time simulation: the firmware side reproduces
+// bleElmRx -> processElmRxQueue -> bleElmQue -> bleElmSend with the loop
+// intervals from main.cpp and the ELM_TX_QUEUE_LIMIT cap, and the BLE link
+// delivers writes and notifications on connection events, at most
+// --notifies-per-event notifications each; bleElmSend leaves a reply queued
+// while the link buffers are full. Every request still
+// runs through handleCommand() and ElmSession, so replies are the real ones.
+//
+// For every rate step it reports sustained PIDs per second, latency
+// percentiles, drops in the bleElmQue reply queue, the RX backlog and client
+// timeouts. Run from the repo root so the default profile paths resolve.
+//
+// Build: g++ -std=c++17 -O2 -Iyamaha/include tools/elm_loadgen.cpp -o elm_loadgen -lz
+// Usage: elm_loadgen [--app realdash|torque|racechrono] [--rates 25,50,100] [--seconds N]
+//                    [--windows 1,2,4,8,64] [--conn-interval ms] [--notifies-per-event N]
+//                    [--rx-interval ms] [--tx-interval ms] [--timeout ms] [--realdash file] [--torque file] [--racechrono file]
+
+#include "native.h"
+#include "appprofiles.h"
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <sstream>
+
+struct Options
+{
+  std::string realdash = "realdash/Realdashv1.xml";
+  std::string torque = "TorqueBHPexportedPIDsv2.csv";
+  std::string racechrono = "RaceChrono/Yam_racechrono.rcz";
+  std::string app; // Empty runs all three
+  std::vector<int> rates = {25, 50, 100, 150, 200, 250, 300, 400};
+  int seconds = 20;
+  std::vector<int> windows = {1, 2, 4, 8, 64}; // Requests in flight, 1 = wait for the prompt like the apps do
+  double connIntervalMs = 30;  // Android default range, 0 = ideal link
+  int notifiesPerEvent = 4;    // Link buffers per connection event, 0 = unlimited
+  int rxIntervalMs = 4;        // sendIntervalElmRX in main.cpp
+  int txIntervalMs = 3;        // sendIntervalElmTX in main.cpp
+  int timeoutMs = 1000;
+};
+
+struct StepResult
+{
+  int rate;
+  uint64_t sent = 0;
+  uint64_t answered = 0;
+  uint64_t drops = 0;
+  uint64_t timeouts = 0;
+  size_t backlog = 0;
+  std::vector<uint64_t> latencyUs;
+};
+
+struct Message
+{
+  uint64_t id;
+  const std::string *command;
+  std::string reply;
+};
+
+// rate 0 sends the next request as soon as the window allows
+StepResult runStep(const PollMix &mix, int rate, int window, const Options &options)
+{
+  const uint64_t tickUs = 100;
+  const uint64_t durationUs = (uint64_t)options.seconds * 1000000ULL;
+  const uint64_t periodUs = rate ? 1000000ULL / rate : 0;
+  const uint64_t connUs = (uint64_t)(options.connIntervalMs * 1000);
+  const uint64_t rxUs = (uint64_t)options.rxIntervalMs * 1000;
+  const uint64_t txUs = (uint64_t)options.txIntervalMs * 1000;
+  const uint64_t timeoutUs = (uint64_t)options.timeoutMs * 1000;
+
+  // Next connection event, when the link carries what was queued before it
+  auto linkDelivery = [&](uint64_t t) { return connUs ? (t / connUs + 1) * connUs : t; };
+
+  StepResult result;
+  result.rate = rate;
+  ElmSession session;
+  std::deque<std::pair<uint64_t, Message>> uplink;   // Client writes in flight
+  std::deque<Message> rxQueue;                        // BleClient::elmRxQueue
+  std::deque<Message> txQueue;                        // BleClient::elmTxQueue
+  std::deque<std::pair<uint64_t, Message>> downlink; // Notifications in flight
+  std::map<uint64_t, uint64_t> outstanding;           // id -> sent time
+
+  uint64_t nextId = 1;
+  uint64_t nextSendUs = 0;
+  uint64_t lastRxUs = 0;
+  uint64_t lastTxUs = 0;
+  size_t cursor = 0;
+
+  for (uint64_t t = 0; t < durationUs; t += tickUs)
+  {
+    // Client gives up on replies that never came
+    for (auto it = outstanding.begin(); it != outstanding.end();)
+    {
+      if (t - it->second > timeoutUs)
+      {
+        result.timeouts++;
+        it = outstanding.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+
+    // Client sends at the offered rate while the window allows
+    if (t >= nextSendUs && outstanding.size() < (size_t)window)
+    {
+      Message message = {nextId++, &mix.cycle[cursor++ % mix.cycle.size()], ""};
+      outstanding[message.id] = t;
+      uplink.push_back({linkDelivery(t), message});
+      result.sent++;
+      nextSendUs = std::max(nextSendUs, t) + periodUs;
+    }
+
+    // bleElmRx
+    while (!uplink.empty() && uplink.front().first <= t)
+    {
+      rxQueue.push_back(uplink.front().second);
+      uplink.pop_front();
+    }
+
+    // processElmRxQueue -> bleElmQue
+    if (t - lastRxUs >= rxUs)
+    {
+      lastRxUs = t;
+      if (!rxQueue.empty())
+      {
+        Message message = rxQueue.front();
+        rxQueue.pop_front();
+        message.reply = session.reply(*message.command);
+        txQueue.push_back(message);
+        if (txQueue.size() > ELM_TX_QUEUE_LIMIT)
+        {
+          txQueue.pop_front();
+          result.drops++;
+        }
+      }
+    }
+
+    // bleElmSend, the reply waits while the next connection event is full
+    uint64_t nextEventUs = linkDelivery(t);
+    int scheduled = 0;
+    for (auto it = downlink.rbegin(); it != downlink.rend() && it->first == nextEventUs; ++it)
+    {
+      scheduled++;
+    }
+    bool linkFull = options.notifiesPerEvent && connUs && scheduled >= options.notifiesPerEvent;
+    if (t - lastTxUs >= txUs && !linkFull)
+    {
+      lastTxUs = t;
+      if (!txQueue.empty())
+      {
+        downlink.push_back({linkDelivery(t), txQueue.front()});
+        txQueue.pop_front();
+      }
+    }
+
+    // Client receives
+    while (!downlink.empty() && downlink.front().first <= t)
+    {
+      auto it = outstanding.find(downlink.front().second.id);
+      if (it != outstanding.end())
+      {
+        result.latencyUs.push_back(t - it->second);
+        result.answered++;
+        outstanding.erase(it);
+      }
+      downlink.pop_front();
+    }
+  }
+
+  result.backlog = rxQueue.size();
+  return result;
+}
+
+double percentileMs(std::vector<uint64_t> &samples, double p)
+{
+  if (samples.empty())
+  {
+    return 0;
+  }
+  return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))] / 1000.0;
+}
+
+void printMix(const PollMix &mix)
+{
+  std::map<std::string, int> counts;
+  for (const std::string &command : mix.cycle)
+  {
+    counts[command]++;
+  }
+
+  printf("\n%s: %zu requests per cycle\n ", mix.app.c_str(), mix.cycle.size());
+  for (const auto &count : counts)
+  {
+    printf(" %s %.1f%%", count.first.c_str(), 100.0 * count.second / mix.cycle.size());
+  }
+  printf("\n");
+}
+
+double printStep(const char *offered, StepResult &step, const Options &options)
+{
+  std::sort(step.latencyUs.begin(), step.latencyUs.end());
+  double answeredPerSecond = (double)step.answered / options.seconds;
+  printf("  %7s %8.1f %8.1f %8.2f %8.2f %8.2f %7llu %7zu %8llu\n", offered, (double)step.sent / options.seconds,
+         answeredPerSecond, percentileMs(step.latencyUs, 0.50), percentileMs(step.latencyUs, 0.99),
+         step.latencyUs.empty() ? 0.0 : step.latencyUs.back() / 1000.0, (unsigned long long)step.drops, step.backlog,
+         (unsigned long long)step.timeouts);
+  return answeredPerSecond;
+}
+
+void runApp(const PollMix &mix, const Options &options)
+{
+  printMix(mix);
+  for (int window : options.windows)
+  {
+    printf(" window %d%s\n", window,
+           window == 1                                ? ", next request on the prompt"
+           : (size_t)window <= ELM_TX_QUEUE_LIMIT ? ", too few in flight for the reply queue to drop"
+                                                      : "");
+    printf("  %7s %8s %8s %8s %8s %8s %7s %7s %8s\n", "offered", "sent/s", "PIDs/s", "p50 ms", "p99 ms", "max ms",
+           "drops", "backlog", "timeouts");
+
+    // The offered rate makes no difference while every request waits for the prompt
+    if (window == 1)
+    {
+      StepResult step = runStep(mix, 0, window, options);
+      printf("  round trip bound at %.1f PIDs/s\n", printStep("prompt", step, options));
+      continue;
+    }
+
+    int sustained = 0;
+    double best = 0;
+    for (int rate : options.rates)
+    {
+      StepResult step = runStep(mix, rate, window, options);
+      double answeredPerSecond = printStep(std::to_string(rate).c_str(), step, options);
+      best = std::max(best, answeredPerSecond);
+      if (step.drops == 0 && step.timeouts == 0 && answeredPerSecond >= 0.95 * rate)
+      {
+        sustained = rate;
+      }
+    }
+    if (sustained)
+    {
+      printf("  keeps up without loss up to %d req/s, peak %.1f PIDs/s\n", sustained, best);
+    }
+    else
+    {
+      printf("  never keeps up with the offered rate, peak %.1f PIDs/s\n", best);
+    }
+  }
+}
+
+std::vector<int> splitList(const std::string &list)
+{
+  std::vector<int> rates;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ','))
+  {
+    if (atoi(item.c_str()) > 0)
+    {
+      rates.push_back(atoi(item.c_str()));
+    }
+  }
+  return rates;
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    auto next = [&]() { return i + 1 < argc ? std::string(argv[++i]) : std::string(); };
+    if (arg == "--app")
+      options.app = next();
+    else if (arg == "--rates")
+      options.rates = splitList(next());
+    else if (arg == "--seconds")
+      options.seconds = std::max(1, atoi(next().c_str()));
+    else if (arg == "--windows")
+      options.windows = splitList(next());
+    else if (arg == "--conn-interval")
+      options.connIntervalMs = atof(next().c_str());
+    else if (arg == "--notifies-per-event")
+      options.notifiesPerEvent = std::max(0, atoi(next().c_str()));
+    else if (arg == "--rx-interval")
+      options.rxIntervalMs = atoi(next().c_str());
+    else if (arg == "--tx-interval")
+      options.txIntervalMs = atoi(next().c_str());
+    else if (arg == "--timeout")
+      options.timeoutMs = atoi(next().c_str());
+    else if (arg == "--realdash")
+      options.realdash = next();
+    else if (arg == "--torque")
+      options.torque = next();
+    else if (arg == "--racechrono")
+      options.racechrono = next();
+    else
+    {
+      fprintf(stderr, "usage: %s [--app realdash|torque|racechrono] [--rates list] [--seconds N] [--windows list] "
+                      "[--conn-interval ms] [--notifies-per-event N] [--rx-interval ms] [--tx-interval ms] [--timeout ms] "
+                      "[--realdash file] [--torque file] [--racechrono file]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (options.rates.empty() || options.windows.empty())
+  {
+    fprintf(stderr, "no rates or windows\n");
+    return 1;
+  }
+
+  struct Loader
+  {
+    const char *name;
+    const std::string &path;
+    bool (*load)(const std::string &, PollMix &);
+  };
+  const Loader loaders[] = {{"realdash", options.realdash, loadRealDash},
+                            {"torque", options.torque, loadTorque},
+                            {"racechrono", options.racechrono, loadRaceChrono}};
+
+  printf("Connection interval %.1f ms, %d notifications per event, ELM RX every %d ms, TX every %d ms, "
+         "reply queue %zu\n",
+         options.connIntervalMs, options.notifiesPerEvent, options.rxIntervalMs, options.txIntervalMs,
+         ELM_TX_QUEUE_LIMIT);
+
+  int ran = 0;
+  for (const Loader &loader : loaders)
+  {
+    if (!options.app.empty() && options.app != loader.name)
+    {
+      continue;
+    }
+
+    PollMix mix;
+    if (!loader.load(loader.path, mix))
+    {
+      fprintf(stderr, "%s: cannot load %s\n", loader.name, loader.path.c_str());
+      continue;
+    }
+    runApp(mix, options);
+    ran++;
+  }
+  return ran ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+// Hex dumps of binary files printed by the logger over USB, "SNIFF DUMP" and
+// "LOG DUMP <n>": "<tag> BEGIN <bytes>", "<tag> <offset> <hex>" lines and
+// "<tag> END". Anything else in the log (menu text, prompts, CR) is ignored.
+
+// The first dump in a log back into the file image
+inline bool parseHexDump(const std::string &text, const std::string &tag, std::string &image)
+{
+  std::string begin = tag + " BEGIN ";
+  size_t start = text.find(begin);
+  if (start == std::string::npos)
+  {
+    return false;
+  }
+  size_t length = strtoul(text.c_str() + start + begin.size(), nullptr, 10);
+  std::string format = tag + " %x %255s";
+  std::string end = tag + " END";
+
+  size_t pos = text.find('\n', start);
+  while (pos != std::string::npos && pos + 1 < text.size())
+  {
+    size_t next = text.find('\n', pos + 1);
+    std::string line = text.substr(pos + 1, next == std::string::npos ? std::string::npos : next - pos - 1);
+    pos = next;
+    if (line.compare(0, end.size(), end) == 0)
+    {
+      break;
+    }
+
+    unsigned offset;
+    char hex[256];
+    if (sscanf(line.c_str(), format.c_str(), &offset, hex) != 2)
+    {
+      continue;
+    }
+    if (offset != image.size())
+    {
+      fprintf(stderr, "dump line at %06X, expected %06zX, lines missing\n", offset, image.size());
+      return false;
+    }
+    for (size_t i = 0; hex[i] && hex[i + 1]; i += 2)
+    {
+      char byte[3] = {hex[i], hex[i + 1], 0};
+      image.push_back((char)strtoul(byte, nullptr, 16));
+    }
+  }
+
+  if (image.size() != length)
+  {
+    fprintf(stderr, "dump has %zu of %zu bytes\n", image.size(), length);
+    return false;
+  }
+  return true;
+}
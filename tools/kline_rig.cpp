@@ -0,0 +1,760 @@
+// kline_rig - end to end latency rig for the native firmware core
+//
+// Three threads joined by two pseudo-terminals:
+//   virtual ECU  -> K-line pty -> firmware core (decodeByte -> PIDs)
+//   virtual ELM client <-> ELM pty <-> firmware core (handleCommand -> ElmSession)
+//
+// The firmware side paces its ELM RX/TX queues with the same loop intervals as
+// bleTimers() in main.cpp. Every ECU frame carries a unique RPM value, so each
+// ELM reply can be matched to the frame it came from and the ECU-to-app
+// latency distribution is reported at the end.
+//
+// --tcp swaps the ELM pty for the WiFi transport: the firmware side listens on
+// a loopback TCP port and runs one ElmStream per connection like elmtcp.h,
+// and the client pipelines --window requests. With --no-client any WiFi
+// ELM327 tool can connect to 127.0.0.1:35000 instead.
+//
+// --init sends AT commands before the rotation, e.g. --init ATS0 or --init
+// ATH1, and the report counts the replies that came back with a CAN header
+// and without spaces, so per-connection ELM settings can be checked.
+//
+// Build: g++ -std=c++17 -O2 -pthread -Iyamaha/include tools/kline_rig.cpp -o kline_rig -lutil
+// Usage: kline_rig [--seconds N] [--fps N] [--replay file] [--rotation "010C 1,010D 1"]
+//                  [--rx-interval ms] [--tx-interval ms] [--long-poll] [--tcp [port]] [--window N]
+//                  [--init "ATS0,ATH1"] [--no-client] [--no-ecu] [--verbose]
+
+#include "native.h"
+#include "replay.h"
+#include <elmstream.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <pty.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+struct Options
+{
+  int seconds = 10;
+  int fps = 70;
+  std::string replay;
+  std::vector<std::string> rotation = {"010C 1", "010D 1", "010C 1", "0105 1"};
+  std::vector<std::string> init; // AT commands sent once before the rotation
+  int rxIntervalMs = 4; // sendIntervalElmRX in main.cpp
+  int txIntervalMs = 3; // sendIntervalElmTX in main.cpp
+  bool client = true;
+  bool ecu = true;
+  bool longPoll = false;
+  int tcpPort = 0; // 0 = ELM pty
+  int window = 1;  // Requests in flight on TCP
+};
+
+struct Pty
+{
+  int master = -1;
+  std::string path;
+};
+
+// Latest frame put on the wire for each raw RPM byte
+struct FrameStamp
+{
+  uint64_t seq;
+  uint64_t sentUs;
+};
+
+std::atomic<bool> running(true);
+std::mutex frameMutex;
+FrameStamp frameByRpm[256];
+std::atomic<uint64_t> framesSent(0);
+
+// Firmware side counters
+std::atomic<uint64_t> elmRequests(0);
+std::atomic<uint64_t> elmQueueDrops(0);
+
+bool openRawPty(Pty &pty)
+{
+  int slave;
+  char name[128];
+  if (openpty(&pty.master, &slave, name, nullptr, nullptr) < 0)
+  {
+    return false;
+  }
+
+  termios tio;
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  close(slave); // Reopened by path, like an external program would
+  pty.path = name;
+  return true;
+}
+
+int openRawPath(const std::string &path)
+{
+  int fd = open(path.c_str(), O_RDWR | O_NOCTTY);
+  if (fd >= 0)
+  {
+    termios tio;
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  return fd;
+}
+
+void sleepUntilUs(uint64_t timeUs)
+{
+  timespec ts;
+  ts.tv_sec = timeUs / 1000000ULL;
+  ts.tv_nsec = (timeUs % 1000000ULL) * 1000;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+}
+
+// Virtual ECU: writes at the real byte cadence and stamps each frame end
+void ecuThread(const std::string &path, const Options &options)
+{
+  int fd = openRawPath(path);
+  if (fd < 0)
+  {
+    fprintf(stderr, "ecu: cannot open %s\n", path.c_str());
+    return;
+  }
+
+  KLineDecoder<EcuProfile> observer; // Finds frame ends in what we send
+  uint64_t nextUs = nativeNowUs() + 200000;
+
+  auto sendByte = [&](uint8_t value)
+  {
+    sleepUntilUs(nextUs);
+    if (write(fd, &value, 1) != 1)
+    {
+      return;
+    }
+    uint64_t now = nativeNowUs();
+    nextUs = std::max(nextUs + Decoder::BYTE_US, now);
+
+    Decoder::Event event = observer.feed(value, now);
+    if (event == Decoder::FRAME || event == Decoder::LOCKED)
+    {
+      std::lock_guard<std::mutex> lock(frameMutex);
+      frameByRpm[observer.frame()[EcuProfile::RPM_INDEX]] = {++framesSent, now};
+    }
+  };
+
+  if (!options.replay.empty())
+  {
+    std::vector<ReplayByte> bytes;
+    if (!replayLoad(options.replay, bytes))
+    {
+      fprintf(stderr, "ecu: cannot read %s\n", options.replay.c_str());
+      close(fd);
+      return;
+    }
+
+    uint64_t startUs = nextUs;
+    for (const ReplayByte &b : bytes)
+    {
+      if (!running)
+      {
+        break;
+      }
+      if (b.direction == 'R')
+      {
+        nextUs = std::max(nextUs, startUs + b.timeUs);
+        sendByte(b.value);
+      }
+    }
+    close(fd);
+    return;
+  }
+
+  // IMMO preamble, normal start
+  sendByte(EcuProfile::IMMO_START_BYTE);
+  for (int i = 2; i < EcuProfile::IMMO_LENGTH; ++i)
+  {
+    sendByte(0x00);
+  }
+  sendByte(0xFE);
+
+  // Lead byte + frame, unique RPM byte per frame
+  uint64_t periodUs = 1000000ULL / options.fps;
+  for (uint64_t seq = 0; running; ++seq)
+  {
+    uint64_t frameStartUs = nextUs;
+    uint8_t frame[6] = {0x01, (uint8_t)(1 + seq % 250), (uint8_t)(seq % 16), 0, 110};
+    frame[5] = frame[1] + frame[2] + frame[3] + frame[4];
+    for (uint8_t value : frame)
+    {
+      sendByte(value);
+    }
+    nextUs = std::max(nextUs, frameStartUs + periodUs);
+  }
+  close(fd);
+}
+
+// Firmware core: YamahaRX + bleElmRx + processElmRxQueue + bleElmSend
+void firmwareThread(int klineFd, int elmFd, const Options &options)
+{
+  ElmSession session;
+  std::deque<std::string> rxQueue;
+  std::deque<std::string> txQueue;
+  std::string line;
+  uint64_t lastRxUs = 0;
+  uint64_t lastTxUs = 0;
+
+  while (running)
+  {
+    pollfd fds[2] = {{klineFd, POLLIN, 0}, {elmFd, POLLIN, 0}};
+    poll(fds, 2, 1);
+    uint64_t now = nativeNowUs();
+
+    if (fds[0].revents & POLLIN)
+    {
+      uint8_t buffer[64];
+      ssize_t n = read(klineFd, buffer, sizeof(buffer));
+      for (ssize_t i = 0; i < n; ++i)
+      {
+        decodeByte(buffer[i], (uint32_t)now);
+      }
+    }
+
+    if (fds[1].revents & POLLIN)
+    {
+      char buffer[256];
+      ssize_t n = read(elmFd, buffer, sizeof(buffer));
+      for (ssize_t i = 0; i < n; ++i)
+      {
+        char c = buffer[i];
+        if (c == '\r' || c == '\n')
+        {
+          if (!line.empty())
+          {
+            rxQueue.push_back(line);
+            elmRequests++;
+            line.clear();
+          }
+        }
+        else
+        {
+          line += toupper((unsigned char)c);
+        }
+      }
+    }
+
+    // releaseElmLongPoll() after YamahaRX(), queued and sent straight away
+    std::string held;
+    bool sendNow = session.release((uint32_t)now, held);
+    if (sendNow)
+    {
+      txQueue.push_back(held);
+    }
+
+    if (now - lastRxUs >= (uint64_t)options.rxIntervalMs * 1000)
+    {
+      lastRxUs = now;
+      if (!rxQueue.empty() && !session.holding())
+      {
+        std::string command = rxQueue.front();
+        rxQueue.pop_front();
+        if (!session.hold(command, (uint32_t)now))
+        {
+          txQueue.push_back(session.reply(command));
+        }
+        if (txQueue.size() > ELM_TX_QUEUE_LIMIT) // Same cap as Device::bleElmQue
+        {
+          txQueue.pop_front();
+          elmQueueDrops++;
+        }
+      }
+    }
+
+    if (sendNow || now - lastTxUs >= (uint64_t)options.txIntervalMs * 1000)
+    {
+      lastTxUs = now;
+      if (!txQueue.empty())
+      {
+        const std::string &reply = txQueue.front();
+        if (write(elmFd, reply.data(), reply.size()) < 0)
+        {
+          perror("firmware: write");
+        }
+        txQueue.pop_front();
+      }
+    }
+  }
+}
+
+// Firmware core on the TCP transport: YamahaRX + elmTcpService
+void firmwareTcpThread(int klineFd, int listenFd)
+{
+  int clientFds[ELM_TCP_MAX_CLIENTS];
+  ElmStream streams[ELM_TCP_MAX_CLIENTS];
+  std::fill(clientFds, clientFds + ELM_TCP_MAX_CLIENTS, -1);
+
+  while (running)
+  {
+    pollfd fds[2 + ELM_TCP_MAX_CLIENTS] = {{klineFd, POLLIN, 0}, {listenFd, POLLIN, 0}};
+    for (int i = 0; i < ELM_TCP_MAX_CLIENTS; ++i)
+    {
+      fds[2 + i] = {clientFds[i], POLLIN, 0}; // Negative fds are skipped
+    }
+    poll(fds, 2 + ELM_TCP_MAX_CLIENTS, 1);
+    uint64_t now = nativeNowUs();
+
+    if (fds[0].revents & POLLIN)
+    {
+      uint8_t buffer[64];
+      ssize_t n = read(klineFd, buffer, sizeof(buffer));
+      for (ssize_t i = 0; i < n; ++i)
+      {
+        decodeByte(buffer[i], (uint32_t)now);
+      }
+    }
+
+    if (fds[1].revents & POLLIN)
+    {
+      int fd = accept(listenFd, nullptr, nullptr);
+      int *slot = std::find(clientFds, clientFds + ELM_TCP_MAX_CLIENTS, -1);
+      if (fd >= 0 && slot == clientFds + ELM_TCP_MAX_CLIENTS)
+      {
+        close(fd); // All slots busy, like elmTcpAccept
+      }
+      else if (fd >= 0)
+      {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        *slot = fd;
+        streams[slot - clientFds] = ElmStream();
+      }
+    }
+
+    for (int i = 0; i < ELM_TCP_MAX_CLIENTS; ++i)
+    {
+      if (clientFds[i] < 0)
+      {
+        continue;
+      }
+
+      ElmStream &stream = streams[i];
+      if ((fds[2 + i].revents & (POLLIN | POLLHUP)) && stream.room() > 0)
+      {
+        char buffer[128];
+        ssize_t n = read(clientFds[i], buffer, std::min(sizeof(buffer), stream.room()));
+        if (n <= 0)
+        {
+          close(clientFds[i]);
+          clientFds[i] = -1;
+          continue;
+        }
+        stream.receive(buffer, n);
+      }
+
+      uint32_t before = stream.requests;
+      std::string reply = stream.service((uint32_t)now);
+      elmRequests += stream.requests - before;
+      if (!reply.empty() && write(clientFds[i], reply.data(), reply.size()) < 0)
+      {
+        perror("firmware: write");
+      }
+    }
+  }
+
+  for (int fd : clientFds)
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+  }
+}
+
+int listenLoopback(int port)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || bind(fd, (sockaddr *)&address, sizeof(address)) < 0 || listen(fd, ELM_TCP_MAX_CLIENTS) < 0)
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+struct ClientStats
+{
+  std::vector<uint64_t> latencyUs; // ECU frame on wire -> reply at the app
+  std::vector<uint64_t> rttUs;     // Request -> reply
+  uint64_t fresh = 0;
+  uint64_t duplicates = 0;
+  uint64_t timeouts = 0;
+  uint64_t pidReplies = 0;
+  uint64_t headerReplies = 0;  // "7E8 .." in front, ATH1
+  uint64_t compactReplies = 0; // No spaces, ATS0
+};
+
+// Pull "41 0C A B" out of a reply, headers and spaces optional
+bool parseRpm(const std::string &reply, uint16_t &rpm)
+{
+  std::string hex;
+  for (char c : reply)
+  {
+    if (isxdigit((unsigned char)c))
+    {
+      hex += toupper((unsigned char)c);
+    }
+  }
+
+  size_t pos = hex.find("410C");
+  if (pos == std::string::npos || hex.size() < pos + 8)
+  {
+    return false;
+  }
+  rpm = strtoul(hex.substr(pos + 4, 4).c_str(), nullptr, 16);
+  return true;
+}
+
+// Round trip, and ECU-to-app latency when the reply carries a new frame
+void recordReply(const std::string &reply, uint64_t sentUs, uint64_t now, ClientStats &stats, uint64_t &lastSeq)
+{
+  stats.rttUs.push_back(now - sentUs);
+
+  std::string text = reply.substr(0, reply.find('\r'));
+  if (text.find("41") != std::string::npos)
+  {
+    stats.pidReplies++;
+    stats.headerReplies += text.rfind("7E8", 0) == 0;
+    stats.compactReplies += text.find(' ') == std::string::npos;
+  }
+
+  uint16_t rpm;
+  if (!parseRpm(reply, rpm))
+  {
+    return;
+  }
+
+  FrameStamp stamp;
+  {
+    std::lock_guard<std::mutex> lock(frameMutex);
+    stamp = frameByRpm[(rpm / EcuProfile::RPM_SCALE) & 0xFF];
+  }
+  if (stamp.seq == 0)
+  {
+    return; // Nothing decoded yet
+  }
+  if (stamp.seq > lastSeq)
+  {
+    stats.latencyUs.push_back(now - stamp.sentUs);
+    stats.fresh++;
+    lastSeq = stamp.seq;
+  }
+  else
+  {
+    stats.duplicates++;
+  }
+}
+
+// One command and its reply up to the prompt, false on a timeout
+bool exchange(int fd, const std::string &command, std::string &reply)
+{
+  std::string line = command + "\r";
+  if (write(fd, line.data(), line.size()) < 0)
+  {
+    return false;
+  }
+  reply.clear();
+  while (running && reply.find('>') == std::string::npos)
+  {
+    pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 1000) <= 0)
+    {
+      return false;
+    }
+    char buffer[128];
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n <= 0)
+    {
+      return false;
+    }
+    reply.append(buffer, n);
+  }
+  return true;
+}
+
+// Virtual ELM client: RaceChrono style request/response poll loop
+void clientThread(const std::string &path, const Options &options, ClientStats &stats)
+{
+  int fd = openRawPath(path);
+  if (fd < 0)
+  {
+    fprintf(stderr, "client: cannot open %s\n", path.c_str());
+    return;
+  }
+
+  std::string reply;
+  for (const std::string &command : options.init)
+  {
+    if (!exchange(fd, command, reply))
+    {
+      stats.timeouts++;
+    }
+  }
+
+  uint64_t lastSeq = 0;
+  for (size_t i = 0; running; ++i)
+  {
+    uint64_t sentUs = nativeNowUs();
+    bool answered = exchange(fd, options.rotation[i % options.rotation.size()], reply);
+    if (!running)
+    {
+      break; // Shutting down, the reply may never come
+    }
+    if (!answered)
+    {
+      stats.timeouts++;
+      continue;
+    }
+    recordReply(reply, sentUs, nativeNowUs(), stats, lastSeq);
+  }
+  close(fd);
+}
+
+// Virtual WiFi ELM client: keeps --window requests in flight on one socket
+void clientTcpThread(const Options &options, ClientStats &stats)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(options.tcpPort);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || connect(fd, (sockaddr *)&address, sizeof(address)) < 0)
+  {
+    perror("client: connect");
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return;
+  }
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  std::string reply;
+  for (const std::string &command : options.init)
+  {
+    if (!exchange(fd, command, reply))
+    {
+      stats.timeouts++;
+    }
+  }
+
+  std::deque<uint64_t> inFlight; // Send times, replies come back in order
+  std::string received;
+  uint64_t lastSeq = 0;
+  size_t next = 0;
+  while (running)
+  {
+    std::string burst;
+    while (inFlight.size() < (size_t)options.window)
+    {
+      burst += options.rotation[next++ % options.rotation.size()] + "\r";
+      inFlight.push_back(nativeNowUs());
+    }
+    if (!burst.empty() && write(fd, burst.data(), burst.size()) < 0)
+    {
+      break;
+    }
+
+    pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 1000) <= 0)
+    {
+      stats.timeouts += inFlight.size();
+      inFlight.clear();
+      continue;
+    }
+    char buffer[512];
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n <= 0)
+    {
+      break;
+    }
+    received.append(buffer, n);
+
+    uint64_t now = nativeNowUs();
+    size_t prompt;
+    while ((prompt = received.find('>')) != std::string::npos && !inFlight.empty())
+    {
+      recordReply(received.substr(0, prompt), inFlight.front(), now, stats, lastSeq);
+      inFlight.pop_front();
+      received.erase(0, prompt + 1);
+    }
+  }
+  close(fd);
+}
+
+void printDistribution(const char *name, std::vector<uint64_t> samples)
+{
+  if (samples.empty())
+  {
+    printf("%-22s no samples\n", name);
+    return;
+  }
+
+  std::sort(samples.begin(), samples.end());
+  auto pct = [&](double p) { return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))] / 1000.0; };
+  printf("%-22s n=%zu  min %.2f  p50 %.2f  p90 %.2f  p99 %.2f  max %.2f ms\n", name, samples.size(), samples.front() / 1000.0,
+         pct(0.50), pct(0.90), pct(0.99), samples.back() / 1000.0);
+}
+
+std::vector<std::string> splitRotation(const std::string &list)
+{
+  std::vector<std::string> rotation;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ','))
+  {
+    if (!item.empty())
+    {
+      rotation.push_back(item);
+    }
+  }
+  return rotation;
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    auto next = [&]() { return i + 1 < argc ? std::string(argv[++i]) : std::string(); };
+    if (arg == "--seconds")
+      options.seconds = atoi(next().c_str());
+    else if (arg == "--fps")
+      options.fps = std::max(1, atoi(next().c_str()));
+    else if (arg == "--replay")
+      options.replay = next();
+    else if (arg == "--rotation")
+      options.rotation = splitRotation(next());
+    else if (arg == "--rx-interval")
+      options.rxIntervalMs = atoi(next().c_str());
+    else if (arg == "--tx-interval")
+      options.txIntervalMs = atoi(next().c_str());
+    else if (arg == "--no-client")
+      options.client = false;
+    else if (arg == "--long-poll")
+      options.longPoll = true;
+    else if (arg == "--tcp")
+      options.tcpPort = i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]) ? atoi(next().c_str()) : ELM_TCP_PORT;
+    else if (arg == "--window")
+      options.window = std::max(1, atoi(next().c_str()));
+    else if (arg == "--init")
+      options.init = splitRotation(next());
+    else if (arg == "--no-ecu")
+      options.ecu = false;
+    else if (arg == "--verbose")
+      nativeVerbose = true;
+    else
+    {
+      fprintf(stderr, "usage: %s [--seconds N] [--fps N] [--replay file] [--rotation list] [--rx-interval ms] "
+                      "[--tx-interval ms] [--long-poll] [--tcp [port]] [--window N] [--init list] [--no-client] [--no-ecu] "
+                      "[--verbose]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (options.rotation.empty())
+  {
+    fprintf(stderr, "empty rotation\n");
+    return 1;
+  }
+
+  elmLongPoll.enabled = options.longPoll;
+
+  Pty kline, elm;
+  if (!openRawPty(kline) || !openRawPty(elm))
+  {
+    perror("openpty");
+    return 1;
+  }
+  int listenFd = -1;
+  if (options.tcpPort && (listenFd = listenLoopback(options.tcpPort)) < 0)
+  {
+    perror("listen");
+    return 1;
+  }
+  if (options.tcpPort)
+  {
+    printf("K-line pty: %s\nELM TCP:    127.0.0.1:%d\nProfile:    %s\n", kline.path.c_str(), options.tcpPort,
+           EcuProfile::NAME);
+  }
+  else
+  {
+    printf("K-line pty: %s\nELM pty:    %s\nProfile:    %s\n", kline.path.c_str(), elm.path.c_str(), EcuProfile::NAME);
+  }
+  fflush(stdout);
+
+  ClientStats stats;
+  std::thread firmware = options.tcpPort ? std::thread(firmwareTcpThread, kline.master, listenFd)
+                                         : std::thread(firmwareThread, kline.master, elm.master, std::cref(options));
+  std::thread ecu, client;
+  if (options.ecu)
+  {
+    ecu = std::thread(ecuThread, kline.path, std::cref(options));
+  }
+  if (options.client && options.tcpPort)
+  {
+    client = std::thread(clientTcpThread, std::cref(options), std::ref(stats));
+  }
+  else if (options.client)
+  {
+    client = std::thread(clientThread, elm.path, std::cref(options), std::ref(stats));
+  }
+
+  sleep(options.seconds);
+  running = false;
+  for (std::thread *t : {&ecu, &client, &firmware})
+  {
+    if (t->joinable())
+    {
+      t->join();
+    }
+  }
+
+  printf("\nframes sent %llu, ELM requests %llu, queue drops %llu, fresh %llu, duplicates %llu, timeouts %llu\n",
+         (unsigned long long)framesSent.load(), (unsigned long long)elmRequests.load(),
+         (unsigned long long)elmQueueDrops.load(), (unsigned long long)stats.fresh,
+         (unsigned long long)stats.duplicates, (unsigned long long)stats.timeouts);
+  if (!options.init.empty())
+  {
+    printf("ELM settings, %llu PID replies: %llu with a CAN header, %llu without spaces\n",
+           (unsigned long long)stats.pidReplies, (unsigned long long)stats.headerReplies,
+           (unsigned long long)stats.compactReplies);
+  }
+  printDistribution("ECU -> app latency", stats.latencyUs);
+  printDistribution("request round trip", stats.rttUs);
+  if (options.longPoll)
+  {
+    printf("long-poll held %u, fresh %u, timed out %u, frame period %u us\n", elmLongPoll.held, elmLongPoll.fresh,
+           elmLongPoll.expired, ecuFramePeriodUs);
+  }
+  return 0;
+}
@@ -0,0 +1,548 @@
+// log_convert - session logs from the logger to CSV and columnar files
+//
+// Inputs are LOG<n>.BIN files copied off SPIFFS, or USB logs of
+// "LOG DUMP <n>", as many as given so a season converts in one run. Each is
+// streamed a block at a time: blocks outside --from/--to are skipped by their
+// header and columns of unselected channels are skipped by their length,
+// neither is decoded. Varints are expanded eight at a time while the bytes
+// have no continuation bit (the common case, most deltas are 0 or +-1),
+// then zigzag and the running sums are undone in plain loops the compiler
+// vectorises. CSV numbers are formatted without printf.
+//
+// Outputs, next to the input or in -d <dir>:
+//   <name>.csv  header row then one row per frame, time in seconds from the
+//               start of the session, for RaceChrono's CSV import or a
+//               spreadsheet
+//   <name>.col  columnar, for plotting: a 32 byte header ("KCOL", uint16
+//               version, uint16 channels, uint64 records, uint32 session,
+//               char profile[12]), channels x char name[12], then one array
+//               of records little endian int32 per channel in that order.
+//               Time is in ms. numpy: np.fromfile(f, '<i4', offset=32 + 12 * channels)
+//               .reshape(channels, records)
+//
+// A log cut short by a reset ends in a partial block, it is read up to there.
+//
+// Build: g++ -std=c++17 -O2 -Iyamaha/include tools/log_convert.cpp -o log_convert
+// Usage: log_convert [--csv] [--col] [-d dir] [--channels rpm,speed,...] [--from s] [--to s]
+//                    LOG<n>.BIN|dump.log ...
+
+#include "appprofiles.h"
+#include "hexdump.h"
+#include <sessionlog.h>
+
+#include <chrono>
+#include <algorithm>
+
+struct Options
+{
+  bool csv = false;
+  bool col = false;
+  std::string directory; // Empty = next to the input
+  std::string channels;  // Comma separated, empty = all
+  double fromS = 0;
+  double toS = 1e12;
+};
+
+struct ConvertStats
+{
+  uint64_t records = 0;
+  uint64_t blocks = 0;
+  uint64_t skippedBlocks = 0; // Outside the time range
+  uint64_t inputBytes = 0;
+};
+
+// Log bytes from a file on disk or a dump parsed into memory
+struct LogSource
+{
+  FILE *file = nullptr;
+  std::string image;
+  size_t pos = 0;
+
+  ~LogSource()
+  {
+    if (file)
+    {
+      fclose(file);
+    }
+  }
+
+  bool read(void *out, size_t length)
+  {
+    if (file)
+    {
+      return fread(out, 1, length, file) == length;
+    }
+    if (pos + length > image.size())
+    {
+      return false;
+    }
+    memcpy(out, image.data() + pos, length);
+    pos += length;
+    return true;
+  }
+
+  void skip(size_t length)
+  {
+    if (file)
+    {
+      fseek(file, (long)length, SEEK_CUR);
+    }
+    else
+    {
+      pos += length;
+    }
+  }
+
+  size_t tell() const
+  {
+    return file ? (size_t)ftell(file) : pos;
+  }
+
+  void seek(size_t offset)
+  {
+    if (file)
+    {
+      fseek(file, (long)offset, SEEK_SET);
+    }
+    else
+    {
+      pos = offset;
+    }
+  }
+};
+
+// Varints to zigzag values, eight single byte varints at a time
+size_t expandVarints(const uint8_t *in, size_t length, uint32_t *out, size_t count)
+{
+  size_t used = 0, n = 0;
+  while (n < count)
+  {
+    if (n + 8 <= count && used + 8 <= length)
+    {
+      uint64_t word;
+      memcpy(&word, in + used, sizeof(word));
+      if ((word & 0x8080808080808080ULL) == 0)
+      {
+        for (int i = 0; i < 8; ++i)
+        {
+          out[n + i] = (uint8_t)(word >> (8 * i));
+        }
+        n += 8;
+        used += 8;
+        continue;
+      }
+    }
+    uint32_t value;
+    size_t bytes = getVarint(in + used, length - used, value);
+    if (bytes == 0)
+    {
+      break;
+    }
+    out[n++] = value;
+    used += bytes;
+  }
+  return n;
+}
+
+// One column back to values, same result as logDecodeColumn
+size_t decodeColumn(const uint8_t *in, size_t length, uint8_t order, int32_t *out, size_t count)
+{
+  uint32_t coded[LOG_BLOCK_RECORDS];
+  count = expandVarints(in, length, coded, std::min<size_t>(count, LOG_BLOCK_RECORDS));
+  for (size_t i = 0; i < count; ++i)
+  {
+    out[i] = unzigzag(coded[i]);
+  }
+  for (uint8_t pass = 0; pass < order; ++pass)
+  {
+    for (size_t i = 1; i < count; ++i)
+    {
+      out[i] += out[i - 1];
+    }
+  }
+  return count;
+}
+
+// File header with any channel count, the block header follows it
+struct LogInfo
+{
+  LogFileHeader header;
+  std::vector<LogChannelInfo> channels;
+  size_t dataOffset = 0;
+};
+
+const size_t LOG_HEADER_FIXED = offsetof(LogFileHeader, channel);
+const size_t LOG_BLOCK_FIXED = offsetof(LogBlockHeader, columnBytes);
+
+bool readInfo(LogSource &source, LogInfo &info)
+{
+  if (!source.read(&info.header, LOG_HEADER_FIXED) || info.header.magic != LOG_MAGIC)
+  {
+    return false;
+  }
+  if (info.header.version != LOG_VERSION || info.header.blockRecords > LOG_BLOCK_RECORDS)
+  {
+    fprintf(stderr, "unsupported log version %u, %u records a block\n", info.header.version,
+            info.header.blockRecords);
+    return false;
+  }
+  info.channels.resize(info.header.channels);
+  if (!source.read(info.channels.data(), info.channels.size() * sizeof(LogChannelInfo)))
+  {
+    return false;
+  }
+  info.dataOffset = source.tell();
+  return true;
+}
+
+// A block header, false at the end of the log or a partial block
+bool readBlock(LogSource &source, const LogInfo &info, LogBlockHeader &block, std::vector<uint16_t> &columnBytes)
+{
+  columnBytes.resize(info.channels.size());
+  return source.read(&block, LOG_BLOCK_FIXED) && block.magic == LOG_BLOCK_MAGIC &&
+         block.records <= info.header.blockRecords &&
+         source.read(columnBytes.data(), columnBytes.size() * sizeof(uint16_t));
+}
+
+size_t payloadBytes(const std::vector<uint16_t> &columnBytes)
+{
+  size_t total = 0;
+  for (uint16_t length : columnBytes)
+  {
+    total += length;
+  }
+  return total;
+}
+
+// Decodes the wanted columns of one block, the others are skipped
+bool readColumns(LogSource &source, const LogInfo &info, const LogBlockHeader &block,
+                 const std::vector<uint16_t> &columnBytes, const std::vector<bool> &wanted,
+                 std::vector<std::vector<int32_t>> &values)
+{
+  uint8_t bytes[LOG_BLOCK_RECORDS * LOG_VARINT_MAX];
+  for (size_t c = 0; c < info.channels.size(); ++c)
+  {
+    if (!wanted[c])
+    {
+      source.skip(columnBytes[c]);
+      continue;
+    }
+    values[c].resize(block.records);
+    if (columnBytes[c] > sizeof(bytes) || !source.read(bytes, columnBytes[c]) ||
+        decodeColumn(bytes, columnBytes[c], info.channels[c].order, values[c].data(), block.records) !=
+            block.records)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Decimal digits without printf, CSV output is most of the run time
+char *putInt(char *out, int64_t value)
+{
+  char digits[20];
+  uint64_t magnitude = value < 0 ? -(uint64_t)value : value;
+  int n = 0;
+  do
+  {
+    digits[n++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  if (value < 0)
+  {
+    *out++ = '-';
+  }
+  while (n)
+  {
+    *out++ = digits[--n];
+  }
+  return out;
+}
+
+// ms as seconds with three decimals
+char *putSeconds(char *out, int32_t ms)
+{
+  if (ms < 0)
+  {
+    *out++ = '-';
+    ms = -ms;
+  }
+  out = putInt(out, ms / 1000);
+  *out++ = '.';
+  *out++ = '0' + ms / 100 % 10;
+  *out++ = '0' + ms / 10 % 10;
+  *out++ = '0' + ms % 10;
+  return out;
+}
+
+std::string channelName(const LogChannelInfo &channel)
+{
+  return std::string(channel.name, strnlen(channel.name, sizeof(channel.name)));
+}
+
+// "LOG12.BIN" -> "LOG12", in the output directory when one is given
+std::string outputStem(const std::string &input, const Options &options)
+{
+  size_t slash = input.find_last_of('/');
+  std::string name = slash == std::string::npos ? input : input.substr(slash + 1);
+  std::string stem = name.substr(0, name.find_last_of('.'));
+  if (options.directory.empty())
+  {
+    return slash == std::string::npos ? stem : input.substr(0, slash + 1) + stem;
+  }
+  return options.directory + "/" + stem;
+}
+
+bool convert(const std::string &input, const Options &options, ConvertStats &total)
+{
+  LogSource source;
+  LogInfo info;
+  source.file = fopen(input.c_str(), "rb");
+  if (!source.file)
+  {
+    fprintf(stderr, "cannot read %s\n", input.c_str());
+    return false;
+  }
+  if (!readInfo(source, info))
+  {
+    // Not a log file, maybe a USB log of LOG DUMP
+    fclose(source.file);
+    source.file = nullptr;
+    std::string text;
+    if (!readFile(input, text) || !parseHexDump(text, "LOG", source.image) || !readInfo(source, info))
+    {
+      fprintf(stderr, "%s is neither a session log nor a LOG DUMP log\n", input.c_str());
+      return false;
+    }
+  }
+
+  // Time is always written, then the selected channels in log order
+  std::vector<bool> wanted(info.channels.size(), options.channels.empty());
+  wanted[LOG_TIME] = true;
+  std::string list = "," + options.channels + ",";
+  for (size_t c = 0; c < info.channels.size(); ++c)
+  {
+    if (list.find("," + channelName(info.channels[c]) + ",") != std::string::npos)
+    {
+      wanted[c] = true;
+    }
+  }
+  std::vector<size_t> selected;
+  for (size_t c = 0; c < info.channels.size(); ++c)
+  {
+    if (wanted[c])
+    {
+      selected.push_back(c);
+    }
+  }
+
+  int64_t fromMs = (int64_t)(options.fromS * 1000), toMs = (int64_t)(options.toS * 1000);
+  auto blockInRange = [&](const LogBlockHeader &block) {
+    return (int64_t)block.lastMs >= fromMs && (int64_t)block.firstMs <= toMs;
+  };
+  auto recordInRange = [&](int32_t timeMs) { return timeMs >= fromMs && timeMs <= toMs; };
+
+  LogBlockHeader block;
+  std::vector<uint16_t> columnBytes;
+  std::vector<std::vector<int32_t>> values(info.channels.size());
+
+  // The columnar file places each channel by the record count, count first
+  // from the block headers, decoding only time columns at the range edges
+  uint64_t records = 0;
+  if (options.col)
+  {
+    std::vector<bool> timeOnly(info.channels.size(), false);
+    timeOnly[LOG_TIME] = true;
+    while (readBlock(source, info, block, columnBytes))
+    {
+      if (!blockInRange(block))
+      {
+        source.skip(payloadBytes(columnBytes));
+      }
+      else if ((int64_t)block.firstMs >= fromMs && (int64_t)block.lastMs <= toMs)
+      {
+        records += block.records;
+        source.skip(payloadBytes(columnBytes));
+      }
+      else
+      {
+        if (!readColumns(source, info, block, columnBytes, timeOnly, values))
+        {
+          break;
+        }
+        records += std::count_if(values[LOG_TIME].begin(), values[LOG_TIME].end(), recordInRange);
+      }
+    }
+    source.seek(info.dataOffset);
+  }
+
+  std::string stem = outputStem(input, options);
+  FILE *csv = options.csv ? fopen((stem + ".csv").c_str(), "w") : nullptr;
+  FILE *col = options.col ? fopen((stem + ".col").c_str(), "wb") : nullptr;
+  if ((options.csv && !csv) || (options.col && !col))
+  {
+    perror(stem.c_str());
+    return false;
+  }
+
+  if (csv)
+  {
+    std::string header;
+    for (size_t c : selected)
+    {
+      header += (header.empty() ? "" : ",") + channelName(info.channels[c]);
+    }
+    fprintf(csv, "%s\n", header.c_str());
+  }
+  size_t colData = 32 + 12 * selected.size();
+  if (col)
+  {
+    uint16_t version = 1, channels = (uint16_t)selected.size();
+    fwrite("KCOL", 1, 4, col);
+    fwrite(&version, sizeof(version), 1, col);
+    fwrite(&channels, sizeof(channels), 1, col);
+    fwrite(&records, sizeof(records), 1, col);
+    fwrite(&info.header.session, sizeof(info.header.session), 1, col);
+    fwrite(info.header.profile, 1, sizeof(info.header.profile), col);
+    for (size_t c : selected)
+    {
+      char name[12] = {};
+      memcpy(name, info.channels[c].name, sizeof(info.channels[c].name));
+      fwrite(name, 1, sizeof(name), col);
+    }
+  }
+
+  ConvertStats stats;
+  uint64_t written = 0;
+  std::vector<char> text(LOG_BLOCK_RECORDS * 12 * (selected.size() + 1));
+  while (readBlock(source, info, block, columnBytes))
+  {
+    stats.blocks++;
+    if (!blockInRange(block))
+    {
+      stats.skippedBlocks++;
+      source.skip(payloadBytes(columnBytes));
+      continue;
+    }
+    if (!readColumns(source, info, block, columnBytes, wanted, values))
+    {
+      fprintf(stderr, "%s: block %llu is cut short\n", input.c_str(), (unsigned long long)stats.blocks);
+      break;
+    }
+
+    // Records of this block inside the range, a run since time only grows
+    const std::vector<int32_t> &time = values[LOG_TIME];
+    size_t first = std::lower_bound(time.begin(), time.end(), (int32_t)std::max<int64_t>(fromMs, INT32_MIN)) -
+                   time.begin();
+    size_t last = std::upper_bound(time.begin(), time.end(), (int32_t)std::min<int64_t>(toMs, INT32_MAX)) -
+                  time.begin();
+    if (first >= last)
+    {
+      continue;
+    }
+
+    if (csv)
+    {
+      char *out = text.data();
+      for (size_t i = first; i < last; ++i)
+      {
+        out = putSeconds(out, time[i]);
+        for (size_t s = 1; s < selected.size(); ++s)
+        {
+          *out++ = ',';
+          out = putInt(out, values[selected[s]][i]);
+        }
+        *out++ = '\n';
+      }
+      fwrite(text.data(), 1, out - text.data(), csv);
+    }
+    if (col)
+    {
+      for (size_t s = 0; s < selected.size(); ++s)
+      {
+        fseek(col, (long)(colData + (s * records + written) * sizeof(int32_t)), SEEK_SET);
+        fwrite(values[selected[s]].data() + first, sizeof(int32_t), last - first, col);
+      }
+    }
+    written += last - first;
+  }
+  stats.records = written;
+  stats.inputBytes = source.file ? source.tell() : source.image.size();
+
+  if (csv)
+  {
+    fclose(csv);
+  }
+  if (col)
+  {
+    fclose(col);
+  }
+
+  char profile[sizeof(info.header.profile) + 1] = {};
+  memcpy(profile, info.header.profile, sizeof(info.header.profile));
+  fprintf(stderr, "%s: session %u %s, %llu records from %llu blocks (%llu outside the range) -> %s%s%s\n",
+          input.c_str(), info.header.session, profile, (unsigned long long)stats.records,
+          (unsigned long long)stats.blocks, (unsigned long long)stats.skippedBlocks, stem.c_str(),
+          csv ? ".csv" : "", col ? (csv ? " .col" : ".col") : "");
+  total.records += stats.records;
+  total.blocks += stats.blocks;
+  total.skippedBlocks += stats.skippedBlocks;
+  total.inputBytes += stats.inputBytes;
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+  std::vector<std::string> inputs;
+  bool usage = false;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    auto next = [&]() { return i + 1 < argc ? std::string(argv[++i]) : std::string(); };
+    if (arg == "--csv")
+      options.csv = true;
+    else if (arg == "--col")
+      options.col = true;
+    else if (arg == "-d")
+      options.directory = next();
+    else if (arg == "--channels")
+      options.channels = next();
+    else if (arg == "--from")
+      options.fromS = atof(next().c_str());
+    else if (arg == "--to")
+      options.toS = atof(next().c_str());
+    else if (arg[0] != '-')
+      inputs.push_back(arg);
+    else
+      usage = true;
+  }
+  if (usage || inputs.empty())
+  {
+    fprintf(stderr, "usage: %s [--csv] [--col] [-d dir] [--channels rpm,speed,...] [--from s] [--to s] "
+                    "LOG<n>.BIN|dump.log ...\n", argv[0]);
+    return 1;
+  }
+  if (!options.csv && !options.col)
+  {
+    options.csv = true;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  ConvertStats total;
+  int failed = 0;
+  for (const std::string &input : inputs)
+  {
+    failed += !convert(input, options, total);
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (inputs.size() > 1)
+  {
+    fprintf(stderr, "%zu logs, %llu records, %.1f MB in %.2f s (%.0f MB/s)%s\n", inputs.size() - failed,
+            (unsigned long long)total.records, total.inputBytes / 1e6, seconds,
+            seconds > 0 ? total.inputBytes / 1e6 / seconds : 0.0,
+            failed ? (", " + std::to_string(failed) + " failed").c_str() : "");
+  }
+  return failed ? 1 : 0;
+}
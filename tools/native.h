@@ -0,0 +1,35 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+// Native host build of the firmware core
+//
+// Pulls in the Arduino-free firmware headers (decoder, PID decode, ELM command
+// engine and session shaping) and supplies the few symbols the firmware gets
+// from main.cpp. Include this from exactly one translation unit per tool.
+
+#include <ecudata.h>
+#include <elm327command.h>
+#include <elmsession.h>
+
+// Console output from the firmware core, off unless a tool asks for it
+bool nativeVerbose = false;
+bool Debug_YAM = false; // No per-frame trace events
+
+void sendResponse(const std::string &message)
+{
+  if (nativeVerbose)
+  {
+    fprintf(stderr, "[fw] %s\n", message.c_str());
+  }
+}
+
+// Monotonic microseconds, the host stand-in for esp_timer_get_time()
+inline uint64_t nativeNowUs()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
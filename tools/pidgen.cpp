@@ -0,0 +1,259 @@
+// pidgen - app profiles from the PID registry
+//
+// Writes the RealDash XML, the Torque PID export and the RaceChrono .rcz from
+// yamaha/include/pidregistry.h, with poll rates taken from each PID's update
+// interval. A RealDash rotation pass is not one ECU frame: every request in it
+// costs a BLE round trip, so the pass length is the round trip times the
+// requests per pass, and every skipCount is the PID's update interval over
+// that pass. Values that change faster than a pass are polled every pass. The
+// round trip defaults to what elm_loadgen reports for a prompt-paced client at
+// the 30 ms Android connection interval; pass a measured one with
+// --round-trip. Run from the repo root after changing the registry, the
+// default paths overwrite the shipped profiles.
+//
+// Build: g++ -std=c++17 -O2 -Iyamaha/include tools/pidgen.cpp -o pidgen -lz
+// Usage: pidgen [--realdash file] [--torque file] [--racechrono file] [--round-trip ms] [--list]
+
+#include "native.h"
+#include "appprofiles.h"
+
+#include <algorithm>
+#include <cmath>
+
+struct Options
+{
+  std::string realdash = "realdash/Realdashv1.xml";
+  std::string torque = "TorqueBHPexportedPIDsv2.csv";
+  std::string racechrono = "RaceChrono/Yam_racechrono.rcz";
+  bool list = false;
+};
+
+double roundTripMs = 60; // One request to its reply, elm_loadgen window 1
+double passMs = 0;       // One RealDash rotation pass, see rotationPassMs()
+
+// Fastest update interval in the registry, one rotation pass
+uint16_t fastestMs()
+{
+  uint16_t fastest = UINT16_MAX;
+  for (const PidInfo &pid : pidRegistry)
+  {
+    fastest = std::min(fastest, pid.updateMs);
+  }
+  return fastest;
+}
+
+// Passes to skip so a PID is polled about once per update
+int skipCount(const PidInfo &pid, double pass)
+{
+  return std::max(1, (int)std::lround(pid.updateMs / pass));
+}
+
+int skipCount(const PidInfo &pid)
+{
+  return skipCount(pid, passMs);
+}
+
+// Round trips one pass takes with the skip counts for that pass length
+double passRequestsMs(double pass)
+{
+  double requests = 0;
+  for (const PidInfo &pid : pidRegistry)
+  {
+    requests += 1.0 / skipCount(pid, pass);
+  }
+  return roundTripMs * requests;
+}
+
+// The pass length depends on the skip counts and they depend on it. The
+// requests per pass only fall as the pass grows, so the shortest pass that
+// fits its own requests is the one the rotation settles at
+double rotationPassMs()
+{
+  double pass = roundTripMs;
+  while (passRequestsMs(pass) > pass)
+  {
+    pass += 1;
+  }
+  return pass;
+}
+
+std::string command(const PidInfo &pid)
+{
+  char text[8];
+  snprintf(text, sizeof(text), "%04X", pid.id);
+  return text;
+}
+
+bool writeFile(const std::string &path, const std::string &data)
+{
+  FILE *file = fopen(path.c_str(), "wb");
+  if (!file)
+  {
+    fprintf(stderr, "cannot write %s\n", path.c_str());
+    return false;
+  }
+  fwrite(data.data(), 1, data.size(), file);
+  fclose(file);
+  printf("wrote %s\n", path.c_str());
+  return true;
+}
+
+std::string realDashUnits(const PidInfo &pid)
+{
+  std::string units = pid.units;
+  if (units == "km/h")
+    return "kmh";
+  if (units == "s")
+    return "Secs";
+  if (units == "rpm")
+    return "";
+  return units;
+}
+
+bool writeRealDash(const std::string &path)
+{
+  static const char *init[] = {"atd", "atz", "atat1", "atst62", "atsp0", "ate0", "atl0",
+                               "ats0", "ath1", "atdpn", "0100", "0120", "0100", "0120"};
+
+  std::string xml = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n<OBD2>\r\n  <init>\r\n"
+                    "    <!-- Initialization commands -->\r\n";
+  for (const char *send : init)
+  {
+    xml += std::string("    <command send=\"") + send + "\"></command>\r\n";
+  }
+  xml += "  </init>\r\n  \r\n  <!-- Rotation for raw value PIDs, generated by tools/pidgen from pidregistry.h -->\r\n"
+         "  <rotation>\r\n";
+
+  for (const PidInfo &pid : pidRegistry)
+  {
+    // No built-in RealDash input, a custom channel keeps it off other gauges
+    char target[64];
+    if (pid.realDashTarget)
+    {
+      snprintf(target, sizeof(target), "targetId=\"%u\"", pid.realDashTarget);
+    }
+    else
+    {
+      snprintf(target, sizeof(target), "name=\"Yamaha %s\"", pid.name);
+    }
+    char line[256];
+    std::string units = realDashUnits(pid);
+    snprintf(line, sizeof(line), "    <command send=\"%s\" skipCount=\"%d\" %s%s></command> "
+                                 "<!-- %s (PID %s), changes every %u ms -->\r\n",
+             command(pid).c_str(), skipCount(pid), target,
+             units.empty() ? "" : (" units=\"" + units + "\"").c_str(), pid.name, command(pid).c_str(), pid.updateMs);
+    xml += line;
+  }
+  xml += "  </rotation>\r\n</OBD2>\r\n";
+  return writeFile(path, xml);
+}
+
+bool writeTorque(const std::string &path)
+{
+  std::string csv = "\"Name\", \"ShortName\", \"ModeAndPID\", \"Equation\", \"Min Value\", \"Max Value\", \"Units\", "
+                    "\"Header\", \"startDiagnostic\", \"stopDiagnostic\", \"scale\",\"minimumRefreshDelayMillis\"\n";
+  for (const PidInfo &pid : pidRegistry)
+  {
+    // Torque polls as fast as it can, hold back everything slower than a pass
+    unsigned refresh = pid.updateMs > fastestMs() ? pid.updateMs : 0;
+    char line[256];
+    snprintf(line, sizeof(line), "\"%s\",\"%s\",\"0x%04x\",\"%s\",%ld,%ld,\"%s\",\"\",\"\",\"\",1,%u\n", pid.name,
+             pid.shortName, pid.id, pid.bytes == 2 ? "int16(a:b)" : "a", (long)pid.min, (long)pid.max, pid.units,
+             refresh);
+    csv += line;
+  }
+  return writeFile(path, csv);
+}
+
+std::string raceChronoEquation(const PidInfo &pid)
+{
+  if (std::string(pid.units) == "km/h")
+    return "a / 3.6"; // RaceChrono wants m/s
+  return pid.bytes == 2 ? "raw" : "a";
+}
+
+bool writeRaceChrono(const std::string &path)
+{
+  // Priority 1 polls every channel, priority 2 adds the fast ones again
+  std::string all, fast, custom;
+  for (const PidInfo &pid : pidRegistry)
+  {
+    if (!pid.raceChronoChannel)
+    {
+      continue;
+    }
+    std::string id = std::to_string(pid.raceChronoChannel);
+    all += (all.empty() ? "" : ",") + id;
+    if (pid.updateMs <= PID_SPEED_MS)
+    {
+      fast += (fast.empty() ? "" : ",") + id;
+    }
+    custom += std::string(custom.empty() ? "" : ",") + "{\"deviceType\":5,\"channelId\":" + id +
+              ",\"pid\":" + std::to_string(pid.id) + ",\"equation\":\"" + raceChronoEquation(pid) +
+              "\",\"obdHeader\":0}";
+  }
+
+  std::string json = "{\"localUuid\":\"d1ee0e17ad91a44d827da325e905c8654639f50b1a967a1f7838728ca2afccce\","
+                     "\"selectedChannels\":[{\"deviceType\":5,\"priority\":1,\"channelIds\":[" + all + "]},"
+                     "{\"deviceType\":5,\"priority\":2,\"channelIds\":[" + fast + "]}],"
+                     "\"customChannels\":[" + custom + "],"
+                     "\"info\":[{\"infoId\":8,\"value\":\"motorcycle\"}],"
+                     "\"obdProtocol\":6,\"obdDefaultHeader\":0,\"obdNonStandard\":false}";
+  return writeFile(path, zipStore("vehicleProfile.json", json));
+}
+
+void listRegistry()
+{
+  static const char *sources[] = {"K-line", "derived", "MCU"};
+  printf("RealDash pass %.0f ms at a %.0f ms round trip\n", passMs, roundTripMs);
+  printf("%-6s %-18s %-8s %-6s %5s %8s %6s\n", "PID", "name", "source", "units", "bytes", "every ms", "skip");
+  for (const PidInfo &pid : pidRegistry)
+  {
+    printf("%-6s %-18s %-8s %-6s %5u %8u %6d\n", command(pid).c_str(), pid.name, sources[pid.source], pid.units,
+           pid.bytes, pid.updateMs, skipCount(pid));
+  }
+  for (unsigned base = 0; base < 0x100; base += 0x20)
+  {
+    char request[8];
+    snprintf(request, sizeof(request), "01%02X", base);
+    printf("%s -> %s\n", request, handleCommand(request).c_str());
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    auto next = [&]() { return i + 1 < argc ? std::string(argv[++i]) : std::string(); };
+    if (arg == "--realdash")
+      options.realdash = next();
+    else if (arg == "--torque")
+      options.torque = next();
+    else if (arg == "--racechrono")
+      options.racechrono = next();
+    else if (arg == "--round-trip")
+      roundTripMs = std::max(1.0, atof(next().c_str()));
+    else if (arg == "--list")
+      options.list = true;
+    else
+    {
+      fprintf(stderr, "usage: %s [--realdash file] [--torque file] [--racechrono file] [--round-trip ms] [--list]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  passMs = rotationPassMs();
+  if (options.list)
+  {
+    listRegistry();
+    return 0;
+  }
+
+  bool ok = writeRealDash(options.realdash);
+  ok &= writeTorque(options.torque);
+  ok &= writeRaceChrono(options.racechrono);
+  return ok ? 0 : 1;
+}
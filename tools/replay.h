@@ -0,0 +1,99 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <kline.h>
+
+// K-line replay format
+//
+// Plain text, one byte per line: "<time_us> <hex byte> [R|T]". Lines starting
+// with '#' are comments, the first one is "# kline replay v1". Time is
+// relative to the start of the capture, direction defaults to R (ECU -> logger).
+// Written by sigrok_import and sniff_convert, played by kline_rig --replay.
+
+struct ReplayByte
+{
+  uint64_t timeUs;
+  uint8_t value;
+  char direction;
+};
+
+inline bool replayLoad(const std::string &path, std::vector<ReplayByte> &bytes)
+{
+  FILE *file = fopen(path.c_str(), "r");
+  if (!file)
+  {
+    return false;
+  }
+
+  char line[128];
+  while (fgets(line, sizeof(line), file))
+  {
+    if (line[0] == '#' || line[0] == '\n')
+    {
+      continue;
+    }
+
+    unsigned long long timeUs;
+    unsigned value;
+    char direction = 'R';
+    if (sscanf(line, "%llu %x %c", &timeUs, &value, &direction) >= 2)
+    {
+      bytes.push_back({timeUs, (uint8_t)value, direction});
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+inline void replayWriteHeader(FILE *file, const char *source)
+{
+  fprintf(file, "# kline replay v1\n# source: %s\n", source);
+}
+
+inline void replayWrite(FILE *file, const ReplayByte &b)
+{
+  fprintf(file, "%llu %02x %c\n", (unsigned long long)b.timeUs, b.value, b.direction);
+}
+
+// Runs a replay through the native decoder, prints frames and start events
+inline void replaySummary(const std::vector<ReplayByte> &bytes)
+{
+  KLineDecoder<EcuProfile> decoder;
+  uint64_t frames = 0, immo = 0, normal = 0, diag = 0, locked = 0;
+  uint64_t firstFrameUs = 0, lastFrameUs = 0;
+  for (const ReplayByte &b : bytes)
+  {
+    if (b.direction != 'R')
+    {
+      continue;
+    }
+    switch (decoder.feed(b.value, (uint32_t)b.timeUs))
+    {
+    case KLineDecoder<EcuProfile>::IMMO_START:
+      immo++;
+      break;
+    case KLineDecoder<EcuProfile>::NORMAL_START:
+      normal++;
+      break;
+    case KLineDecoder<EcuProfile>::DIAG_START:
+      diag++;
+      break;
+    case KLineDecoder<EcuProfile>::LOCKED:
+      locked++;
+      [[fallthrough]];
+    case KLineDecoder<EcuProfile>::FRAME:
+      firstFrameUs = frames++ ? firstFrameUs : b.timeUs;
+      lastFrameUs = b.timeUs;
+      break;
+    default:
+      break;
+    }
+  }
+  double seconds = (lastFrameUs - firstFrameUs) / 1e6;
+  fprintf(stderr, "decoder: %llu frames (%.1f/s), IMMO starts %llu, normal %llu, diag %llu, mid-stream locks %llu\n",
+          (unsigned long long)frames, seconds > 0 ? (frames - 1) / seconds : 0.0, (unsigned long long)immo,
+          (unsigned long long)normal, (unsigned long long)diag, (unsigned long long)locked);
+}
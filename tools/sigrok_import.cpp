@@ -0,0 +1,416 @@
+// sigrok_import - logic analyser captures of the K-line to the replay format
+//
+// Two inputs:
+//   sigrok session (.sr)  raw logic samples, one channel is decoded with a
+//                         software UART at the profile baud (8N1, idle high)
+//   UART decoder export   text from sigrok-cli or PulseView, one decoded byte
+//                         per line with its start sample or start time, e.g.
+//                         "sigrok-cli -i cap.sr -P uart:rx=D0:baudrate=16040
+//                          -A uart=rx-data --protocol-decoder-samplenum"
+//                         gives "123456-123789 uart-1: 3E"
+//
+// Replay times are the end of each byte's stop bit relative to the start of
+// the capture, the moment the firmware's UART callback would timestamp it.
+// The result is fed through the native decoder and a summary printed, so a
+// bench capture can go straight into kline_rig --replay as a regression or
+// throughput test.
+//
+// Build: g++ -std=c++17 -O2 -Iyamaha/include tools/sigrok_import.cpp -o sigrok_import -lz
+// Usage: sigrok_import capture.sr|export.txt [-o out.replay] [--channel D0|N] [--baud N]
+//                      [--samplerate Hz] [--invert]
+
+#include "native.h"
+#include "appprofiles.h"
+#include "replay.h"
+
+#include <ctype.h>
+#include <algorithm>
+#include <cmath>
+
+struct Options
+{
+  std::string input;
+  std::string output; // Empty = stdout
+  std::string channel = "0";
+  double baud = EcuProfile::BAUD;
+  double samplerate = 0; // Text exports with sample numbers need it
+  bool invert = false;   // Probed behind an inverting transceiver
+};
+
+struct ImportStats
+{
+  uint64_t framingErrors = 0; // Stop bit low
+  uint64_t glitches = 0;      // Start bit gone by its middle
+};
+
+// "1 MHz", "500 kHz", "24000000"
+double parseRate(const std::string &text)
+{
+  char *end = nullptr;
+  double value = strtod(text.c_str(), &end);
+  while (end && *end == ' ')
+  {
+    end++;
+  }
+  switch (end ? tolower((unsigned char)*end) : 0)
+  {
+  case 'k':
+    return value * 1e3;
+  case 'm':
+    return value * 1e6;
+  case 'g':
+    return value * 1e9;
+  default:
+    return value;
+  }
+}
+
+// Software UART, fed one sample at a time across all chunks of a capture
+struct SoftUart
+{
+  double samplesPerBit;
+  double samplerate;
+  std::vector<ReplayByte> &bytes;
+  ImportStats &stats;
+
+  bool last = false;
+  bool seenIdle = false; // A frame only starts after the line was high
+  bool inFrame = false;
+  uint64_t startSample = 0;
+  int bit = 0; // 0 = start bit, 1-8 data, 9 stop
+  double nextCentre = 0;
+  uint8_t value = 0;
+
+  SoftUart(double samplerate, double baud, std::vector<ReplayByte> &bytes, ImportStats &stats)
+      : samplesPerBit(samplerate / baud), samplerate(samplerate), bytes(bytes), stats(stats)
+  {
+  }
+
+  void sample(uint64_t index, bool level)
+  {
+    if (!inFrame)
+    {
+      if (level)
+      {
+        seenIdle = true;
+      }
+      else if (last && seenIdle)
+      {
+        // Falling edge, the start bit
+        inFrame = true;
+        startSample = index;
+        bit = 0;
+        value = 0;
+        nextCentre = index + samplesPerBit / 2;
+      }
+      last = level;
+      return;
+    }
+    last = level;
+
+    if (index < (uint64_t)nextCentre)
+    {
+      return;
+    }
+
+    if (bit == 0 && level)
+    {
+      stats.glitches++;
+      inFrame = false;
+      return;
+    }
+    if (bit >= 1 && bit <= 8)
+    {
+      value |= (uint8_t)level << (bit - 1);
+    }
+    if (bit == 9)
+    {
+      inFrame = false;
+      seenIdle = level;
+      if (!level)
+      {
+        stats.framingErrors++;
+        return;
+      }
+      double endSample = startSample + 10 * samplesPerBit;
+      bytes.push_back({(uint64_t)llround(endSample * 1e6 / samplerate), value, 'R'});
+      return;
+    }
+    bit++;
+    nextCentre = startSample + (bit + 0.5) * samplesPerBit;
+  }
+};
+
+// Trailing chunk number of "logic-1-12"
+long chunkNumber(const std::string &name)
+{
+  size_t dash = name.rfind('-');
+  return dash == std::string::npos ? 0 : atol(name.c_str() + dash + 1);
+}
+
+bool importSession(const std::string &zip, const Options &options, std::vector<ReplayByte> &bytes,
+                   ImportStats &stats)
+{
+  std::string metadata;
+  if (!zipExtract(zip, "metadata", metadata))
+  {
+    fprintf(stderr, "no metadata in the session file\n");
+    return false;
+  }
+
+  // [device 1] of the metadata ini, probes are numbered from 1
+  std::string captureFile = "logic-1";
+  double samplerate = 0;
+  int unitSize = 1;
+  int channelBit = isdigit((unsigned char)options.channel[0]) ? atoi(options.channel.c_str()) : -1;
+  size_t start = 0;
+  while (start < metadata.size())
+  {
+    size_t end = metadata.find('\n', start);
+    end = end == std::string::npos ? metadata.size() : end;
+    std::string line = metadata.substr(start, end - start);
+    start = end + 1;
+    if (!line.empty() && line.back() == '\r')
+    {
+      line.pop_back();
+    }
+
+    size_t equals = line.find('=');
+    if (equals == std::string::npos)
+    {
+      continue;
+    }
+    std::string key = line.substr(0, equals);
+    std::string value = line.substr(equals + 1);
+    if (key == "capturefile")
+      captureFile = value;
+    else if (key == "samplerate")
+      samplerate = parseRate(value);
+    else if (key == "unitsize")
+      unitSize = atoi(value.c_str());
+    else if (key.compare(0, 5, "probe") == 0 && value == options.channel)
+      channelBit = atoi(key.c_str() + 5) - 1;
+  }
+  if (options.samplerate > 0)
+  {
+    samplerate = options.samplerate;
+  }
+  if (samplerate <= 0 || channelBit < 0 || channelBit >= unitSize * 8)
+  {
+    fprintf(stderr, "samplerate %.0f, channel %s not usable\n", samplerate, options.channel.c_str());
+    return false;
+  }
+
+  // Chunks "logic-1-1", "logic-1-2" ... or a single "logic-1"
+  std::vector<std::string> chunks;
+  for (const std::string &name : zipMembers(zip))
+  {
+    if (name == captureFile || name.compare(0, captureFile.size() + 1, captureFile + "-") == 0)
+    {
+      chunks.push_back(name);
+    }
+  }
+  std::sort(chunks.begin(), chunks.end(),
+            [](const std::string &a, const std::string &b) { return chunkNumber(a) < chunkNumber(b); });
+
+  SoftUart uart(samplerate, options.baud, bytes, stats);
+  uint64_t index = 0;
+  for (const std::string &chunk : chunks)
+  {
+    std::string data;
+    if (!zipExtract(zip, chunk, data))
+    {
+      fprintf(stderr, "cannot extract %s\n", chunk.c_str());
+      return false;
+    }
+    const uint8_t *samples = (const uint8_t *)data.data();
+    for (size_t offset = 0; offset + unitSize <= data.size(); offset += unitSize)
+    {
+      bool level = (samples[offset + channelBit / 8] >> (channelBit % 8)) & 1;
+      uart.sample(index++, level != options.invert);
+    }
+  }
+  fprintf(stderr, "%s: %zu chunks, %llu samples at %.0f Hz, %.1f samples per bit\n", options.input.c_str(),
+          chunks.size(), (unsigned long long)index, samplerate, uart.samplesPerBit);
+  return true;
+}
+
+// Start time in us of a text export line: "123-456 ..." sample range, or a
+// leading time in seconds with an optional s/ms/us/ns unit
+bool exportTime(const std::string &line, const Options &options, double &startUs)
+{
+  const char *text = line.c_str();
+  while (*text == ' ' || *text == '"')
+  {
+    text++;
+  }
+  char *end = nullptr;
+  double value = strtod(text, &end);
+  if (end == text)
+  {
+    return false;
+  }
+
+  if (*end == '-' && isdigit((unsigned char)end[1]))
+  {
+    if (options.samplerate <= 0)
+    {
+      fprintf(stderr, "sample numbers in the export, give --samplerate\n");
+      exit(1);
+    }
+    startUs = value * 1e6 / options.samplerate;
+    return true;
+  }
+
+  double scale = 1e6;
+  if (strncmp(end, "ms", 2) == 0)
+    scale = 1e3;
+  else if (strncmp(end, "us", 2) == 0 || strncmp(end, "\xC2\xB5s", 3) == 0)
+    scale = 1;
+  else if (strncmp(end, "ns", 2) == 0)
+    scale = 1e-3;
+  startUs = value * scale;
+  return true;
+}
+
+// Last token that is a byte, "3E", "0x3E" or "'3E'"
+bool exportByte(const std::string &line, uint8_t &value)
+{
+  std::string token;
+  bool found = false;
+  for (size_t i = 0; i <= line.size(); ++i)
+  {
+    char c = i < line.size() ? line[i] : ' ';
+    if (isalnum((unsigned char)c))
+    {
+      token += c;
+      continue;
+    }
+    if (token.size() > 2 && (token[0] == '0') && (token[1] == 'x' || token[1] == 'X'))
+    {
+      token = token.substr(2);
+    }
+    if (token.size() == 2 && isxdigit((unsigned char)token[0]) && isxdigit((unsigned char)token[1]))
+    {
+      value = strtoul(token.c_str(), nullptr, 16);
+      found = true;
+    }
+    token.clear();
+  }
+  return found;
+}
+
+bool importExport(const std::string &text, const Options &options, std::vector<ReplayByte> &bytes)
+{
+  double byteUs = 10 * 1e6 / options.baud;
+  size_t start = 0;
+  uint64_t skipped = 0;
+  while (start < text.size())
+  {
+    size_t end = text.find('\n', start);
+    end = end == std::string::npos ? text.size() : end;
+    std::string line = text.substr(start, end - start);
+    start = end + 1;
+
+    // Only data annotations, not start/stop/parity bits or errors
+    std::string lower = line;
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return tolower(c); });
+    if (line.empty() || line[0] == '#' || lower.find("bit") != std::string::npos ||
+        lower.find("error") != std::string::npos || lower.find("break") != std::string::npos)
+    {
+      continue;
+    }
+
+    double startUs;
+    uint8_t value;
+    if (!exportTime(line, options, startUs) || !exportByte(line.substr(line.find_first_of(" ,;\t") + 1), value))
+    {
+      skipped++;
+      continue;
+    }
+    char direction = lower.find("tx") != std::string::npos ? 'T' : 'R';
+    bytes.push_back({(uint64_t)llround(startUs + byteUs), value, direction});
+  }
+  if (skipped)
+  {
+    fprintf(stderr, "%llu lines without a time and a byte skipped\n", (unsigned long long)skipped);
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    auto next = [&]() { return i + 1 < argc ? std::string(argv[++i]) : std::string(); };
+    if (arg == "-o")
+      options.output = next();
+    else if (arg == "--channel")
+      options.channel = next();
+    else if (arg == "--baud")
+      options.baud = atof(next().c_str());
+    else if (arg == "--samplerate")
+      options.samplerate = parseRate(next());
+    else if (arg == "--invert")
+      options.invert = true;
+    else if (arg[0] != '-' && options.input.empty())
+      options.input = arg;
+    else
+    {
+      options.input.clear();
+      break;
+    }
+  }
+  if (options.input.empty() || options.baud <= 0)
+  {
+    fprintf(stderr, "usage: %s capture.sr|export.txt [-o out.replay] [--channel D0|N] [--baud N] "
+                    "[--samplerate Hz] [--invert]\n", argv[0]);
+    return 1;
+  }
+
+  std::string data;
+  if (!readFile(options.input, data))
+  {
+    fprintf(stderr, "cannot read %s\n", options.input.c_str());
+    return 1;
+  }
+
+  // Session files are zip archives
+  std::vector<ReplayByte> bytes;
+  ImportStats stats;
+  bool session = data.compare(0, 4, "PK\x03\x04") == 0;
+  if (!(session ? importSession(data, options, bytes, stats) : importExport(data, options, bytes)))
+  {
+    return 1;
+  }
+  std::stable_sort(bytes.begin(), bytes.end(),
+                   [](const ReplayByte &a, const ReplayByte &b) { return a.timeUs < b.timeUs; });
+
+  FILE *out = options.output.empty() ? stdout : fopen(options.output.c_str(), "w");
+  if (!out)
+  {
+    perror(options.output.c_str());
+    return 1;
+  }
+  replayWriteHeader(out, ("sigrok_import " + options.input).c_str());
+  for (const ReplayByte &b : bytes)
+  {
+    replayWrite(out, b);
+  }
+  if (out != stdout)
+  {
+    fclose(out);
+  }
+
+  fprintf(stderr, "%zu bytes", bytes.size());
+  if (session)
+  {
+    fprintf(stderr, ", %llu framing errors, %llu glitches", (unsigned long long)stats.framingErrors,
+            (unsigned long long)stats.glitches);
+  }
+  fprintf(stderr, "\n");
+  replaySummary(bytes);
+  return 0;
+}
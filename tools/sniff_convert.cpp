@@ -0,0 +1,144 @@
+// sniff_convert - sniffer captures from the logger to the replay format
+//
+// Two inputs:
+//   SNIFF.BIN      the capture file itself, copied off SPIFFS
+//   serial log     the USB output of "SNIFF DUMP", anything around the
+//                  "SNIFF BEGIN" / "SNIFF END" block is ignored
+//
+// The 32-bit capture timestamps are unwrapped and made relative to the first
+// byte. Bytes marked lost get a "# lost" comment line in front so gaps are
+// visible in the replay. A capture cut short by a reset has no record count,
+// it is read up to the first erased (0xFF) record.
+//
+// Build: g++ -std=c++17 -O2 -Iyamaha/include tools/sniff_convert.cpp -o sniff_convert
+// Usage: sniff_convert SNIFF.BIN|dump.log [-o out.replay] [--bin SNIFF.BIN]
+
+#include "native.h"
+#include "appprofiles.h"
+#include "replay.h"
+#include "hexdump.h"
+#include <snifffile.h>
+
+int main(int argc, char **argv)
+{
+  std::string input, output, binOutput;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    auto next = [&]() { return i + 1 < argc ? std::string(argv[++i]) : std::string(); };
+    if (arg == "-o")
+      output = next();
+    else if (arg == "--bin")
+      binOutput = next();
+    else if (arg[0] != '-' && input.empty())
+      input = arg;
+    else
+    {
+      input.clear();
+      break;
+    }
+  }
+  if (input.empty())
+  {
+    fprintf(stderr, "usage: %s SNIFF.BIN|dump.log [-o out.replay] [--bin SNIFF.BIN]\n", argv[0]);
+    return 1;
+  }
+
+  std::string image;
+  if (!readFile(input, image))
+  {
+    fprintf(stderr, "cannot read %s\n", input.c_str());
+    return 1;
+  }
+  SniffHeader header;
+  if (image.size() < sizeof(header) || memcmp(image.data(), "KSNF", 4) != 0)
+  {
+    std::string text;
+    text.swap(image);
+    if (!parseHexDump(text, "SNIFF", image))
+    {
+      fprintf(stderr, "%s is neither SNIFF.BIN nor a SNIFF DUMP log\n", input.c_str());
+      return 1;
+    }
+  }
+  memcpy(&header, image.data(), sizeof(header));
+  if (header.magic != SNIFF_MAGIC || header.version != SNIFF_VERSION || header.recordSize != sizeof(SniffRecord))
+  {
+    fprintf(stderr, "unsupported sniff file, version %u record size %u\n", header.version, header.recordSize);
+    return 1;
+  }
+
+  if (!binOutput.empty())
+  {
+    FILE *bin = fopen(binOutput.c_str(), "wb");
+    if (!bin || fwrite(image.data(), 1, image.size(), bin) != image.size())
+    {
+      perror(binOutput.c_str());
+      return 1;
+    }
+    fclose(bin);
+  }
+
+  size_t available = (image.size() - sizeof(header)) / sizeof(SniffRecord);
+  bool complete = header.recordCount != 0xFFFFFFFF;
+  size_t count = complete ? std::min<size_t>(header.recordCount, available) : available;
+
+  std::vector<ReplayByte> bytes;
+  std::vector<size_t> gaps; // Indexes of bytes with lost data in front
+  uint64_t high = 0;
+  uint32_t last = 0;
+  for (size_t i = 0; i < count; ++i)
+  {
+    SniffRecord record;
+    memcpy(&record, image.data() + sizeof(header) + i * sizeof(SniffRecord), sizeof(record));
+    if (!complete && record.timeUs == 0xFFFFFFFF && record.value == 0xFF && record.flags == 0xFF)
+    {
+      break;
+    }
+    if (i > 0 && record.timeUs < last)
+    {
+      high += 1ULL << 32;
+    }
+    last = record.timeUs;
+    if (record.flags & SNIFF_LOST)
+    {
+      gaps.push_back(bytes.size());
+    }
+    bytes.push_back({high | record.timeUs, record.value, (record.flags & SNIFF_TX) ? 'T' : 'R'});
+  }
+  uint64_t start = bytes.empty() ? 0 : bytes.front().timeUs;
+  for (ReplayByte &b : bytes)
+  {
+    b.timeUs -= start;
+  }
+
+  FILE *out = output.empty() ? stdout : fopen(output.c_str(), "w");
+  if (!out)
+  {
+    perror(output.c_str());
+    return 1;
+  }
+  char profile[sizeof(header.profile) + 1] = {};
+  memcpy(profile, header.profile, sizeof(header.profile));
+  replayWriteHeader(out, ("sniff_convert " + input + ", " + profile + " at " + std::to_string(header.baud) +
+                          " baud").c_str());
+  size_t gap = 0;
+  for (size_t i = 0; i < bytes.size(); ++i)
+  {
+    if (gap < gaps.size() && gaps[gap] == i)
+    {
+      fprintf(out, "# lost\n");
+      gap++;
+    }
+    replayWrite(out, bytes[i]);
+  }
+  if (out != stdout)
+  {
+    fclose(out);
+  }
+
+  fprintf(stderr, "%zu bytes, %s, %u lost on the logger, %zu gaps\n", bytes.size(),
+          complete ? "complete" : "cut short", complete ? header.lost : 0, gaps.size());
+  replaySummary(bytes);
+  return 0;
+}
@@ -5,13 +5,17 @@
 #include <BLEDevice.h>
 #include <string>
 #include <queue>
-#include <string>
+#include <mutex>
+#include <elmsession.h>
+#include <blelink.h>
+#include <consolering.h>
+#include <trace.h>
 
 // debug
 bool Debug_RX = false;
 bool Debug_TX = false;
 bool Debug_PIDS = false;
-bool Debug_YAM = true;
+bool Debug_YAM = false;
 
 // Main
 extern void sendResponse(const std::string &message);
@@ -24,8 +28,8 @@ extern bool CalculateGear_Flag;
 // forward declaration for Disable bike timer
 extern bool DisableBikeOff_Flag;
 
-// Function declaration for handling commands
-std::string handleCommand(const std::string &command);
+// USB ELM327 mode keeps console text off the USB port
+extern bool usbElmMode;
 
 // ELM327 Service and Characteristic UUIDs
 const uint16_t ELM327_SERVICE_UUID = 0xFFF0;
@@ -39,6 +43,28 @@ const char UART_TX[] = "6e400003-b5a3-f393-e0a9-e50e24dcca9e";
 
 class MyCallbacks;
 
+// Console text waiting for the UART notify, shared by all terminals
+const size_t CONSOLE_RING_SIZE = 4096;
+const size_t CONSOLE_CHUNK_MAX = 244; // Notify payload with a 247 byte MTU
+
+// One connected central. Every connection has its own ELM settings, queues
+// and counters, the K-line data behind the PIDs is decoded once in loop()
+// and shared by all of them. Slots are claimed and freed and requests queued
+// on the BLE task while loop() answers them, both sides hold clientsMutex.
+struct BleClient
+{
+  bool active = false;
+  uint16_t connId = 0;
+  esp_bd_addr_t peer = {};
+  ElmSession elm;
+  std::queue<std::string> elmRxQueue;
+  std::queue<std::string> elmTxQueue;
+
+  // ELM load counters, see ELM STATS
+  uint32_t elmRequests = 0;
+  uint32_t elmTxDrops = 0;
+};
+
 // Device class for handling BLE operations
 class Device : public BLEServerCallbacks
 {
@@ -50,26 +76,72 @@ public:
   BLECharacteristic *ELMRX;
   BLECharacteristic *UartRX;
   BLECharacteristic *UartTX;
-  bool clientConnected;
-  bool handleATHCommand = false;
-  bool handleATSCommand = false;
-  bool ath1Active = false;
+  bool clientConnected; // Any central connected
+  BleClient clients[BLE_MAX_CLIENTS];
+  std::mutex clientsMutex;
+  ConsoleRing<CONSOLE_RING_SIZE> uartTXRing;
 
   ~Device() override = default;
 
-void onConnect(BLEServer *) override
+  void onConnect(BLEServer *, esp_ble_gatts_cb_param_t *param) override
   {
+    BleClient *client;
+    uint8_t connected;
+    {
+      std::lock_guard<std::mutex> lock(clientsMutex);
+      client = findClient(param->connect.conn_id);
+      for (BleClient &free : clients)
+      {
+        if (!client && !free.active)
+        {
+          client = &free;
+        }
+      }
+      if (client)
+      {
+        // Fresh session and queues for this connection
+        *client = BleClient();
+        client->active = true;
+        client->connId = param->connect.conn_id;
+        memcpy(client->peer, param->connect.remote_bda, sizeof(esp_bd_addr_t));
+      }
+      connected = connectedClients();
+    }
+    if (!client)
+    {
+      server->disconnect(param->connect.conn_id); // All slots taken
+      return;
+    }
+
     clientConnected = true;
-    privateSendResponse("Device connected");
+    privateSendResponse("Device connected, " + std::to_string(connected) + " of " +
+                        std::to_string(BLE_MAX_CLIENTS) + " clients");
     menu("MENU");
-    handleATSCommand = false;
-    handleATHCommand = false;
+    bleLinkNegotiate(param->connect.remote_bda);
+
+    // Keep advertising so another central can join
+    if (connected < BLE_MAX_CLIENTS)
+    {
+      BLEDevice::startAdvertising();
+    }
   }
 
-  void onDisconnect(BLEServer *) override
+  void onDisconnect(BLEServer *, esp_ble_gatts_cb_param_t *param) override
   {
-    clientConnected = false;
-    privateSendResponse("Device disconnected");
+    uint8_t connected;
+    {
+      std::lock_guard<std::mutex> lock(clientsMutex);
+      BleClient *client = findClient(param->disconnect.conn_id);
+      if (client)
+      {
+        client->active = false;
+      }
+      connected = connectedClients();
+    }
+    bleLinkReset(param->disconnect.remote_bda);
+
+    clientConnected = connected > 0;
+    privateSendResponse("Device disconnected, " + std::to_string(connected) + " clients left");
     BLEDevice::startAdvertising();
   }
 
@@ -80,10 +152,26 @@ void onConnect(BLEServer *) override
     return instance;
   }
 
-  // Setter for setting ATH1 active mode
-  void setATH1Active(bool active)
+  BleClient *findClient(uint16_t connId)
   {
-    ath1Active = active;
+    for (BleClient &client : clients)
+    {
+      if (client.active && client.connId == connId)
+      {
+        return &client;
+      }
+    }
+    return nullptr;
+  }
+
+  uint8_t connectedClients() const
+  {
+    uint8_t count = 0;
+    for (const BleClient &client : clients)
+    {
+      count += client.active;
+    }
+    return count;
   }
 
   // Check if device is connected
@@ -99,6 +187,7 @@ void onConnect(BLEServer *) override
     BLEDevice::init("Carista");
     BLEDevice::setPower(ESP_PWR_LVL_P9);
     BLEDevice::setMTU(517);
+    BLEDevice::setCustomGapHandler(bleLinkGapEvent);
 
     // Create BLE server and set callbacks
     server = BLEDevice::createServer();
@@ -137,103 +226,126 @@ void onConnect(BLEServer *) override
     return true;
   }
 
-  void bleElmQue(std::string data)
+  void bleElmQue(BleClient &client, const std::string &data)
   {
-    if (!clientConnected)
+    if (!client.active)
       return;
 
     // Enqueue new data
-    ElmTXQueue.push(data);
+    client.elmTxQueue.push(data);
+    client.elmRequests++;
 
-    // Ensure the queue doesn't exceed 50 messages
-    if (ElmTXQueue.size() > 50)
+    // Ensure the queue doesn't exceed the limit
+    if (client.elmTxQueue.size() > ELM_TX_QUEUE_LIMIT)
     {
-      ElmTXQueue.pop(); // Remove the oldest data if over the limit
+      client.elmTxQueue.pop(); // Remove the oldest data if over the limit
+      client.elmTxDrops++;
+      TRACE_ERROR(TRACE_ELM_DROP, client.elmTxQueue.size(), client.elmTxDrops);
     }
   }
 
+  // One reply per client per tick, each only to the client that asked
   void bleElmSend()
   {
-    // Check if there are messages to send and if the client is connected
-    if (!ElmTXQueue.empty() && clientConnected)
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    for (BleClient &client : clients)
     {
-      // Get the message at the front of the queue
-      const std::string &data = ElmTXQueue.front();
-
-      // Attempt to send the message
-      ELMTX->setValue(data);
-      ELMTX->notify();
-
-      // Optional debug message
-      if (Debug_TX)
+      if (client.active && !client.elmTxQueue.empty())
       {
-        privateSendResponse("Sent to Elm: " + data);
+        bleElmSend(client);
       }
-
-      // Remove the message from the queue after sending
-      ElmTXQueue.pop();
     }
   }
 
-  void bleUartQue(const std::string &message)
+  void bleElmSend(BleClient &client)
   {
-    if (!clientConnected)
+    if (client.elmTxQueue.empty())
     {
       return;
     }
-    // Add the message to the queue
-    uartTXQueue.push(message + '\n'); // Ensure newline
 
-    // Check if the queue size exceeds the limit
-    if (uartTXQueue.size() > 50)
+    // Get the message at the front of the queue
+    const std::string &data = client.elmTxQueue.front();
+
+    // Targeted notification, ELMTX->notify() would reach every central
+    esp_ble_gatts_send_indicate(server->getGattsIf(), client.connId, ELMTX->getHandle(), data.size(),
+                                (uint8_t *)data.data(), false);
+
+    // Optional debug message
+    if (Debug_TX)
     {
-      uartTXQueue.pop(); // Remove the oldest message from the front of the queue
+      privateSendResponse("Sent to Elm " + std::to_string(client.connId) + ": " + data);
     }
+
+    // Remove the message from the queue after sending
+    client.elmTxQueue.pop();
   }
 
-  void bleUartSend()
+  void bleUartQue(const std::string &message)
+  {
+    bleUartQue(message.data(), message.size());
+  }
+
+  void bleUartQue(const char *message, size_t length)
   {
-    if (!clientConnected || uartTXQueue.empty())
+    if (!clientConnected)
     {
       return;
     }
+    uartTXRing.push(message, length); // Newline added, oldest lines dropped when full
+  }
 
-    const std::string &text = uartTXQueue.front();
-    UartTX->setValue(text);
-    UartTX->notify();
-    uartTXQueue.pop();
+  // Bytes the console ring takes before it drops a line
+  size_t bleUartRoom() const
+  {
+    return clientConnected ? uartTXRing.capacity() - uartTXRing.used() : uartTXRing.capacity();
   }
 
-  // Modify the response based on device settings
-  std::string modifySendResponse(const std::string &command,
-                                 const std::string &response)
+  void bleUartSend()
   {
-    Device &device = Device::getInstance();
-    std::string amendedResponse = response;
+    if (!clientConnected || uartTXRing.used() == 0)
+    {
+      return;
+    }
 
-    if (device.ath1Active && command.rfind("01", 0) == 0)
+    // One notify reaches every terminal, size it for the smallest MTU
+    size_t payload = CONSOLE_CHUNK_MAX;
     {
-      amendedResponse = "7E8 06 " + amendedResponse;
-      if (Debug_RX)
+      std::lock_guard<std::mutex> lock(clientsMutex);
+      for (const BleClient &client : clients)
       {
-        privateSendResponse("ATH1 Active: Headers appended " + amendedResponse);
+        if (client.active)
+        {
+          payload = std::min(payload, (size_t)server->getPeerMTU(client.connId) - 3);
+        }
       }
     }
 
-    if (device.handleATSCommand)
+    char chunk[CONSOLE_CHUNK_MAX];
+    size_t length = uartTXRing.pop(chunk, payload);
+    UartTX->setValue(reinterpret_cast<uint8_t *>(chunk), length);
+    UartTX->notify();
+  }
+
+  // Modify the response based on the client's session settings
+  std::string modifySendResponse(const BleClient &client, const std::string &command,
+                                 const std::string &response)
+  {
+    std::string amendedResponse = client.elm.shape(command, response);
+
+    if (Debug_RX && (client.elm.headers || client.elm.spacesOff))
     {
-      amendedResponse.erase(std::remove(amendedResponse.begin(), amendedResponse.end(), ' '), amendedResponse.end());
-      if (Debug_RX)
-      {
-        privateSendResponse("ATS1 Active: Spaces removed " + amendedResponse);
-      }
+      privateSendResponse("Session shaped: " + amendedResponse);
     }
     return amendedResponse;
   }
 
   static void privateSendResponse(const std::string &message)
   {
-    Serial.println(message.c_str());
+    if (!usbElmMode)
+    {
+      Serial.println(message.c_str());
+    }
     getInstance().bleUartQue(message); // Utilizes getInstance to call another method
   }
 
@@ -247,9 +359,6 @@ private:
              UartTX(),
              clientConnected(false) {}
 
-  std::queue<std::string> uartTXQueue;
-  std::queue<std::string> ElmTXQueue;
-
   // Prevent copy construction and assignment
   Device(const Device &) = delete;
   Device &operator=(const Device &) = delete;
@@ -277,7 +386,7 @@ public:
 
 
 
-  void onWrite(BLECharacteristic *characteristic) override
+  void onWrite(BLECharacteristic *characteristic, esp_ble_gatts_cb_param_t *param) override
   {
     if (characteristic == Device::getInstance().UartRX)
     {
@@ -301,7 +410,7 @@ public:
       // If there is data
       if (len > 0)
       {
-        bleElmRx(data, len);
+        bleElmRx(data, len, param->write.conn_id);
       }
     }
   }
@@ -351,7 +460,7 @@ public:
       receiveResponse(command);
     }
   }
-void bleElmRx(uint8_t *data, size_t len)
+void bleElmRx(uint8_t *data, size_t len, uint16_t connId)
 {
   size_t start = 0;
   if (start < len && isspace(data[start]))
@@ -378,20 +487,76 @@ void bleElmRx(uint8_t *data, size_t len)
   }
 
   std::string command(reinterpret_cast<char *>(data + start), end - start);
-  bleElmRxQueue.push(command);
+  Device &device = Device::getInstance();
+  std::lock_guard<std::mutex> lock(device.clientsMutex);
+  BleClient *client = device.findClient(connId);
+  if (client)
+  {
+    client->elmRxQueue.push(command);
+  }
 }
 
 static void processElmRxQueue()
 {
-  if (!bleElmRxQueue.empty())
+  std::lock_guard<std::mutex> lock(Device::getInstance().clientsMutex);
+  for (BleClient &client : Device::getInstance().clients)
+  {
+    if (client.active)
+    {
+      processElmRxQueue(client);
+    }
+  }
+}
+
+static void processElmRxQueue(BleClient &client)
+{
+  Device &device = Device::getInstance();
+
+  // A held long-poll request blocks the queue until it is answered
+  if (client.elm.holding())
   {
-    std::string command = bleElmRxQueue.front();
-    bleElmRxQueue.pop();
+    releaseElmLongPoll(client);
+    return;
+  }
+
+  if (!client.elmRxQueue.empty())
+  {
+    std::string command = client.elmRxQueue.front();
+    client.elmRxQueue.pop();
+
+    if (client.elm.hold(command, micros()))
+    {
+      return;
+    }
 
-    std::string response = handleCommand(command);
+    std::string response = handleCommand(command, &client.elm);
 
-    std::string modifiedResponse = Device::getInstance().modifySendResponse(command, response + "\r>");
-    Device::getInstance().bleElmQue(modifiedResponse);
+    std::string modifiedResponse = device.modifySendResponse(client, command, response + "\r>");
+    device.bleElmQue(client, modifiedResponse);
+  }
+}
+
+// Answer held requests straight after the frame they waited for decoded
+static void releaseElmLongPoll()
+{
+  std::lock_guard<std::mutex> lock(Device::getInstance().clientsMutex);
+  for (BleClient &client : Device::getInstance().clients)
+  {
+    if (client.active && client.elm.holding())
+    {
+      releaseElmLongPoll(client);
+    }
+  }
+}
+
+static void releaseElmLongPoll(BleClient &client)
+{
+  Device &device = Device::getInstance();
+  std::string reply;
+  if (client.elm.release(micros(), reply))
+  {
+    device.bleElmQue(client, reply);
+    device.bleElmSend(client);
   }
 }
 
@@ -405,7 +570,6 @@ private:
   }
 
   static std::queue<std::string> bleUartRxQue; // Queue holding incoming commands
-  static std::queue<std::string> bleElmRxQueue;
 
   // Device::getInstance().sendUART("Message");
   void trimInPlace(std::string &str)
@@ -1,5 +1,6 @@
 #pragma once
 #include <U8g2lib.h>
+#include <powerscale.h>
 
 U8G2_SH1106_128X64_NONAME_F_HW_I2C u8g2(U8G2_R0, /* reset=*/U8X8_PIN_NONE);
 
@@ -21,6 +22,7 @@ void displayData()
 
   if (Time - lastDisplayUpdate >= frameIntervalMs)
   {
+    PmLock lock(PM_BURST_DISPLAY);
     u8g2.clearBuffer();
     u8g2.setFont(u8g2_font_sirclivethebold_tr);
 
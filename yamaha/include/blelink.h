@@ -0,0 +1,208 @@
+#pragma once
+#include <Arduino.h>
+#include <BLEDevice.h>
+#include <string>
+#include "esp_gap_ble_api.h"
+#include <trace.h>
+
+// BLE link tuning
+//
+// Phones pick a 30-50 ms connection interval unless asked otherwise, and every
+// ELM round trip costs at least one interval. On connect the peripheral asks
+// for a short interval, walking down a ladder of safer ranges when the central
+// rejects one (iOS refuses anything under 15 ms), plus data length extension
+// and the 2M PHY where the controller supports it. The GAP handler records
+// what was negotiated for the LINK command and the BLE interval PID.
+
+// Connection interval ranges in 1.25 ms units, most aggressive first
+struct BleLinkRung
+{
+  uint16_t minInterval;
+  uint16_t maxInterval;
+};
+
+const BleLinkRung bleLinkLadder[] = {
+    {6, 12},  // 7.5 - 15 ms, Android
+    {12, 24}, // 15 - 30 ms, iOS minimum
+    {24, 40}, // 30 - 50 ms, what phones pick anyway
+};
+const uint8_t BLE_LINK_RUNGS = sizeof(bleLinkLadder) / sizeof(bleLinkLadder[0]);
+const uint16_t BLE_LINK_TIMEOUT = 400;  // Supervision timeout, 10 ms units
+const uint16_t BLE_LINK_OCTETS = 251;   // Data length extension maximum
+
+// Concurrent centrals, CONFIG_BT_ACL_CONNECTIONS allows up to 4
+#define BLE_MAX_CLIENTS 3
+
+// Negotiated state per connection, written from the BLE stack task
+struct BleLink
+{
+  volatile bool used;
+  esp_bd_addr_t peer;
+  volatile uint8_t rung;
+  volatile uint16_t interval; // 1.25 ms units, 0 = not negotiated yet
+  volatile uint16_t latency;
+  volatile uint16_t timeout;
+  volatile uint8_t txPhy;
+  volatile uint8_t rxPhy;
+  volatile uint16_t txOctets;
+  volatile uint16_t rxOctets;
+  volatile uint8_t rejects;
+};
+
+BleLink bleLinks[BLE_MAX_CLIENTS] = {};
+BleLink *bleLinkPending = nullptr; // Data length events carry no address
+
+// Connection interval in whole ms, of the newest link
+extern uint8_t BLE_Interval_PID;
+
+BleLink *bleLinkFind(const uint8_t *peer)
+{
+  for (BleLink &link : bleLinks)
+  {
+    if (link.used && memcmp(link.peer, peer, sizeof(esp_bd_addr_t)) == 0)
+    {
+      return &link;
+    }
+  }
+  return nullptr;
+}
+
+void bleLinkRequestRung(BleLink &link)
+{
+  esp_ble_conn_update_params_t params = {};
+  memcpy(params.bda, link.peer, sizeof(esp_bd_addr_t));
+  params.min_int = bleLinkLadder[link.rung].minInterval;
+  params.max_int = bleLinkLadder[link.rung].maxInterval;
+  params.latency = 0;
+  params.timeout = BLE_LINK_TIMEOUT;
+  esp_ble_gap_update_conn_params(&params);
+}
+
+// Called from onConnect with the central's address
+void bleLinkNegotiate(const esp_bd_addr_t peer)
+{
+  BleLink *link = bleLinkFind(peer);
+  for (BleLink &free : bleLinks)
+  {
+    if (!link && !free.used)
+    {
+      link = &free;
+    }
+  }
+  if (!link)
+  {
+    return;
+  }
+
+  memcpy(link->peer, peer, sizeof(esp_bd_addr_t));
+  link->used = true;
+  link->rung = 0;
+  link->rejects = 0;
+  link->interval = 0;
+  link->txPhy = 1;
+  link->rxPhy = 1;
+  link->txOctets = 27;
+  link->rxOctets = 27;
+  bleLinkPending = link;
+
+  bleLinkRequestRung(*link);
+  esp_ble_gap_set_pkt_data_len(link->peer, BLE_LINK_OCTETS);
+#ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+  esp_ble_gap_set_preferred_phy(link->peer, 0, ESP_BLE_GAP_PHY_2M_PREF_MASK | ESP_BLE_GAP_PHY_1M_PREF_MASK,
+                                ESP_BLE_GAP_PHY_2M_PREF_MASK | ESP_BLE_GAP_PHY_1M_PREF_MASK,
+                                ESP_BLE_GAP_PHY_OPTIONS_NO_PREF);
+#endif
+}
+
+void bleLinkReset(const esp_bd_addr_t peer)
+{
+  BleLink *link = bleLinkFind(peer);
+  if (link)
+  {
+    link->used = false;
+    link->interval = 0;
+  }
+  if (link == bleLinkPending)
+  {
+    bleLinkPending = nullptr;
+  }
+
+  // The PID follows whichever link is left
+  BLE_Interval_PID = 0;
+  for (const BleLink &other : bleLinks)
+  {
+    if (other.used && other.interval)
+    {
+      BLE_Interval_PID = (other.interval * 5 + 2) / 4;
+    }
+  }
+}
+
+// Custom GAP handler, runs in the BLE stack task so it only records state
+void bleLinkGapEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
+{
+  BleLink *link = nullptr;
+  switch (event)
+  {
+  case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
+    link = bleLinkFind(param->update_conn_params.bda);
+    if (!link)
+    {
+      break;
+    }
+    if (param->update_conn_params.status != ESP_BT_STATUS_SUCCESS)
+    {
+      // Rejected, fall back to the next rung
+      link->rejects++;
+      TRACE_INFO(TRACE_BLE_LINK, bleLinkLadder[link->rung].maxInterval, param->update_conn_params.status);
+      if (link->rung + 1 < BLE_LINK_RUNGS)
+      {
+        link->rung++;
+        bleLinkRequestRung(*link);
+      }
+      break;
+    }
+    link->interval = param->update_conn_params.conn_int;
+    link->latency = param->update_conn_params.latency;
+    link->timeout = param->update_conn_params.timeout;
+    BLE_Interval_PID = (link->interval * 5 + 2) / 4; // 1.25 ms units -> ms
+    TRACE_INFO(TRACE_BLE_LINK, link->interval, 0);
+    break;
+  case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:
+    if (bleLinkPending && param->pkt_data_length_cmpl.status == ESP_BT_STATUS_SUCCESS)
+    {
+      bleLinkPending->txOctets = param->pkt_data_length_cmpl.params.tx_len;
+      bleLinkPending->rxOctets = param->pkt_data_length_cmpl.params.rx_len;
+    }
+    break;
+#ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+  case ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT:
+    link = bleLinkFind(param->phy_update.bda);
+    if (link && param->phy_update.status == ESP_BT_STATUS_SUCCESS)
+    {
+      link->txPhy = param->phy_update.tx_phy;
+      link->rxPhy = param->phy_update.rx_phy;
+    }
+    break;
+#endif
+  default:
+    break;
+  }
+}
+
+std::string bleLinkReport(const BleLink &link)
+{
+  if (link.interval == 0)
+  {
+    return "no connection parameters negotiated yet";
+  }
+
+  char line[160];
+  snprintf(line, sizeof(line),
+           "interval %u.%02u ms (ladder rung %u, %u rejected), latency %u, timeout %u ms, "
+           "PHY tx %uM rx %uM, data length tx %u rx %u",
+           link.interval * 125 / 100, link.interval * 125 % 100, link.rung + 1, link.rejects, link.latency,
+           link.timeout * 10, link.txPhy == ESP_BLE_GAP_PHY_2M ? 2 : 1, link.rxPhy == ESP_BLE_GAP_PHY_2M ? 2 : 1,
+           link.txOctets, link.rxOctets);
+  return line;
+}
@@ -0,0 +1,186 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <ecuprofile.h>
+#include <sessionlog.h>
+
+// Channel history
+//
+// The last HISTORY_SECONDS of every normal frame at full rate, one array per
+// channel plus the raw frame bytes, so a query over one channel walks one
+// array. On the FeatherS3 the arrays live in PSRAM, 8 MB that is otherwise
+// unused; without PSRAM a HISTORY_FALLBACK_SECONDS history in internal RAM
+// still covers the freeze frame and trigger windows. Freeze frames (dtc.h)
+// and capture triggers (triggers.h) only note when they fire, the main loop
+// cuts their window out of the history when it writes the file. Nothing here
+// touches flash. The ring is cleared when a ride starts, so it never holds
+// two rides and frame times within it stay comparable as signed 32-bit us.
+// The memory is handed in.
+
+#ifndef HISTORY_SECONDS
+#define HISTORY_SECONDS 600 // ~650 KB of PSRAM
+#endif
+static_assert(HISTORY_SECONDS < 2000, "history times are compared as signed 32-bit us");
+
+const uint8_t HISTORY_FALLBACK_SECONDS = 12; // Longest freeze frame or trigger window, plus margin
+
+// One normal frame, all channels
+struct ChannelSample
+{
+  uint32_t timeUs;
+  uint16_t rpm;
+  uint8_t speed;
+  uint8_t coolant; // C
+  uint8_t error;
+  uint8_t gear;
+};
+
+struct ChannelHistory
+{
+  static constexpr size_t RECORD_BYTES = sizeof(uint32_t) + sizeof(uint16_t) + 4 + EcuProfile::FRAME_LENGTH;
+
+  static constexpr size_t records(uint32_t seconds)
+  {
+    return (uint64_t)seconds * 1000000 / EcuProfile::FRAME_PERIOD_US;
+  }
+
+  size_t capacity = 0;
+  bool inPsram = false;
+
+  // Columns carved out of one block, widest first for alignment
+  bool begin(void *memory, size_t bytes, bool psram)
+  {
+    if (!memory)
+    {
+      return false;
+    }
+    capacity = bytes / RECORD_BYTES;
+    inPsram = psram;
+    timeUs = static_cast<uint32_t *>(memory);
+    rpm = reinterpret_cast<uint16_t *>(timeUs + capacity);
+    speed = reinterpret_cast<uint8_t *>(rpm + capacity);
+    coolant = speed + capacity;
+    error = coolant + capacity;
+    gear = error + capacity;
+    raw = gear + capacity;
+    clear();
+    return capacity > 0;
+  }
+
+  void clear()
+  {
+    head = 0;
+    count = 0;
+  }
+
+  void add(const ChannelSample &sample, const uint8_t *frame)
+  {
+    if (capacity == 0)
+    {
+      return;
+    }
+    timeUs[head] = sample.timeUs;
+    rpm[head] = sample.rpm;
+    speed[head] = sample.speed;
+    coolant[head] = sample.coolant;
+    error[head] = sample.error;
+    gear[head] = sample.gear;
+    memcpy(raw + head * EcuProfile::FRAME_LENGTH, frame, EcuProfile::FRAME_LENGTH);
+    head = (head + 1) % capacity;
+    if (count < capacity)
+    {
+      count++;
+    }
+  }
+
+  size_t size() const
+  {
+    return count;
+  }
+
+  // Index 0 is the oldest frame
+  uint32_t time(size_t i) const
+  {
+    return timeUs[slot(i)];
+  }
+
+  ChannelSample sample(size_t i) const
+  {
+    size_t s = slot(i);
+    return {timeUs[s], rpm[s], speed[s], coolant[s], error[s], gear[s]};
+  }
+
+  const uint8_t *frame(size_t i) const
+  {
+    return raw + slot(i) * EcuProfile::FRAME_LENGTH;
+  }
+
+  int32_t value(size_t i, LogChannel channel) const
+  {
+    size_t s = slot(i);
+    switch (channel)
+    {
+    case LOG_RPM:
+      return rpm[s];
+    case LOG_SPEED:
+      return speed[s];
+    case LOG_COOLANT:
+      return coolant[s];
+    case LOG_ERROR:
+      return error[s];
+    case LOG_GEAR:
+      return gear[s];
+    default:
+      return 0;
+    }
+  }
+
+  // First frame at or after t, size() if none
+  size_t lowerBound(uint32_t t) const
+  {
+    size_t low = 0, high = count;
+    while (low < high)
+    {
+      size_t middle = (low + high) / 2;
+      if ((int32_t)(time(middle) - t) < 0)
+      {
+        low = middle + 1;
+      }
+      else
+      {
+        high = middle;
+      }
+    }
+    return low;
+  }
+
+  // First frame after t
+  size_t upperBound(uint32_t t) const
+  {
+    return lowerBound(t + 1);
+  }
+
+  uint32_t spanUs() const
+  {
+    return count ? time(count - 1) - time(0) : 0;
+  }
+
+private:
+  uint32_t *timeUs = nullptr;
+  uint16_t *rpm = nullptr;
+  uint8_t *speed = nullptr;
+  uint8_t *coolant = nullptr;
+  uint8_t *error = nullptr;
+  uint8_t *gear = nullptr;
+  uint8_t *raw = nullptr; // FRAME_LENGTH per frame
+  size_t head = 0;
+  size_t count = 0;
+
+  size_t slot(size_t i) const
+  {
+    return (head + capacity - count + i) % capacity;
+  }
+};
+
+ChannelHistory channelHistory;
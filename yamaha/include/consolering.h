@@ -0,0 +1,85 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Console ring
+//
+// Fixed byte ring between sendResponse() and the BLE UART notify. Each
+// message is copied in once with its newline and drained in chunks of up to
+// one notify payload, so console output never touches the heap and short
+// lines share a notify. When the ring is full the oldest whole lines go.
+template <size_t SIZE>
+struct ConsoleRing
+{
+  uint32_t dropped = 0; // Bytes dropped for lack of space
+
+  size_t used() const
+  {
+    return count;
+  }
+
+  static constexpr size_t capacity()
+  {
+    return SIZE;
+  }
+
+  // One message plus '\n', a message longer than the ring keeps its end
+  void push(const char *text, size_t length)
+  {
+    if (length + 1 > SIZE)
+    {
+      dropped += length + 1 - SIZE;
+      text += length + 1 - SIZE;
+      length = SIZE - 1;
+    }
+    while (SIZE - count < length + 1)
+    {
+      dropLine();
+    }
+    write(text, length);
+    write("\n", 1);
+  }
+
+  // Copies up to max bytes out, returns how many
+  size_t pop(char *out, size_t max)
+  {
+    size_t length = count < max ? count : max;
+    size_t first = SIZE - tail < length ? SIZE - tail : length;
+    memcpy(out, data + tail, first);
+    memcpy(out + first, data, length - first);
+    tail = (tail + length) % SIZE;
+    count -= length;
+    return length;
+  }
+
+private:
+  char data[SIZE];
+  size_t head = 0;
+  size_t tail = 0;
+  size_t count = 0;
+
+  void write(const char *text, size_t length)
+  {
+    size_t first = SIZE - head < length ? SIZE - head : length;
+    memcpy(data + head, text, first);
+    memcpy(data, text + first, length - first);
+    head = (head + length) % SIZE;
+    count += length;
+  }
+
+  void dropLine()
+  {
+    while (count > 0)
+    {
+      char c = data[tail];
+      tail = (tail + 1) % SIZE;
+      count--;
+      dropped++;
+      if (c == '\n')
+      {
+        break;
+      }
+    }
+  }
+};
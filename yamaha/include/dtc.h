@@ -0,0 +1,185 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <ecuprofile.h>
+#include <channelhistory.h>
+
+// Diagnostic trouble codes
+//
+// The ECU reports one Yamaha fault code at a time in the frame error byte.
+// Each code is mapped to an SAE DTC so the fault screens of Torque and
+// RaceChrono work: mode 07 (pending) is the code the ECU reports now, mode 03
+// (stored) every code seen since the last mode 04 clear. Codes without an SAE
+// equivalent become manufacturer codes P10xx, xx being the Yamaha number.
+//
+// The first time a code is stored, the main loop writes the last
+// FREEZE_SECONDS of all channels before it from the channel history to SPIFFS
+// as its freeze frame (DTC<code>.CSV), so the data leading up to the fault
+// survives a power cycle. The flash side lives in spifffs.h.
+
+struct YamahaFault
+{
+  uint8_t code;
+  uint16_t dtc; // SAE encoding, P0335 = 0x0335
+  const char *name;
+};
+
+const YamahaFault yamahaFaults[] = {
+    {12, 0x0335, "Crankshaft position sensor"},
+    {13, 0x0105, "Intake air pressure sensor circuit"},
+    {14, 0x0106, "Intake air pressure sensor hose"},
+    {15, 0x0120, "Throttle position sensor circuit"},
+    {16, 0x0121, "Throttle position sensor stuck"},
+    {19, 0x1019, "Sidestand switch circuit"},
+    {21, 0x0115, "Coolant temperature sensor"},
+    {22, 0x0110, "Intake air temperature sensor"},
+    {24, 0x0130, "O2 sensor"},
+    {30, 0x1030, "Latch up detected (bike fell over)"},
+    {33, 0x0351, "Ignition coil primary circuit"},
+    {39, 0x0201, "Fuel injector circuit"},
+    {41, 0x1041, "Lean angle sensor circuit"},
+    {42, 0x0500, "Speed sensor or neutral switch"},
+    {43, 0x1043, "Fuel system voltage"},
+    {44, 0x0601, "EEPROM error"},
+    {46, 0x0560, "Charging voltage"},
+    {50, 0x0605, "ECU memory fault"},
+};
+
+const YamahaFault *findFault(uint8_t code)
+{
+  for (const YamahaFault &fault : yamahaFaults)
+  {
+    if (fault.code == code)
+    {
+      return &fault;
+    }
+  }
+  return nullptr;
+}
+
+uint16_t dtcFor(uint8_t code)
+{
+  if (const YamahaFault *fault = findFault(code))
+  {
+    return fault->dtc;
+  }
+  // P10xx with the decimal Yamaha code as the digits, codes past 99 keep the
+  // last two digits
+  return 0x1000 | ((code / 10 % 10) << 4) | (code % 10);
+}
+
+const char *faultName(uint8_t code)
+{
+  const YamahaFault *fault = findFault(code);
+  return fault ? fault->name : "Unknown Yamaha code";
+}
+
+// "P0335", the top two bits pick P/C/B/U
+std::string dtcText(uint16_t dtc)
+{
+  char text[6];
+  snprintf(text, sizeof(text), "%c%04X", "PCBU"[dtc >> 14], dtc & 0x3FFF);
+  return text;
+}
+
+const uint8_t FREEZE_SECONDS = 5;
+const size_t DTC_MAX = 8; // Stored codes
+static_assert(FREEZE_SECONDS < HISTORY_FALLBACK_SECONDS, "freeze frame longer than the history");
+
+struct DtcLog
+{
+  uint8_t stored[DTC_MAX] = {};
+  uint8_t storedCount = 0;
+  uint8_t active = 0; // Code in the newest frame, 0 = none
+
+  // Freeze frame waiting for the main loop to write it
+  uint32_t snapshotUs = 0; // Frame that reported the code
+  uint8_t snapshotCode = 0;
+  bool snapshotPending = false;
+
+  bool clearPending = false; // Mode 04, freeze files to delete
+  uint32_t freezeFrames = 0; // Taken since boot
+  uint32_t missed = 0;       // New codes while a freeze frame was still pending or the list was full
+
+  void frame(const ChannelSample &sample)
+  {
+    active = sample.error;
+    if (active == 0 || isStored(active))
+    {
+      return;
+    }
+
+    if (storedCount == DTC_MAX)
+    {
+      missed++;
+      return;
+    }
+    stored[storedCount++] = active;
+
+    if (snapshotPending)
+    {
+      missed++;
+      return;
+    }
+    snapshotUs = sample.timeUs;
+    snapshotCode = active;
+    snapshotPending = true;
+    freezeFrames++;
+  }
+
+  bool isStored(uint8_t code) const
+  {
+    for (uint8_t i = 0; i < storedCount; ++i)
+    {
+      if (stored[i] == code)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Code found on flash at boot, its freeze frame is already saved
+  void restore(uint8_t code)
+  {
+    if (code != 0 && storedCount < DTC_MAX && !isStored(code))
+    {
+      stored[storedCount++] = code;
+    }
+  }
+
+  // Mode 04, the ECU sets a code that is still present again on its next frame
+  void clear()
+  {
+    storedCount = 0;
+    active = 0;
+    snapshotPending = false;
+    clearPending = true;
+  }
+
+  // Mode 03 / 07 reply, "43 02 03 35 01 15", count byte first as on CAN
+  std::string reply(uint8_t mode, const uint8_t *codes, uint8_t count) const
+  {
+    char text[8 + DTC_MAX * 6];
+    int length = snprintf(text, sizeof(text), "%02X %02X", mode, count);
+    for (uint8_t i = 0; i < count; ++i)
+    {
+      uint16_t dtc = dtcFor(codes[i]);
+      length += snprintf(text + length, sizeof(text) - length, " %02X %02X", dtc >> 8, dtc & 0xFF);
+    }
+    return text;
+  }
+
+  std::string storedReply() const
+  {
+    return reply(0x43, stored, storedCount);
+  }
+
+  std::string pendingReply() const
+  {
+    return reply(0x47, &active, active ? 1 : 0);
+  }
+};
+
+DtcLog dtcLog;
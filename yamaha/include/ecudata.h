@@ -0,0 +1,304 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <ecuprofile.h>
+#include <kline.h>
+#include <rollup.h>
+#include <channelhistory.h>
+#include <dtc.h>
+#include <triggers.h>
+#include <sessionlog.h>
+#include <trace.h>
+
+// ECU data
+//
+// Decoded K-line frames -> PID values. The host tools in /tools run the same
+// decode path through tools/native.h.
+
+extern void sendResponse(const std::string &message);
+extern bool Debug_YAM;
+
+// ECU decoder, specialised for the profile selected in ecuprofile.h
+using Decoder = KLineDecoder<EcuProfile>;
+Decoder kline;
+
+// Buffer sizes
+#define VEHICLE_SPEED_RAW_BUFFER_SIZE EcuProfile::SPEED_FRAMES
+
+// Yamaha RX Buffers
+using t_buffer_item = uint8_t;
+uint8_t Vehicle_Speed_Raw_Buffer[VEHICLE_SPEED_RAW_BUFFER_SIZE];
+
+// Buffer indices and time variables
+uint8_t VehicleSpeedRawBufferIndex = 0;
+
+// Gears
+uint8_t gear_speed = 0;
+uint16_t gear_rpm = 0;
+bool Gear_Speed_Ready = false;
+bool Gear_RPM_Ready = false;
+
+// Top Speed
+uint8_t MaxSpeed = 0;
+
+// Per second / minute aggregates, histograms and peaks
+Rollups rollups;
+
+// Frame clock, tells ELM long-poll when the next frame is due
+uint32_t ecuFrameCount = 0;
+uint32_t ecuLastFrameUs = 0;
+uint32_t ecuFramePeriodUs = EcuProfile::FRAME_PERIOD_US;
+
+// PIDS
+uint16_t RPM_PID;        // RPM * RPM_SCALE = RAW
+uint8_t Speed_PID;       // RAW km/h
+uint8_t Coolant_PID;     // Temp = RAW + COOLANT_OFFSET
+uint8_t Error_PID;       // Error code
+uint8_t Gear_PID = 0;    // RAW 
+uint8_t Temp_PID;        // MCU Temp C
+uint8_t CPU_PID;         // CPU Freq mhz
+uint16_t RAM_Free_PID;   // Free Ram kb
+uint8_t Max_Speed_PID;   // Max Speed Reached
+uint16_t MCU_Uptime_PID; // Seconds
+uint8_t BLE_Interval_PID; // BLE connection interval ms
+uint16_t RPM_Max_1s_PID;  // Highest RPM of the last complete second
+uint16_t RPM_Min_1s_PID;  // Lowest RPM of the last complete second
+uint8_t Speed_Max_1s_PID; // Highest speed of the last complete second
+uint16_t RPM_Mean_1m_PID; // Mean RPM of the last complete minute
+uint16_t RPM_Peak_PID;    // Highest RPM this ride
+uint16_t Heap_Largest_PID; // Largest free heap block kb
+uint16_t Heap_Min_PID;     // Lowest free heap since boot kb
+uint16_t Decode_Lag_PID;   // Worst capture to decode delay of the last second us
+
+// Function declarations
+void decodeByte(uint8_t receivedByte, uint32_t timeUs);
+void alignedFrame(const uint8_t *frame);
+void handleDiagData(const uint8_t *frame);
+void handleNormalData(const uint8_t *frame);
+void resetEcuData();
+void updateFrameClock(uint32_t timeUs);
+void updateRollups(uint32_t timeUs);
+void updateHistory(uint32_t timeUs);
+void updateDtcs(uint32_t timeUs);
+void updateTriggers(uint32_t timeUs);
+void updateSessionLog(uint32_t timeUs);
+void setMidStreamLock(bool enabled);
+void calculateRPM(uint16_t rpm);
+void calculateVehicleSpeed(t_buffer_item speedByte);
+void extractErrorCode(t_buffer_item Error);
+void calculateCoolantTemp(uint8_t Temp);
+void maximumSpeed();
+
+void decodeByte(uint8_t receivedByte, uint32_t timeUs)
+{
+  switch (kline.feed(receivedByte, timeUs))
+  {
+  case Decoder::IMMO_START:
+    TRACE_INFO(TRACE_IMMO_START, 0, 0);
+    rollups.clear(); // New ride
+    channelHistory.clear();
+    sendResponse("Starting IMMO sequence.");
+    break;
+  case Decoder::DIAG_START:
+    TRACE_INFO(TRACE_DIAG_START, 0, 0);
+    sendResponse("Diag start initiated.");
+    break;
+  case Decoder::NORMAL_START:
+    TRACE_INFO(TRACE_NORMAL_START, 0, 0);
+    sendResponse("Normal start initiated.");
+    break;
+  case Decoder::LOCKED:
+    TRACE_INFO(TRACE_LOCKED, kline.acquireTimeUs() / 1000, 0);
+    sendResponse("Mid-stream lock after " + std::to_string(kline.acquireTimeUs() / 1000) + " ms, normal data.");
+    // Only ever follows a reset, so a new ride too
+    rollups.clear();
+    channelHistory.clear();
+    [[fallthrough]]; // The frame that locked is decoded too
+  case Decoder::FRAME:
+    alignedFrame(kline.frame());
+    updateFrameClock(timeUs);
+    updateRollups(timeUs);
+    updateHistory(timeUs);
+    updateDtcs(timeUs);
+    updateTriggers(timeUs);
+    updateSessionLog(timeUs);
+    break;
+  default:
+    break;
+  }
+}
+
+void alignedFrame(const uint8_t *frame)
+{
+  if (kline.inDiagMode())
+  {
+    handleDiagData(frame);
+  }
+  else
+  {
+    handleNormalData(frame);
+  }
+}
+
+void handleDiagData(const uint8_t *frame)
+{
+  sendResponse("Diag menu!");
+}
+
+void handleNormalData(const uint8_t *frame)
+{
+
+  maximumSpeed();
+
+  if (Debug_YAM)
+  {
+    TRACE_DEBUG(TRACE_FRAME, Decoder::rpm(frame), Decoder::speedRaw(frame));
+  }
+  calculateRPM(Decoder::rpm(frame));
+  calculateVehicleSpeed(Decoder::speedRaw(frame));
+  extractErrorCode(Decoder::errorCode(frame));
+  calculateCoolantTemp(Decoder::coolant(frame));
+}
+
+void resetEcuData()
+{
+  kline.reset();
+  Gear_PID = 0;
+  Coolant_PID = 0;
+  RPM_PID = 0;
+  Speed_PID = 0;
+  Error_PID = 0;
+  ecuFramePeriodUs = EcuProfile::FRAME_PERIOD_US;
+}
+
+void updateFrameClock(uint32_t timeUs)
+{
+  // Running average of the cadence, gaps in the stream are not a period
+  uint32_t interval = timeUs - ecuLastFrameUs;
+  if (ecuFrameCount > 0 && interval < EcuProfile::PREAMBLE_GAP_US)
+  {
+    ecuFramePeriodUs += ((int32_t)interval - (int32_t)ecuFramePeriodUs) / 8;
+  }
+  ecuLastFrameUs = timeUs;
+  ecuFrameCount++;
+}
+
+void updateRollups(uint32_t timeUs)
+{
+  if (kline.inDiagMode() || !rollups.frame(timeUs, RPM_PID, Speed_PID, Coolant_PID))
+  {
+    return;
+  }
+
+  // A second closed, refresh the rollup PIDs
+  const RollupChannel &rpm = rollups.channels[ROLLUP_RPM];
+  RPM_Max_1s_PID = rpm.lastSecond.max;
+  RPM_Min_1s_PID = rpm.lastSecond.min;
+  RPM_Mean_1m_PID = rpm.lastMinute.mean() + 0.5;
+  RPM_Peak_PID = rpm.peak;
+  Speed_Max_1s_PID = rollups.channels[ROLLUP_SPEED].lastSecond.max;
+}
+
+// Full rate history of every channel, see channelhistory.h
+void updateHistory(uint32_t timeUs)
+{
+  if (kline.inDiagMode())
+  {
+    return;
+  }
+  channelHistory.add({timeUs, RPM_PID, Speed_PID, Coolant_PID, Error_PID, Gear_PID}, kline.frame());
+}
+
+// Picks up new fault codes, see dtc.h
+void updateDtcs(uint32_t timeUs)
+{
+  if (kline.inDiagMode())
+  {
+    return;
+  }
+  dtcLog.frame({timeUs, RPM_PID, Speed_PID, Coolant_PID, Error_PID, Gear_PID});
+}
+
+// Capture windows around configured conditions, see triggers.h
+void updateTriggers(uint32_t timeUs)
+{
+  if (kline.inDiagMode())
+  {
+    return;
+  }
+  triggerCapture.frame({timeUs, RPM_PID, Speed_PID, Coolant_PID, Error_PID, Gear_PID});
+}
+
+// Every normal frame of the ride into LOG<n>.BIN, see sessionlog.h
+void updateSessionLog(uint32_t timeUs)
+{
+  if (kline.inDiagMode())
+  {
+    return;
+  }
+  const int32_t channels[LOG_CHANNELS - 1] = {RPM_PID, Speed_PID, Coolant_PID, Error_PID, Gear_PID};
+  sessionLog.frame(timeUs, channels);
+}
+
+void setMidStreamLock(bool enabled)
+{
+  kline.setMidStreamLock(enabled);
+}
+
+void calculateRPM(uint16_t rpm)
+{
+  // Assign the scaled RPM value directly to RPM_PID and gear_rpm.
+  RPM_PID = rpm; // Correct up to 255 * RPM_SCALE
+  gear_rpm = RPM_PID;
+}
+
+void calculateVehicleSpeed(t_buffer_item speedByte)
+{
+
+  if (VehicleSpeedRawBufferIndex < VEHICLE_SPEED_RAW_BUFFER_SIZE)
+  {
+    Vehicle_Speed_Raw_Buffer[VehicleSpeedRawBufferIndex++] = speedByte;
+  }
+
+  // Check if the buffer is full.
+  if (VehicleSpeedRawBufferIndex == VEHICLE_SPEED_RAW_BUFFER_SIZE)
+  {
+    int totalSpeed = 0;
+    for (int i = 0; i < VEHICLE_SPEED_RAW_BUFFER_SIZE; ++i)
+    {
+      totalSpeed += Vehicle_Speed_Raw_Buffer[i]; // Accumulate speed data.
+    }
+
+    // Process the accumulated speed data.
+    Speed_PID = totalSpeed;
+    MaxSpeed = totalSpeed;
+
+    gear_speed = Speed_PID;
+
+    // Keep sync of Speed/RPM
+    Gear_Speed_Ready = true;
+    Gear_RPM_Ready = true;
+
+    // Reset the buffer index to 0 for the next frame.
+    VehicleSpeedRawBufferIndex = 0;
+  }
+}
+
+void extractErrorCode(t_buffer_item Error)
+{
+  Error_PID = Error;
+}
+
+void calculateCoolantTemp(uint8_t Temp)
+{
+  Coolant_PID = Temp;
+}
+
+void maximumSpeed()
+{
+  // All time top speed, loaded from SPIFFS at boot and saved on bike off
+  if (Speed_PID > Max_Speed_PID)
+  {
+    Max_Speed_PID = Speed_PID;
+  }
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+
+// ECU model profiles
+//
+// Every Yamaha K-line dialect is described by a struct of constexpr traits.
+// The decoder (kline.h) and the PID scaling are templated on the profile that
+// is selected at build time, so all frame offsets and constants fold away and
+// the hot path costs the same as the old hard-wired XT660 code.
+//
+// To add a model: copy XT660Profile, adjust the traits, add an ECU_PROFILE_xxx
+// switch at the bottom and set it in platformio.ini build_flags.
+
+struct XT660Profile
+{
+  static constexpr const char *NAME = "XT660";
+  static constexpr uint32_t BAUD = 16040;
+
+  // IMMO / startup handshake
+  static constexpr uint8_t IMMO_START_BYTE = 0x3E; // First byte after key on
+  static constexpr uint8_t IMMO_LENGTH = 61;       // Bytes incl. the start byte
+  static constexpr uint8_t DIAG_START_BYTE = 0xCD; // Last IMMO byte = diag mode
+  static constexpr uint32_t PREAMBLE_GAP_US = 100000; // Line silence before a real start byte
+
+  // Mid-stream acquisition without a preamble
+  static constexpr uint8_t LOCK_FRAMES = 8; // Consistent frames needed to lock
+
+  // Normal data frame
+  static constexpr uint8_t FRAME_LENGTH = 5; // Data bytes + checksum
+  static constexpr uint8_t RPM_INDEX = 0;
+  static constexpr uint8_t SPEED_INDEX = 1;
+  static constexpr uint8_t ERROR_INDEX = 2;
+  static constexpr uint8_t COOLANT_INDEX = 3;
+
+  // Scaling
+  static constexpr uint16_t RPM_SCALE = 50;      // RPM * 50 = RAW
+  static constexpr int16_t COOLANT_OFFSET = -30; // Temp = RAW - 30
+  static constexpr uint8_t SPEED_FRAMES = 8;     // Speed is summed over 8 frames
+  static constexpr uint32_t FRAME_PERIOD_US = 14286; // Nominal cadence, ~70 frames/s
+
+  // Gearbox
+  static constexpr uint8_t MAX_GEARS = 5;
+};
+
+// Build time selection. XT660 is the only dialect with known traits so far,
+// a model gets its ECU_PROFILE_xxx case here once its frames have been
+// captured and run through kline_rig
+using EcuProfile = XT660Profile;
@@ -3,20 +3,13 @@
 #include <iostream>
 #include <iomanip>
 #include <sstream>
+#include <stdio.h>
+#include <pidregistry.h>
+#include <elmsession.h>
+#include <dtc.h>
 
 // handle Sending
 //extern void sendResponse(const std::string & message);
-// PIDS
-extern uint16_t RPM_PID; // RPM * 50 = RAW
-extern uint8_t Speed_PID; // RAW km/h
-extern uint8_t Coolant_PID; // Temp = RAW
-extern uint8_t Error_PID; // Error code
-extern uint8_t Gear_PID; // RAW 00-05
-extern uint8_t Temp_PID; // MCU Temp
-extern uint8_t CPU_PID; // CPU Freq mhz
-extern uint8_t RAM_Free_PID; // Free Ram
-extern uint8_t Max_Speed_PID; // Max Speed Reached
-extern uint16_t MCU_Uptime_PID;
 
 // Function to convert a PID value to hexadecimal string
 template < typename T >
@@ -34,27 +27,67 @@ template < typename T >
     return stream.str();
   }
 
-std::string handleCommand(const std::string & command) {
+// Reply for a registry PID, e.g. "41 0C 0bb8"
+std::string pidReply(const PidInfo & pid) {
+  uint16_t value = pidValue(pid);
+  return std::string(pid.reply) + " " + (pid.bytes == 2 ? hexToString < uint16_t > (value) : hexToString < uint8_t > (value));
+}
+
+// Supported PIDs [base+01 - base+20], computed from the registry
+std::string pidBitmapReply(uint8_t base) {
+  if (base > pidHighestMode01())
+    return "NO DATA";
+  uint32_t bits = pidBitmaps[base >> 5];
+  char reply[24];
+  snprintf(reply, sizeof(reply), "41 %02X %02X %02X %02X %02X", base, (unsigned)(bits >> 24), (unsigned)(bits >> 16) & 0xFF,
+    (unsigned)(bits >> 8) & 0xFF, (unsigned) bits & 0xFF);
+  return reply;
+}
+
+// "010C", "1001" or with the RaceChrono +1 response suffix "010C 1"
+bool isPidRequest(const std::string & command, uint16_t & pid) {
+  if (command.size() != 4 && !(command.size() == 6 && command.compare(4, 2, " 1") == 0))
+    return false;
+  for (int i = 0; i < 4; ++i) {
+    if (!isxdigit(static_cast < unsigned char > (command[i])))
+      return false;
+  }
+  pid = strtoul(command.substr(0, 4).c_str(), nullptr, 16);
+  return true;
+}
+
+std::string handleCommand(const std::string & command, ElmSession * session) {
+  uint16_t pid;
   if (command == "ATI" || command == "AT@1")
     return "ELM327 v2.1";
-  else if (command == "ATS1" || command == "AT S1")
-    // Implementation for ATS1
+  else if (command == "ATS1" || command == "AT S1") {
+    if (session)
+      session->spacesOff = false;
     return "OK";
-  else if (command == "ATS0" || command == "AT S0")
-    // Implementation for ATS0
+  }
+  else if (command == "ATS0" || command == "AT S0") {
+    if (session)
+      session->spacesOff = true;
     return "OK";
-  else if (command == "ATH1" || command == "AT H1")
-    // Implementation for ATH1
+  }
+  else if (command == "ATH1" || command == "AT H1") {
+    if (session)
+      session->headers = true;
     return "OK";
-  else if (command == "ATH0" || command == "AT H0")
-    // Implementation for ATH0
+  }
+  else if (command == "ATH0" || command == "AT H0") {
+    if (session)
+      session->headers = false;
     return "OK";
-  else if (command == "ATZ")
-    // Implementation for ATZ
+  }
+  else if (command == "ATZ" || command == "ATD") {
+    // Back to the defaults, headers off and spaces on
+    if (session)
+      session->defaults();
     return "OK";
+  }
   else if (
     command == "ATE0" ||
-    command == "ATD" ||
     command == "ATPC" ||
     command == "ATM0" ||
     command == "ATL0" ||
@@ -70,37 +103,22 @@ std::string handleCommand(const std::string & command) {
     return "OK";
   else if (command == "ATDPN")
     return "6"; // Protocol Number 6 CAN bus
-  else if (command == "0100") // PID 1 - Supported PIDs [01-20]
-    return "41 00 08 18 00 01";
-  else if (command == "0120") // PID 2 - Supported PIDs [21-40]
-    return "41 20 00 00 00 01";
-  else if (command == "0140") // PID 3 - Supported PIDs [41-60]
-    return "41 40 00 00 00 01";
-  else if (command == "0160") // PID 4 - Supported PIDs [61-80]
-    return "41 60 00 00 00 01";
-  else if (command == "0180") // PID 5 - Supported PIDs [81-A0]
-    return "41 80 00 00 00 00";
-  else if (command == "01A0") // PID 6 - Supported PIDs [A1-C0]
-    return "41 A0 10 00 00 00 00";
-  else if (command == "01C0") // PID 7 - Supported PIDs [C1-E0]
-    return "41 C0 NO DATA";
-  else if (command == "0105") // Engine Coolant Temperature (PID 0105)
-    return "41 05 " + hexToString(Coolant_PID);
-  else if (command == "0105 1") // Engine Coolant Temperature (PID 0105)  // Race chrono +1 response
-    return "41 05 " + hexToString(Coolant_PID);
-  else if (command == "010C") // RPM (PID 010C)
-    return "41 0C " + hexToString(RPM_PID);
-  else if (command == "010C 1") // RPM (PID 010C) // race chrono +1 response
-    return "41 0C " + hexToString(RPM_PID);
-  else if (command == "010D") // Vehicle Speed (PID 010D)
-    return "41 0D " + hexToString(Speed_PID);
-  else if (command == "010D 1") // Vehicle Speed (PID 010D) // race chrono +1 response
-    return "41 0D " + hexToString(Speed_PID);
-  else if (command == "01A4") // Transmission Actual Gear (PID 01A4)
-    return "41 A4 " + hexToString(Gear_PID);
-  else if (command == "01A4 1") // Transmission Actual Gear (PID 01A4) // +1
-    return "41 A4 " + hexToString(Gear_PID);
-  else if (command == "0902") // VIN (PID 0902)
+  else if (command == "03") // Stored DTCs, see dtc.h
+    return dtcLog.storedReply();
+  else if (command == "07") // Pending DTCs
+    return dtcLog.pendingReply();
+  else if (command == "04") { // Clear DTCs and freeze frames
+    dtcLog.clear();
+    return "44";
+  }
+  else if (isPidRequest(command, pid)) {
+    // Registry PIDs and the supported-PID bitmaps, see pidregistry.h
+    if ((pid >> 8) == 0x01 && (pid & 0x1F) == 0)
+      return pidBitmapReply(pid & 0xFF);
+    if (const PidInfo * info = findPid(pid))
+      return pidReply( * info);
+  }
+  if (command == "0902") // VIN (PID 0902)
     return "49 02 00 00 59 41 4D 41 48 41 45 53 50 33 32 4F 44 42";
   else if (command == "0904") // Calibration ID (PID 0904)
     return "49 04 00 00 00 00";
@@ -108,33 +126,6 @@ std::string handleCommand(const std::string & command) {
     return "49 0A 45 53 50 33 32 37 45 6D 75 6C 61 74 6F 72 00 00 00 00 00 00";
   else if (command == "01009") // ???
     return "41 009 NO DATA";
-
-  // custom PIDS
-
-  else if (command == "1001 1") // Error code ( Custom PID 0901) // +1
-    return "41 02 " + hexToString(Error_PID);
-  else if (command == "1001") // Error code ( Custom PID 0901)
-    return "41 02 " + hexToString(Error_PID);
-  else if (command == "1002 1") // MCU Temp C ( Custom PID 0903) // +1
-    return "41 02 " + hexToString(Temp_PID);
-  else if (command == "1002") // MCU Temp C ( Custom PID 0903)
-    return "41 02 " + hexToString(Temp_PID);
-  else if (command == "1003 1") // CPU Freq mhz ( Custom PID 0904) // +1
-    return "41 02 " + hexToString(CPU_PID);
-  else if (command == "1003") // CPU Freq mhz ( Custom PID 0904)
-    return "41 02 " + hexToString(CPU_PID);
-  else if (command == "1004 1") // Free Ram ( Custom PID 0905) // +1
-    return "41 02 " + hexToString(RAM_Free_PID);
-  else if (command == "1004") // Free Ram ( Custom PID 0905)
-    return "41 02 " + hexToString(RAM_Free_PID);
-  else if (command == "1005 1") // Max Speed ( Custom PID 0907) // +1
-    return "41 02 " + hexToString(Max_Speed_PID);
-  else if (command == "1005") // Max Speed ( Custom PID 0907)
-    return "41 02 " + hexToString(Max_Speed_PID);
-  else if (command == "1006 1") // Max Speed ( Custom PID 0907) // +1
-    return "41 02 " + hexToString(MCU_Uptime_PID);
-  else if (command == "1006") // Max Speed ( Custom PID 0907)
-    return "41 02 " + hexToString(MCU_Uptime_PID);
   else {
 
     if (!command.empty()) {
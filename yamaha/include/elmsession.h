@@ -0,0 +1,142 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <string>
+#include <algorithm>
+#include <pidregistry.h>
+
+// Function declaration for handling commands, AT settings go to the session
+struct ElmSession;
+std::string handleCommand(const std::string &command, ElmSession *session = nullptr);
+
+// Replies waiting for a notify slot, the oldest is dropped past this
+const size_t ELM_TX_QUEUE_LIMIT = 50;
+
+// Frame clock, see ecudata.h
+extern uint32_t ecuFrameCount;
+extern uint32_t ecuLastFrameUs;
+extern uint32_t ecuFramePeriodUs;
+
+// Long-poll settings and counters, shared by all sessions
+struct ElmLongPoll
+{
+  bool enabled = false;
+  uint32_t windowUs = 6000;   // Hold a request when the next frame is due within this
+  uint32_t timeoutUs = 12000; // Answer with the current value after this at the latest
+  uint32_t held = 0;
+  uint32_t fresh = 0;   // Answered from the frame they waited for
+  uint32_t expired = 0; // Answered on timeout
+};
+
+ElmLongPoll elmLongPoll;
+
+// ELM327 session
+//
+// Per client ELM settings and reply shaping. The BLE transport and the native
+// host tools run the exact same command path.
+struct ElmSession
+{
+  bool headers = false;   // ATH1, prefix mode 01 replies with a CAN header
+  bool spacesOff = false; // ATS0, strip spaces from replies
+
+  // ATZ and ATD
+  void defaults()
+  {
+    headers = false;
+    spacesOff = false;
+  }
+
+  // Modify the response based on session settings
+  std::string shape(const std::string &command, const std::string &response) const
+  {
+    std::string amendedResponse = response;
+
+    // CAN header and the byte count of the reply, "7E8 04 41 0C 0bb8"
+    if (headers && command.rfind("01", 0) == 0 && response.rfind("41", 0) == 0)
+    {
+      size_t digits = 0;
+      for (size_t i = 0; i < response.size() && response[i] != '\r'; ++i)
+      {
+        digits += isxdigit(static_cast<unsigned char>(response[i])) != 0;
+      }
+      char header[8];
+      snprintf(header, sizeof(header), "7E8 %02X ", (unsigned)(digits / 2));
+      amendedResponse = header + amendedResponse;
+    }
+
+    if (spacesOff)
+    {
+      amendedResponse.erase(std::remove(amendedResponse.begin(), amendedResponse.end(), ' '), amendedResponse.end());
+    }
+    return amendedResponse;
+  }
+
+  // Full reply for one command line, prompt included
+  std::string reply(const std::string &command)
+  {
+    return shape(command, handleCommand(command, this) + "\r>");
+  }
+
+  // Long-poll: a K-line PID request that arrives shortly before the next
+  // frame is due waits for that frame, so the app gets the newest sample and
+  // never the same one twice. ELM is strictly request/response, so nothing
+  // else is answered while a request is held.
+  bool holding() const
+  {
+    return !heldCommand.empty();
+  }
+
+  // True when the command is held, collect the reply with release()
+  bool hold(const std::string &command, uint32_t nowUs)
+  {
+    if (!elmLongPoll.enabled || ecuFrameCount == 0 || command.size() < 4 || command.compare(0, 2, "01") != 0)
+    {
+      return false;
+    }
+
+    const PidInfo *pid = findPid(strtoul(command.substr(0, 4).c_str(), nullptr, 16));
+    if (!pid || pid->source == PID_SOURCE_MCU)
+    {
+      return false;
+    }
+
+    int32_t dueUs = (int32_t)(ecuLastFrameUs + ecuFramePeriodUs - nowUs);
+    if (dueUs <= 0 || (uint32_t)dueUs > elmLongPoll.windowUs)
+    {
+      return false;
+    }
+
+    heldCommand = command;
+    heldUs = nowUs;
+    heldFrame = ecuFrameCount;
+    elmLongPoll.held++;
+    return true;
+  }
+
+  // Reply for the held request once its frame decoded or it timed out
+  bool release(uint32_t nowUs, std::string &replyText)
+  {
+    if (!holding())
+    {
+      return false;
+    }
+
+    bool fresh = ecuFrameCount != heldFrame;
+    if (!fresh && nowUs - heldUs < elmLongPoll.timeoutUs)
+    {
+      return false;
+    }
+
+    fresh ? elmLongPoll.fresh++ : elmLongPoll.expired++;
+    replyText = reply(heldCommand);
+    heldCommand.clear();
+    return true;
+  }
+
+private:
+  std::string heldCommand;
+  uint32_t heldUs = 0;
+  uint32_t heldFrame = 0;
+};
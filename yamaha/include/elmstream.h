@@ -0,0 +1,96 @@
+#pragma once
+#include <ctype.h>
+#include <stdint.h>
+#include <string>
+#include <elmsession.h>
+
+// TCP transport, WiFi ELM327 adapters listen on this port, one ElmStream per client
+#define ELM_TCP_PORT 35000
+#define ELM_TCP_MAX_CLIENTS 4
+
+// ELM327 over a byte stream
+//
+// Line framing for the TCP transport and the host rig. Received bytes are
+// buffered until CR or LF and every complete line is answered straight away,
+// so a client can pipeline several requests in one packet and gets the
+// replies back in order. A held long-poll request stops the line until its
+// frame decodes, the way a busy ELM327 reads nothing until it has answered.
+struct ElmStream
+{
+  static const size_t INPUT_LIMIT = 256; // Unanswered bytes kept per client
+
+  ElmSession session;
+  std::string input;
+  uint32_t requests = 0;
+  uint32_t overflows = 0; // Input dropped for lack of a line end
+
+  // Bytes the transport may read into the stream right now
+  size_t room() const
+  {
+    return input.size() < INPUT_LIMIT ? INPUT_LIMIT - input.size() : 0;
+  }
+
+  void receive(const char *data, size_t length)
+  {
+    input.append(data, length);
+  }
+
+  // Everything that can be answered now, prompts included
+  std::string service(uint32_t nowUs)
+  {
+    std::string output;
+    std::string held;
+    if (session.release(nowUs, held))
+    {
+      output += held;
+    }
+
+    std::string command;
+    while (!session.holding() && nextCommand(command))
+    {
+      requests++;
+      if (session.hold(command, nowUs))
+      {
+        break;
+      }
+      output += session.reply(command);
+    }
+
+    // A full buffer without a line end is not ELM, start over
+    if (room() == 0 && input.find_first_of("\r\n") == std::string::npos)
+    {
+      input.clear();
+      overflows++;
+    }
+    return output;
+  }
+
+private:
+  // Next complete line, trimmed and upper case, empty lines skipped
+  bool nextCommand(std::string &command)
+  {
+    for (;;)
+    {
+      size_t end = input.find_first_of("\r\n");
+      if (end == std::string::npos)
+      {
+        return false;
+      }
+
+      command.clear();
+      for (size_t i = 0; i < end; ++i)
+      {
+        command += toupper((unsigned char)input[i]);
+      }
+      input.erase(0, end + 1);
+
+      size_t first = command.find_first_not_of(' ');
+      if (first == std::string::npos)
+      {
+        continue;
+      }
+      command = command.substr(first, command.find_last_not_of(' ') - first + 1);
+      return true;
+    }
+  }
+};
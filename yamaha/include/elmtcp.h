@@ -0,0 +1,165 @@
+#pragma once
+#include <Arduino.h>
+#include <WiFi.h>
+#include <algorithm>
+#include <string>
+#include <elmstream.h>
+#include <powerscale.h>
+
+// ELM327 over TCP
+//
+// Soft-AP with the addressing cheap WiFi ELM327 adapters use, 192.168.0.10
+// port 35000, so apps and PC tools that already know those adapters connect
+// without setup. Every TCP client gets its own ElmStream and can pipeline as
+// many requests as it likes, where BLE needs a write and a notify per PID.
+// Off by default, the radio is shared with BLE and the AP costs heap.
+
+#ifndef ELM_TCP_SSID
+#define ELM_TCP_SSID "WiFi_OBDII"
+#endif
+#ifndef ELM_TCP_PASSWORD
+#define ELM_TCP_PASSWORD "" // Open like the adapters, WPA2 needs 8 characters or more
+#endif
+
+extern void sendResponse(const std::string &message);
+
+struct ElmTcpClient
+{
+  WiFiClient socket;
+  ElmStream stream;
+};
+
+bool elmTcpRunning = false;
+WiFiServer elmTcpServer(ELM_TCP_PORT);
+ElmTcpClient elmTcpClients[ELM_TCP_MAX_CLIENTS];
+uint32_t elmTcpRejected = 0; // Connections refused, all slots busy
+
+bool elmTcpStart()
+{
+  if (elmTcpRunning)
+  {
+    return true;
+  }
+
+  IPAddress address(192, 168, 0, 10);
+  IPAddress mask(255, 255, 255, 0);
+  WiFi.mode(WIFI_AP);
+  if (!WiFi.softAPConfig(address, address, mask) ||
+      !WiFi.softAP(ELM_TCP_SSID, strlen(ELM_TCP_PASSWORD) ? ELM_TCP_PASSWORD : nullptr))
+  {
+    WiFi.mode(WIFI_OFF);
+    return false;
+  }
+
+  elmTcpServer.begin();
+  elmTcpServer.setNoDelay(true);
+  elmTcpRunning = true;
+  return true;
+}
+
+void elmTcpStop()
+{
+  if (!elmTcpRunning)
+  {
+    return;
+  }
+
+  for (ElmTcpClient &client : elmTcpClients)
+  {
+    client.socket.stop();
+    client.stream = ElmStream();
+  }
+  elmTcpServer.end();
+  WiFi.softAPdisconnect(true);
+  WiFi.mode(WIFI_OFF);
+  elmTcpRunning = false;
+}
+
+size_t elmTcpConnected()
+{
+  size_t count = 0;
+  for (ElmTcpClient &client : elmTcpClients)
+  {
+    if (client.socket.connected())
+    {
+      count++;
+    }
+  }
+  return count;
+}
+
+void elmTcpAccept()
+{
+  if (!elmTcpServer.hasClient())
+  {
+    return;
+  }
+
+  WiFiClient incoming = elmTcpServer.available();
+  for (ElmTcpClient &client : elmTcpClients)
+  {
+    if (!client.socket.connected())
+    {
+      client.socket.stop();
+      client.socket = incoming;
+      client.socket.setNoDelay(true);
+      client.stream = ElmStream();
+      sendResponse("TCP ELM client " + std::string(incoming.remoteIP().toString().c_str()) + " connected, " +
+                   std::to_string(elmTcpConnected()) + " of " + std::to_string(ELM_TCP_MAX_CLIENTS));
+      return;
+    }
+  }
+  incoming.stop();
+  elmTcpRejected++;
+}
+
+void elmTcpWrite(ElmTcpClient &client, const std::string &reply)
+{
+  if (!reply.empty())
+  {
+    PmLock lock(PM_BURST_ELM);
+    client.socket.write(reinterpret_cast<const uint8_t *>(reply.data()), reply.size());
+  }
+}
+
+// Called every loop, answers whatever each client has sent
+void elmTcpService()
+{
+  if (!elmTcpRunning)
+  {
+    return;
+  }
+
+  elmTcpAccept();
+  for (ElmTcpClient &client : elmTcpClients)
+  {
+    if (!client.socket.connected())
+    {
+      continue;
+    }
+
+    char buffer[128];
+    size_t length = std::min({(size_t)client.socket.available(), client.stream.room(), sizeof(buffer)});
+    if (length == 0 && (client.stream.input.empty() || client.stream.session.holding()))
+    {
+      // Idle or waiting on a held request, the full clock is only taken
+      // for the reply once the hold releases
+      if (client.stream.session.holding())
+      {
+        elmTcpWrite(client, client.stream.service(micros()));
+      }
+      continue;
+    }
+
+    PmLock lock(PM_BURST_ELM);
+    if (length > 0)
+    {
+      int received = client.socket.read(reinterpret_cast<uint8_t *>(buffer), length);
+      if (received > 0)
+      {
+        client.stream.receive(buffer, received);
+      }
+    }
+    elmTcpWrite(client, client.stream.service(micros()));
+  }
+}
@@ -1,9 +1,11 @@
 #pragma once
 #include <vector>
+#include <algorithm>
 #include <unordered_map>
 #include <cmath>
 #include <SPI.h>
 #include <SPIFFS.h>
+#include <ecuprofile.h>
 
 // Main
 extern bool Gear_Speed_Ready;
@@ -11,6 +13,7 @@ extern bool Gear_RPM_Ready;
 extern uint8_t gear_speed;
 extern uint16_t gear_rpm;
 extern uint8_t Gear_PID;
+extern uint32_t Time;
 extern void sendResponse(const std::string & message);
 
 bool gearLearning = false;
@@ -20,26 +23,74 @@ bool ratioReset = false;
 float currentRatio = 0.0f;
 size_t closestIndex = 0;
 constexpr int ratioArrayMax = 79;  // set odd to ensure always a gear mode
-constexpr int MAX_GEARS = 5;       // Set 5 for xt660x
+constexpr int MAX_GEARS = EcuProfile::MAX_GEARS; // From the ECU profile
 constexpr float constsDeviation = 6.0f;
 constexpr float lookupDeviation = 6.0f;
 
 std::vector <float> ratioArray;
 std::vector <float> constRatios;
 
+// Ride-time adaptation
+//
+// The stand procedure learns the ratios once, tyre wear, a sprocket change
+// or the loaded bike on the road move them. While riding every speed sample
+// that clearly belongs to a gear refines that gear's ratio: an exponentially
+// weighted mean and variance, samples more than adaptOutlierSigma away are
+// rejected. Samples are excluded below adaptMinSpeed / adaptMinRpm (clutch
+// slip at pull away), when the ratio moved between two samples (clutch in,
+// shifting) and when the speed jumped (wheelspin, lock-up). Refined ratios
+// are written to RATIOS.TXT at most every adaptSaveMs and on bike off, and
+// only when one moved by adaptSaveChange. The stand-learned ratios are kept
+// in RATIOBASE.TXT and the drift clamp stays centred on them across reboots.
+struct GearAdaptStats
+{
+  float base = 0;     // Stand-learned ratio, adaptation is clamped around it
+  float mean = 0;
+  float variance = 0;
+  uint32_t accepted = 0;
+  uint32_t rejected = 0; // Outliers
+  uint32_t excluded = 0; // Clutch, shift, wheelspin or too slow
+};
+
+bool gearAdapting = true;
+constexpr uint8_t adaptMinSpeed = 20;       // km/h
+constexpr uint16_t adaptMinRpm = 2500;
+constexpr float adaptSteadyRatio = 0.02f;   // Max ratio change between samples
+constexpr uint8_t adaptMaxSpeedStep = 3;    // km/h per speed sample (~115 ms)
+constexpr uint8_t adaptStableSamples = 3;   // Same gear this many samples in a row
+constexpr float adaptWeight = 1.0f / 64;
+constexpr float adaptOutlierSigma = 3.0f;
+constexpr float adaptMinSigma = 0.01f;      // Of the mean, keeps the window open
+constexpr uint16_t adaptMinSamples = 50;    // Before a gear's ratio is replaced
+constexpr float adaptMaxDrift = 0.10f;      // Of the base ratio
+constexpr uint32_t adaptSaveMs = 600000;    // 10 minutes
+constexpr float adaptSaveChange = 0.005f;
+
+std::vector <GearAdaptStats> gearAdaptStats;
+std::vector <float> savedRatios; // As last written to RATIOS.TXT
+std::vector <float> baseRatios;  // Stand-learned, RATIOBASE.TXT
+uint32_t lastAdaptSave = 0;
+
 // Function prototypes
 void gears();
 void resetRATIOS();
 void gearLearn();
 void gearConsts(float currentRatio);
 void writeGearConstantsToSPIFFS();
+void writeBaseRatios();
+void loadBaseRatios();
 void gearLookup();
+void gearAdaptBegin();
+void gearAdapt();
+void saveAdaptedRatios(bool force);
 
 
 void gears(){
   resetRATIOS();
   gearLearn();
   gearLookup();
+  gearAdapt();
+  saveAdaptedRatios(false);
 }
 
 void resetRATIOS()
@@ -80,6 +131,10 @@ void resetRATIOS()
   file.close();
   sendResponse("New RATIOS.TXT created successfully");
 
+  // The next stand procedure sets a new base
+  SPIFFS.remove("/RATIOBASE.TXT");
+  baseRatios.clear();
+
   ratioReset = false;
   gearLearning = true;
   constRatios.empty();  // empty the constRatios
@@ -139,6 +194,9 @@ void gearConsts(float currentRatio)
     gearLearning = false;
     // Write gear constants to RATIOS.TXT
     writeGearConstantsToSPIFFS();
+    baseRatios = constRatios;
+    writeBaseRatios();
+    gearAdaptBegin();
     return;
   }
 
@@ -197,6 +255,35 @@ void writeGearConstantsToSPIFFS() {
     sendResponse("Gear constants written to RATIOS.TXT successfully.");
 }
 
+void writeBaseRatios() {
+  File baseFile = SPIFFS.open("/RATIOBASE.TXT", "w");
+  if (!baseFile) {
+    sendResponse("Failed to open RATIOBASE.TXT for writing.");
+    return;
+  }
+  for (float ratio : baseRatios) {
+    baseFile.println(ratio);
+  }
+  baseFile.close();
+}
+
+// Stand-learned ratios, or the loaded ones when RATIOBASE.TXT is missing or
+// does not match (ratios learned before it existed), which then become the base
+void loadBaseRatios() {
+  baseRatios.clear();
+  File baseFile = SPIFFS.open("/RATIOBASE.TXT", "r");
+  if (baseFile) {
+    while (baseFile.available()) {
+      baseRatios.push_back(baseFile.readStringUntil('\n').toFloat());
+    }
+    baseFile.close();
+  }
+  if (baseRatios.size() != constRatios.size()) {
+    baseRatios = constRatios;
+    writeBaseRatios();
+  }
+}
+
 void gearLookup() {
   if (ratioReset || gearLearning || constRatios.empty()) {
     return;
@@ -219,5 +306,111 @@ void gearLookup() {
   }
 }
 
+// Fresh statistics from the current ratios, clamped around the stand-learned
+// ones, after loading or learning
+void gearAdaptBegin() {
+  if (baseRatios.size() != constRatios.size()) {
+    loadBaseRatios();
+  }
+  gearAdaptStats.assign(constRatios.size(), GearAdaptStats());
+  for (size_t i = 0; i < constRatios.size(); ++i) {
+    GearAdaptStats &stats = gearAdaptStats[i];
+    stats.base = baseRatios[i];
+    stats.mean = constRatios[i];
+    stats.variance = std::pow(lookupDeviation / adaptOutlierSigma, 2); // Starts as wide as the lookup window
+  }
+  savedRatios = constRatios;
+  lastAdaptSave = Time;
+}
 
+void gearAdapt() {
+  static float lastRatio = 0.0f;
+  static uint8_t lastSpeed = 0;
+  static uint8_t stableGear = 0;
+  static uint8_t stableCount = 0;
+
+  if (!gearAdapting || ratioReset || gearLearning || constRatios.empty()) {
+    return;
+  }
+
+  // One step per new speed sample, gearLearn() owns the flags while learning
+  if (!Gear_Speed_Ready || !Gear_RPM_Ready) {
+    return;
+  }
+  Gear_Speed_Ready = Gear_RPM_Ready = false;
+
+  if (gearAdaptStats.size() != constRatios.size()) {
+    gearAdaptBegin();
+  }
 
+  float ratio = gear_speed ? static_cast<float>(gear_rpm) / static_cast<float>(gear_speed) : 0.0f;
+  bool steady = lastRatio > 0 && std::fabs(ratio - lastRatio) <= adaptSteadyRatio * lastRatio;
+  bool traction = std::abs(gear_speed - lastSpeed) <= adaptMaxSpeedStep;
+  lastRatio = ratio;
+  lastSpeed = gear_speed;
+
+  if (Gear_PID != 0 && Gear_PID == stableGear) {
+    stableCount = std::min<uint8_t>(stableCount + 1, adaptStableSamples);
+  } else {
+    stableGear = Gear_PID;
+    stableCount = 0;
+  }
+
+  // Gear_PID keeps the last match, make sure this sample matched it too
+  if (Gear_PID == 0 || Gear_PID > gearAdaptStats.size()) {
+    return;
+  }
+  size_t index = Gear_PID - 1;
+  GearAdaptStats &stats = gearAdaptStats[index];
+  bool matched = std::fabs(constRatios[index] - ratio) <= lookupDeviation;
+  if (gear_speed < adaptMinSpeed || gear_rpm < adaptMinRpm || !steady || !traction || !matched ||
+      stableCount < adaptStableSamples) {
+    stats.excluded++;
+    return;
+  }
+
+  float sigma = std::max(std::sqrt(stats.variance), adaptMinSigma * stats.mean);
+  float delta = ratio - stats.mean;
+  if (std::fabs(delta) > adaptOutlierSigma * sigma) {
+    stats.rejected++;
+    return;
+  }
+
+  stats.mean += adaptWeight * delta;
+  stats.variance = (1.0f - adaptWeight) * (stats.variance + adaptWeight * delta * delta);
+  stats.mean = std::min(std::max(stats.mean, stats.base * (1.0f - adaptMaxDrift)), stats.base * (1.0f + adaptMaxDrift));
+  stats.accepted++;
+  if (stats.accepted >= adaptMinSamples) {
+    constRatios[index] = stats.mean;
+  }
+}
+
+// Periodic, or forced on bike off, and only when a ratio really moved
+void saveAdaptedRatios(bool force) {
+  if (!gearAdapting || gearLearning || constRatios.empty() || savedRatios.size() != constRatios.size()) {
+    return;
+  }
+  if (!force && Time - lastAdaptSave < adaptSaveMs) {
+    return;
+  }
+  lastAdaptSave = Time;
+
+  bool changed = false;
+  for (size_t i = 0; i < constRatios.size(); ++i) {
+    changed |= std::fabs(constRatios[i] - savedRatios[i]) > adaptSaveChange * savedRatios[i];
+  }
+  if (!changed) {
+    return;
+  }
+  writeGearConstantsToSPIFFS();
+  savedRatios = constRatios;
+}
+
+std::string gearAdaptReport(size_t index) {
+  const GearAdaptStats &stats = gearAdaptStats[index];
+  char line[128];
+  snprintf(line, sizeof(line), "Gear %u: %.2f (base %.2f, sd %.2f), accepted %u, outliers %u, excluded %u",
+           (unsigned)(index + 1), constRatios[index], stats.base, std::sqrt(stats.variance), stats.accepted,
+           stats.rejected, stats.excluded);
+  return line;
+}
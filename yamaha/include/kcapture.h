@@ -0,0 +1,86 @@
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+#include "esp_timer.h"
+#include <ecuprofile.h>
+#include <trace.h>
+
+// K-line capture
+//
+// Serial1 is armed as the very first thing in setup(). Every byte the UART
+// driver receives is timestamped in the receive callback and pushed into a
+// lock free ring, so nothing is lost while BLE, SPIFFS and the OLED are still
+// initialising. loop() drains the ring through kCaptureRead().
+
+#define KCAPTURE_SIZE 4096 // Power of two, ~2.5 s of K-line traffic
+#define KCAPTURE_MASK (KCAPTURE_SIZE - 1)
+
+// Time on the wire for one 8N1 byte
+constexpr uint32_t KLINE_BYTE_US = 10UL * 1000000UL / EcuProfile::BAUD;
+
+uint8_t kCaptureBytes[KCAPTURE_SIZE];
+uint32_t kCaptureTimes[KCAPTURE_SIZE];
+std::atomic<uint32_t> kCaptureHead(0); // Written by the UART event task
+std::atomic<uint32_t> kCaptureTail(0); // Written by loop()
+std::atomic<uint32_t> kCaptureOverflows(0); // Written by the UART event task
+
+// Boot timing, microseconds since app start. The first byte time is written
+// by the UART event task, only read it once kCaptureSeen is set.
+int64_t kCaptureArmedUs = 0;
+int64_t kCaptureFirstByteUs = -1;
+std::atomic<bool> kCaptureSeen(false);
+
+void kCaptureReceive()
+{
+  uint32_t now = esp_timer_get_time();
+  int pending = Serial1.available();
+
+  while (pending > 0)
+  {
+    uint8_t value = Serial1.read();
+    pending--;
+
+    uint32_t head = kCaptureHead.load(std::memory_order_relaxed);
+    if (head - kCaptureTail.load(std::memory_order_acquire) >= KCAPTURE_SIZE)
+    {
+      uint32_t overflows = kCaptureOverflows.fetch_add(1, std::memory_order_relaxed) + 1;
+      TRACE_ERROR(TRACE_CAPTURE_OVERFLOW, std::min<uint32_t>(overflows, 0xFFFF), 0);
+      continue;
+    }
+
+    // Bytes that queued up together are spread back over their wire time
+    uint32_t byteUs = now - pending * KLINE_BYTE_US;
+    if (!kCaptureSeen.load(std::memory_order_relaxed))
+    {
+      kCaptureFirstByteUs = byteUs;
+      kCaptureSeen.store(true, std::memory_order_release);
+    }
+
+    kCaptureBytes[head & KCAPTURE_MASK] = value;
+    kCaptureTimes[head & KCAPTURE_MASK] = byteUs;
+    kCaptureHead.store(head + 1, std::memory_order_release);
+  }
+}
+
+void kCaptureBegin(int8_t rxPin, int8_t txPin)
+{
+  kCaptureArmedUs = esp_timer_get_time();
+  Serial1.setRxBufferSize(1024);
+  Serial1.onReceive(kCaptureReceive);
+  Serial1.begin(EcuProfile::BAUD, SERIAL_8N1, rxPin, txPin);
+  Serial1.setRxFIFOFull(1); // Callback per byte for tight timestamps
+}
+
+bool kCaptureRead(uint8_t &value, uint32_t &timeUs)
+{
+  uint32_t tail = kCaptureTail.load(std::memory_order_relaxed);
+  if (tail == kCaptureHead.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+
+  value = kCaptureBytes[tail & KCAPTURE_MASK];
+  timeUs = kCaptureTimes[tail & KCAPTURE_MASK];
+  kCaptureTail.store(tail + 1, std::memory_order_release);
+  return true;
+}
@@ -0,0 +1,200 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <ecuprofile.h>
+
+// K-line byte decoder
+//
+// Byte-at-a-time state machine: IMMO preamble -> normal/diag mode -> aligned
+// frames. All sizes and offsets come from the Profile traits, so there is no
+// heap use and no runtime branching on the bike model.
+//
+// Mid-stream acquisition: until the preamble has been handled the decoder also
+// hunts for an already running normal data stream. Once LOCK_FRAMES checksum
+// valid frames arrive at a constant byte spacing and a steady cadence it
+// switches straight to normal data, the frame that completed the lock is the
+// first frame. A start byte only begins a preamble after PREAMBLE_GAP_US of
+// line silence, a 0x3E data byte in a running stream leaves the hunt alone.
+template <typename Profile>
+class KLineDecoder
+{
+public:
+  enum Event : uint8_t
+  {
+    NONE,
+    IMMO_START,   // Start byte seen, collecting the IMMO sequence
+    NORMAL_START, // IMMO sequence complete, normal data follows
+    DIAG_START,   // IMMO sequence complete, diag data follows
+    LOCKED,       // Normal data stream acquired without a preamble, frame() holds its first frame
+    FRAME         // A checksum-valid frame is available via frame()
+  };
+
+  static constexpr uint8_t FRAME_LENGTH = Profile::FRAME_LENGTH;
+  static constexpr uint32_t BYTE_US = 10UL * 1000000UL / Profile::BAUD;
+
+  Event feed(uint8_t receivedByte, uint32_t timeUs)
+  {
+    bool silence = !seenByte || (timeUs - lastByteUs) >= Profile::PREAMBLE_GAP_US;
+    lastByteUs = timeUs;
+    seenByte = true;
+
+    // Check and handle the first byte of the IMMO sequence immediately
+    if (receivedByte == Profile::IMMO_START_BYTE && silence && (!is3E || immoHandled))
+    {
+      reset();
+      is3E = true;
+      immoCount = 1;
+      return IMMO_START;
+    }
+
+    if (!immoHandled)
+    {
+      // Hunt for a running stream alongside the IMMO sequence
+      if (midStreamLock && hunt(receivedByte, timeUs))
+      {
+        is3E = true;
+        immoHandled = true;
+        locked = true;
+        diagMode = false;
+        frameIndex = 0;
+        return LOCKED;
+      }
+
+      // Continue handling the IMMO sequence
+      if (!is3E || ++immoCount < Profile::IMMO_LENGTH)
+      {
+        return NONE;
+      }
+      immoHandled = true;
+      frameIndex = 0;
+      diagMode = (receivedByte == Profile::DIAG_START_BYTE);
+      return diagMode ? DIAG_START : NORMAL_START;
+    }
+
+    if (pushWindow(receivedByte))
+    {
+      frameIndex = 0; // Start the next frame from scratch
+      return FRAME;
+    }
+    return NONE;
+  }
+
+  void reset()
+  {
+    is3E = false;
+    immoHandled = false;
+    diagMode = false;
+    locked = false;
+    immoCount = 0;
+    frameIndex = 0;
+    huntIndex = 0;
+    lockCount = 0;
+  }
+
+  void setMidStreamLock(bool enabled) { midStreamLock = enabled; }
+  bool midStreamLockEnabled() const { return midStreamLock; }
+  uint32_t acquireTimeUs() const { return lockUs - huntStartUs; }
+
+  const uint8_t *frame() const { return window; }
+  bool started() const { return is3E; }
+  bool immoDone() const { return immoHandled; }
+  bool inDiagMode() const { return diagMode; }
+  bool lockedMidStream() const { return locked; }
+
+  // Frame checks
+  static bool checksumOk(const uint8_t *f)
+  {
+    uint8_t sum = 0;
+    bool allZero = true;
+    for (uint8_t i = 0; i < FRAME_LENGTH - 1; ++i)
+    {
+      sum += f[i];
+      allZero &= (f[i] == 0);
+    }
+    return !allZero && sum == f[FRAME_LENGTH - 1];
+  }
+
+  // Field scaling
+  static uint16_t rpm(const uint8_t *f) { return f[Profile::RPM_INDEX] * Profile::RPM_SCALE; }
+  static uint8_t speedRaw(const uint8_t *f) { return f[Profile::SPEED_INDEX]; }
+  static uint8_t errorCode(const uint8_t *f) { return f[Profile::ERROR_INDEX]; }
+  static uint8_t coolant(const uint8_t *f) { return f[Profile::COOLANT_INDEX] + Profile::COOLANT_OFFSET; }
+
+private:
+  // Slide the window once full, true when it holds a valid frame
+  bool pushWindow(uint8_t receivedByte)
+  {
+    if (frameIndex == FRAME_LENGTH)
+    {
+      memmove(window, window + 1, FRAME_LENGTH - 1);
+      frameIndex--;
+    }
+    window[frameIndex++] = receivedByte;
+    return frameIndex == FRAME_LENGTH && checksumOk(window);
+  }
+
+  // Statistical lock: valid frames at a fixed byte period and steady cadence
+  bool hunt(uint8_t receivedByte, uint32_t timeUs)
+  {
+    if (huntIndex++ == 0)
+    {
+      huntStartUs = timeUs;
+    }
+    if (!pushWindow(receivedByte))
+    {
+      return false;
+    }
+
+    uint32_t period = huntIndex - lockIndex;
+    uint32_t interval = timeUs - lockUs;
+
+    if (lockCount >= 2 && period < lockPeriod)
+    {
+      return false; // Chance checksum inside a frame, ignore it
+    }
+
+    uint32_t tolerance = lockInterval / 4 + 2 * BYTE_US;
+    bool steady = period == lockPeriod &&
+                  interval + tolerance >= lockInterval && interval <= lockInterval + tolerance;
+
+    if (lockCount >= 2)
+    {
+      lockCount = steady ? lockCount + 1 : 1;
+    }
+    else if (lockCount == 1 && period >= FRAME_LENGTH)
+    {
+      // Second valid frame, take its spacing as the reference
+      lockCount = 2;
+      lockPeriod = period;
+      lockInterval = interval;
+    }
+    else
+    {
+      lockCount = 1;
+    }
+
+    lockIndex = huntIndex;
+    lockUs = timeUs;
+    return lockCount >= Profile::LOCK_FRAMES;
+  }
+
+  uint8_t window[FRAME_LENGTH] = {};
+  uint8_t frameIndex = 0;
+  uint8_t immoCount = 0;
+  bool is3E = false;
+  bool immoHandled = false;
+  bool diagMode = false;
+
+  // Mid-stream acquisition
+  bool midStreamLock = true;
+  bool locked = false;
+  bool seenByte = false;
+  uint32_t lastByteUs = 0;
+  uint32_t huntIndex = 0;
+  uint32_t huntStartUs = 0;
+  uint32_t lockIndex = 0;
+  uint32_t lockPeriod = 0;
+  uint32_t lockUs = 0;
+  uint32_t lockInterval = 0;
+  uint8_t lockCount = 0;
+};
@@ -0,0 +1,196 @@
+#pragma once
+#include <Arduino.h>
+#include <BLEDevice.h>
+#include <string>
+#include "esp_sleep.h"
+#include "driver/gpio.h"
+#include "esp_timer.h"
+#include <kcapture.h>
+#include <trace.h>
+
+// Park mode
+//
+// Once handleBikeOffCondition() has seen 5 s of K-line silence the logger
+// parks: BLE advertising slows down and, while no central, USB host or WiFi
+// client needs the MCU, it light-sleeps for most of every second with the
+// K-line RX pin as GPIO wake source. The pin wakes on the opposite of its
+// parked level, so the ECU powering up (line going idle high) or the first
+// start bit ends the nap and the UART captures again well inside the IMMO
+// preamble. The time from wake to the first captured byte is measured for
+// every K-line wake.
+//
+// Light sleep with Bluedroid up needs controller modem sleep
+// (CONFIG_BT_CTRL_MODEM_SLEEP with the main XTAL as low power clock), which
+// the Arduino core's prebuilt sdkconfig does not enable. Without it
+// advertising is stopped for the nap and restarted after, so the controller
+// is idle while the CPU sleeps and centrals find the logger in the awake
+// window. A sleep the system rejects is counted and not treated as a nap.
+
+#if defined(CONFIG_BT_CTRL_MODEM_SLEEP) && CONFIG_BT_CTRL_MODEM_SLEEP
+const bool PARK_ADVERTISE_IN_NAP = true;
+#else
+const bool PARK_ADVERTISE_IN_NAP = false;
+#endif
+
+const uint32_t PARK_NAP_MS = 900;         // Light sleep per cycle
+const uint32_t PARK_AWAKE_MS = 100;       // Awake window, holds one advertising event
+const uint16_t PARK_ADV_INTERVAL = 128;   // 80 ms in 0.625 ms units
+const uint16_t RUN_ADV_INTERVAL_MIN = 32; // 20 - 40 ms, the BLEAdvertising default
+const uint16_t RUN_ADV_INTERVAL_MAX = 64;
+
+extern void sendResponse(const std::string &message);
+
+struct ParkStats
+{
+  uint32_t naps = 0;
+  uint32_t rejected = 0;       // esp_light_sleep_start() refused
+  uint32_t klineWakes = 0;     // Naps ended by the K-line pin
+  uint64_t sleptUs = 0;
+  int32_t lastWakeUs = -1;     // Wake to first captured byte, -1 = none yet
+  int16_t lastWakeByte = -1;   // 0x3E when the IMMO start byte was caught
+  uint32_t worstWakeUs = 0;
+};
+
+bool parkEnabled = true;
+bool parked = false;
+gpio_num_t parkPin = (gpio_num_t)-1;
+ParkStats parkStats;
+
+// Wake measurement in flight
+bool parkWakePending = false;
+int64_t parkWakeUs = 0;
+uint32_t parkWakeHead = 0;
+uint32_t parkHead = 0;        // Capture head when the last nap ended
+uint32_t parkAwakeSinceMs = 0;
+
+void parkBegin(int8_t rxPin)
+{
+  parkPin = (gpio_num_t)rxPin;
+}
+
+void parkAdvertising(uint16_t minInterval, uint16_t maxInterval)
+{
+  BLEAdvertising *advertising = BLEDevice::getAdvertising();
+  advertising->stop();
+  advertising->setMinInterval(minInterval);
+  advertising->setMaxInterval(maxInterval);
+  advertising->start();
+}
+
+// Called on bike off
+void parkEnter()
+{
+  if (parked)
+  {
+    return;
+  }
+  parked = true;
+  parkHead = kCaptureHead.load(std::memory_order_acquire);
+  parkAwakeSinceMs = millis();
+  parkAdvertising(PARK_ADV_INTERVAL, PARK_ADV_INTERVAL);
+}
+
+void parkExit()
+{
+  if (!parked)
+  {
+    return;
+  }
+  parked = false;
+  parkAdvertising(RUN_ADV_INTERVAL_MIN, RUN_ADV_INTERVAL_MAX);
+}
+
+// First byte after a K-line wake, timed by the capture callback
+void parkMeasureWake()
+{
+  uint32_t head = kCaptureHead.load(std::memory_order_acquire);
+  if (!parkWakePending || head == parkWakeHead)
+  {
+    return;
+  }
+  parkWakePending = false;
+
+  uint32_t latencyUs = kCaptureTimes[parkWakeHead & KCAPTURE_MASK] - (uint32_t)parkWakeUs;
+  uint8_t firstByte = kCaptureBytes[parkWakeHead & KCAPTURE_MASK];
+  parkStats.lastWakeUs = latencyUs;
+  parkStats.lastWakeByte = firstByte;
+  parkStats.worstWakeUs = std::max(parkStats.worstWakeUs, latencyUs);
+  TRACE_INFO(TRACE_WAKE, firstByte, latencyUs);
+}
+
+// Called every loop, busy = something needs the MCU awake
+void parkService(bool busy)
+{
+  parkMeasureWake();
+  if (!parked)
+  {
+    return;
+  }
+
+  // K-line traffic, the bike is back
+  if (kCaptureHead.load(std::memory_order_acquire) != parkHead)
+  {
+    parkExit();
+    return;
+  }
+
+  if (!parkEnabled || busy || millis() - parkAwakeSinceMs < PARK_AWAKE_MS || parkPin < 0)
+  {
+    return;
+  }
+
+  // Wake on whichever level the line is not at now
+  int level = gpio_get_level(parkPin);
+  gpio_wakeup_enable(parkPin, level ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+  esp_sleep_enable_gpio_wakeup();
+  esp_sleep_enable_timer_wakeup((uint64_t)PARK_NAP_MS * 1000);
+
+  BLEAdvertising *advertising = BLEDevice::getAdvertising();
+  if (!PARK_ADVERTISE_IN_NAP)
+  {
+    advertising->stop();
+  }
+
+  int64_t sleepUs = esp_timer_get_time();
+  esp_err_t slept = esp_light_sleep_start();
+  int64_t wakeUs = esp_timer_get_time();
+
+  bool klineWake = slept == ESP_OK && esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO;
+  gpio_wakeup_disable(parkPin);
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_GPIO);
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_TIMER);
+  if (!PARK_ADVERTISE_IN_NAP)
+  {
+    advertising->start();
+  }
+
+  parkAwakeSinceMs = millis();
+  if (slept != ESP_OK)
+  {
+    parkStats.rejected++; // Try again after the next awake window
+    return;
+  }
+  parkStats.naps++;
+  parkStats.sleptUs += wakeUs - sleepUs;
+  if (klineWake)
+  {
+    parkStats.klineWakes++;
+    parkWakePending = true;
+    parkWakeUs = wakeUs;
+    parkWakeHead = kCaptureHead.load(std::memory_order_acquire);
+    parkHead = parkWakeHead; // Stay parked until a byte really arrives
+  }
+}
+
+std::string parkReport()
+{
+  char line[220];
+  snprintf(line, sizeof(line),
+           "Sleep %s%s, naps %u (%u rejected), slept %llu s, K-line wakes %u, last wake to first byte %ld us (byte %s), "
+           "worst %u us",
+           parkEnabled ? "on" : "off", parked ? " (parked)" : "", parkStats.naps, parkStats.rejected,
+           (unsigned long long)(parkStats.sleptUs / 1000000), parkStats.klineWakes, (long)parkStats.lastWakeUs,
+           parkStats.lastWakeByte < 0 ? "-" : (parkStats.lastWakeByte == EcuProfile::IMMO_START_BYTE ? "3E IMMO" : "other"),
+           parkStats.worstWakeUs);
+  return line;
+}
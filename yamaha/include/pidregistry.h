@@ -0,0 +1,147 @@
+#pragma once
+#include <stdint.h>
+#include <ecuprofile.h>
+
+// PID registry
+//
+// One table describes every PID the logger serves: the id the app sends, the
+// reply header, where the value comes from, its width, display range and how
+// often it really changes. handleCommand() dispatches through it, the 01xx
+// supported-PID bitmaps are computed from it at compile time, and
+// tools/pidgen writes the RealDash, Torque and RaceChrono profiles from it so
+// the app poll rates follow the data instead of hand-picked skipCounts.
+//
+// To add a PID: add the global, add a row here, run pidgen.
+
+// PIDS
+extern uint16_t RPM_PID;        // RPM
+extern uint8_t Speed_PID;       // km/h
+extern uint8_t Coolant_PID;     // Temp C
+extern uint8_t Error_PID;       // Error code
+extern uint8_t Gear_PID;        // 0-5
+extern uint8_t Temp_PID;        // MCU Temp
+extern uint8_t CPU_PID;         // CPU Freq mhz
+extern uint16_t RAM_Free_PID;   // Free Ram kb
+extern uint8_t Max_Speed_PID;   // Max Speed Reached
+extern uint16_t MCU_Uptime_PID; // Seconds
+extern uint8_t BLE_Interval_PID; // Connection interval ms
+extern uint16_t RPM_Max_1s_PID;  // Rollups, see rollup.h
+extern uint16_t RPM_Min_1s_PID;
+extern uint8_t Speed_Max_1s_PID;
+extern uint16_t RPM_Mean_1m_PID;
+extern uint16_t RPM_Peak_PID;
+extern uint16_t Heap_Largest_PID; // kb
+extern uint16_t Heap_Min_PID;     // kb
+extern uint16_t Decode_Lag_PID;   // us, see powerscale.h
+
+enum PidSource : uint8_t
+{
+  PID_SOURCE_KLINE,   // Straight from an ECU frame
+  PID_SOURCE_DERIVED, // Computed from ECU data (gear, top speed)
+  PID_SOURCE_MCU      // Logger housekeeping, updateMcuPidValues()
+};
+
+struct PidInfo
+{
+  uint16_t id;        // Mode and PID as sent by the app, 0x010C
+  const char *reply;  // Reply header
+  const char *name;
+  const char *shortName;
+  const char *units;
+  PidSource source;
+  uint8_t bytes;      // 1 or 2
+  const void *value;  // uint8_t or uint16_t global
+  int32_t min;
+  int32_t max;
+  uint16_t updateMs;  // How often the value can change
+  uint16_t realDashTarget;    // RealDash targetId, 0 = custom channel named after the PID
+  uint16_t raceChronoChannel; // RaceChrono channelId, 0 = not exported
+};
+
+// Update intervals
+constexpr uint16_t PID_FRAME_MS = EcuProfile::FRAME_PERIOD_US / 1000;
+constexpr uint16_t PID_SPEED_MS = PID_FRAME_MS * EcuProfile::SPEED_FRAMES; // Speed sums 8 frames
+constexpr uint16_t PID_SLOW_MS = 1000;                                     // Coolant, error codes, uptime
+constexpr uint16_t PID_MINUTE_MS = 60000;                                  // 1 minute rollups
+
+constexpr PidInfo pidRegistry[] = {
+    {0x0105, "41 05", "Coolant", "Coolant", "C", PID_SOURCE_KLINE, 1, &Coolant_PID, 0, 255, PID_SLOW_MS, 14, 10026},
+    {0x010C, "41 0C", "RPM Yamaha", "RPM", "rpm", PID_SOURCE_KLINE, 2, &RPM_PID, 0, 16000, PID_FRAME_MS, 37, 10024},
+    {0x010D, "41 0D", "Speed Yamaha", "Speed", "km/h", PID_SOURCE_KLINE, 1, &Speed_PID, 0, 250, PID_SPEED_MS, 81, 4},
+    {0x01A4, "41 A4", "Gear Yamaha", "Gear", "", PID_SOURCE_DERIVED, 1, &Gear_PID, 0, 6, PID_SPEED_MS, 139, 1004},
+    {0x1001, "41 02", "Error Code Yamaha", "Error", "", PID_SOURCE_KLINE, 1, &Error_PID, 0, 255, PID_SLOW_MS, 105, 0},
+    {0x1002, "41 02", "MCU temp", "MCU Temp", "C", PID_SOURCE_MCU, 1, &Temp_PID, 0, 100, 5000, 174, 0},
+    {0x1003, "41 02", "MCU Speed", "MCU mhz", "mhz", PID_SOURCE_MCU, 1, &CPU_PID, 0, 250, 10000, 0, 0},
+    {0x1004, "41 02", "free ram", "Ram Free", "kb", PID_SOURCE_MCU, 2, &RAM_Free_PID, 0, 320, 2000, 0, 0},
+    {0x1005, "41 02", "Top Speed", "Top Speed", "km/h", PID_SOURCE_DERIVED, 1, &Max_Speed_PID, 0, 250, PID_SPEED_MS, 408, 0},
+    {0x1006, "41 02", "MCU Uptime", "MCU Time", "s", PID_SOURCE_MCU, 2, &MCU_Uptime_PID, 0, 65000, PID_SLOW_MS, 34, 0},
+    {0x1007, "41 02", "BLE Interval", "BLE ms", "ms", PID_SOURCE_MCU, 1, &BLE_Interval_PID, 0, 100, 5000, 0, 0},
+    {0x1008, "41 02", "RPM Max 1s", "RPM Max", "rpm", PID_SOURCE_DERIVED, 2, &RPM_Max_1s_PID, 0, 16000, PID_SLOW_MS, 0, 0},
+    {0x1009, "41 02", "RPM Min 1s", "RPM Min", "rpm", PID_SOURCE_DERIVED, 2, &RPM_Min_1s_PID, 0, 16000, PID_SLOW_MS, 0, 0},
+    {0x100A, "41 02", "Speed Max 1s", "Speed Max", "km/h", PID_SOURCE_DERIVED, 1, &Speed_Max_1s_PID, 0, 250, PID_SLOW_MS, 0, 0},
+    {0x100B, "41 02", "RPM Mean 1m", "RPM Mean", "rpm", PID_SOURCE_DERIVED, 2, &RPM_Mean_1m_PID, 0, 16000, PID_MINUTE_MS, 0, 0},
+    {0x100C, "41 02", "RPM Peak", "RPM Peak", "rpm", PID_SOURCE_DERIVED, 2, &RPM_Peak_PID, 0, 16000, PID_SLOW_MS, 0, 0},
+    {0x100D, "41 02", "Heap Largest Block", "Heap Blk", "kb", PID_SOURCE_MCU, 2, &Heap_Largest_PID, 0, 320, 2000, 0, 0},
+    {0x100E, "41 02", "Heap Minimum", "Heap Min", "kb", PID_SOURCE_MCU, 2, &Heap_Min_PID, 0, 320, 2000, 0, 0},
+    {0x100F, "41 02", "Decode Lag", "Lag us", "us", PID_SOURCE_MCU, 2, &Decode_Lag_PID, 0, 5000, PID_SLOW_MS, 0, 0},
+};
+
+constexpr size_t PID_COUNT = sizeof(pidRegistry) / sizeof(pidRegistry[0]);
+
+constexpr const PidInfo *findPid(uint16_t id)
+{
+  for (const PidInfo &pid : pidRegistry)
+  {
+    if (pid.id == id)
+    {
+      return &pid;
+    }
+  }
+  return nullptr;
+}
+
+inline uint16_t pidValue(const PidInfo &pid)
+{
+  return pid.bytes == 2 ? *static_cast<const uint16_t *>(pid.value) : *static_cast<const uint8_t *>(pid.value);
+}
+
+// Mode 01 supported-PID bitmap for PIDs base+1 .. base+0x20, bit 0 flags
+// that a higher range has PIDs too
+constexpr uint32_t pidBitmap(uint8_t base)
+{
+  uint32_t bits = 0;
+  for (const PidInfo &pid : pidRegistry)
+  {
+    if ((pid.id >> 8) != 0x01)
+    {
+      continue;
+    }
+    unsigned offset = (pid.id & 0xFF) - base;
+    if ((pid.id & 0xFF) > base && offset <= 0x20)
+    {
+      bits |= 1UL << (0x20 - offset);
+    }
+    else if ((pid.id & 0xFF) > base)
+    {
+      bits |= 1;
+    }
+  }
+  return bits;
+}
+
+// Highest mode 01 PID, ranges above it answer NO DATA
+constexpr uint8_t pidHighestMode01()
+{
+  uint8_t highest = 0;
+  for (const PidInfo &pid : pidRegistry)
+  {
+    if ((pid.id >> 8) == 0x01 && (pid.id & 0xFF) > highest)
+    {
+      highest = pid.id & 0xFF;
+    }
+  }
+  return highest;
+}
+
+constexpr uint32_t pidBitmaps[8] = {pidBitmap(0x00), pidBitmap(0x20), pidBitmap(0x40), pidBitmap(0x60),
+                                    pidBitmap(0x80), pidBitmap(0xA0), pidBitmap(0xC0), pidBitmap(0xE0)};
@@ -0,0 +1,160 @@
+#pragma once
+#include <Arduino.h>
+#include <string>
+#include "esp_timer.h"
+#include <ecuprofile.h>
+#ifdef CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+
+// Dynamic frequency scaling
+//
+// With CONFIG_PM_ENABLE the CPU idles at PM_MIN_MHZ between K-line frames
+// and runs at PM_MAX_MHZ only while a burst lock is held: a K-line frame from
+// its first byte until the line has been quiet for PM_FRAME_GAP_US, answering
+// ELM requests and drawing the OLED. 80 MHz is the floor
+// because the APB clock, and with it the K-line UART and the BLE controller,
+// has to stay at 80 MHz. Capture timestamps come from the UART callback, so
+// the cost of the lower clock shows up as decode lag: capture to decode of
+// each byte, worst case per second in the decode lag PID. Lag is also kept
+// apart for scaling on and off, so "Power" shows what DFS itself costs.
+//
+// Builds without CONFIG_PM_ENABLE keep the fixed clock, the locks compile to
+// nothing and the lag is still measured.
+
+const int PM_MAX_MHZ = 240;
+const int PM_MIN_MHZ = 80;
+const uint32_t PM_FRAME_GAP_US = 3 * 10UL * 1000000UL / EcuProfile::BAUD; // 3 byte times, frame over
+
+enum PmBurst : uint8_t
+{
+  PM_BURST_KLINE,
+  PM_BURST_ELM,
+  PM_BURST_DISPLAY,
+  PM_BURSTS
+};
+
+bool pmScaling = false; // DFS active
+uint32_t pmBursts[PM_BURSTS] = {};
+
+#ifdef CONFIG_PM_ENABLE
+esp_pm_lock_handle_t pmLocks[PM_BURSTS] = {};
+#endif
+
+// Decode lag, capture timestamp to decodeByte()
+extern uint16_t Decode_Lag_PID;
+uint32_t pmLagMaxUs = 0;      // Worst in the current second
+uint32_t pmLagSecondMs = 0;
+
+// Per mode, [0] fixed clock, [1] scaling
+uint64_t pmLagSumUs[2] = {};
+uint32_t pmLagCount[2] = {};
+uint32_t pmLagWorstUs[2] = {};
+
+bool pmConfigure(bool scaling)
+{
+#ifdef CONFIG_PM_ENABLE
+#if ESP_IDF_VERSION_MAJOR >= 5
+  esp_pm_config_t config = {};
+#else
+  esp_pm_config_esp32s3_t config = {};
+#endif
+  config.max_freq_mhz = PM_MAX_MHZ;
+  config.min_freq_mhz = scaling ? PM_MIN_MHZ : PM_MAX_MHZ;
+  config.light_sleep_enable = false; // Park mode sleeps explicitly
+  if (esp_pm_configure(&config) != ESP_OK)
+  {
+    return false;
+  }
+
+  static const char *const names[PM_BURSTS] = {"kline", "elm", "display"};
+  for (uint8_t burst = 0; burst < PM_BURSTS; ++burst)
+  {
+    if (!pmLocks[burst] && esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, names[burst], &pmLocks[burst]) != ESP_OK)
+    {
+      return false;
+    }
+  }
+  pmScaling = scaling;
+  return true;
+#else
+  return !scaling;
+#endif
+}
+
+void pmBurstBegin(PmBurst burst)
+{
+#ifdef CONFIG_PM_ENABLE
+  if (pmLocks[burst])
+  {
+    esp_pm_lock_acquire(pmLocks[burst]);
+  }
+#endif
+  pmBursts[burst]++;
+}
+
+void pmBurstEnd(PmBurst burst)
+{
+#ifdef CONFIG_PM_ENABLE
+  if (pmLocks[burst])
+  {
+    esp_pm_lock_release(pmLocks[burst]);
+  }
+#endif
+}
+
+// Holds the CPU at full clock for its scope
+class PmLock
+{
+public:
+  explicit PmLock(PmBurst burst) : burst(burst)
+  {
+    pmBurstBegin(burst);
+  }
+
+  ~PmLock()
+  {
+    pmBurstEnd(burst);
+  }
+
+  PmLock(const PmLock &) = delete;
+  PmLock &operator=(const PmLock &) = delete;
+
+private:
+  PmBurst burst;
+};
+
+void pmRecordLag(uint32_t byteTimeUs)
+{
+  uint32_t lagUs = (uint32_t)esp_timer_get_time() - byteTimeUs;
+  pmLagMaxUs = std::max(pmLagMaxUs, lagUs);
+  pmLagSumUs[pmScaling] += lagUs;
+  pmLagCount[pmScaling]++;
+  pmLagWorstUs[pmScaling] = std::max(pmLagWorstUs[pmScaling], lagUs);
+
+  // Publish the worst case once a second
+  uint32_t nowMs = millis();
+  if (nowMs - pmLagSecondMs >= 1000)
+  {
+    Decode_Lag_PID = std::min(pmLagMaxUs, (uint32_t)UINT16_MAX);
+    pmLagMaxUs = 0;
+    pmLagSecondMs = nowMs;
+  }
+}
+
+std::string pmReport()
+{
+  auto mean = [](int mode) { return pmLagCount[mode] ? (unsigned)(pmLagSumUs[mode] / pmLagCount[mode]) : 0; };
+  char line[260];
+  snprintf(line, sizeof(line),
+           "DFS %s, CPU %u MHz, bursts kline %u elm %u display %u, decode lag worst last second %u us, "
+           "scaling on mean %u worst %u us, off mean %u worst %u us",
+#ifdef CONFIG_PM_ENABLE
+           pmScaling ? "on (80-240 MHz)" : "off (240 MHz)",
+#else
+           "not in this build",
+#endif
+           (unsigned)getCpuFrequencyMhz(), pmBursts[PM_BURST_KLINE], pmBursts[PM_BURST_ELM],
+           pmBursts[PM_BURST_DISPLAY], Decode_Lag_PID, mean(1), pmLagWorstUs[1], mean(0), pmLagWorstUs[0]);
+  return line;
+}
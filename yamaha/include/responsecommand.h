@@ -1,5 +1,6 @@
 #pragma once
 #include <string> // For std::string
+#include <trace.h>
 
 extern void menu(std::string command);
 extern void dir();
@@ -10,50 +11,93 @@ extern void deleteAll();
 extern void copyFile(std::string filename, std::string newFilename);
 extern void createFile(std::string filename);
 extern void sendResponse(const std::string &message);
+extern void sendResponse(const char *message, size_t length);
 extern void showRATIOS();
-extern void sendResponse(const std::string &message);
 extern void toUpperCaseInPlace(std::string &str);
 extern void trimInPlace(std::string &str);
 extern void credits();
+extern void bootReport();
+extern void showStats();
+extern void resetStats();
+extern void showDtcs();
+extern void showTriggers();
+extern void showSessionLogs();
+extern void dumpSessionLog(uint32_t session);
+extern void querySessionLog(uint32_t session, float fromS, float toS, const char *channelName, uint32_t stepMs);
+extern void showHistory();
+extern void queryHistory(const char *channelName, float fromSAgo, float toSAgo, uint32_t stepMs);
+extern std::string parkReport();
+extern bool parkEnabled;
+extern std::string pmReport();
+extern bool pmConfigure(bool scaling);
+extern std::string sniffReport();
+extern bool sniffStart();
+extern void sniffStop();
+extern void sniffDump();
+extern void setMidStreamLock(bool enabled);
+extern void setUsbElm(bool enabled);
+extern uint32_t usbElmRequests;
 void handleActionWithArgs(const std::string& action, const std::string& args);
 
-void menu(std::string command) {
-  // Menu Header
-  sendResponse("\n\n**** Yamaha Datalogger ****\n");
-
-  // Set Gear Ratios
-  sendResponse("Enter a command :");
+// Menu and credits text, kept in flash and streamed a line at a time so
+// printing them builds no strings on the heap
+const char *const menuText[] = {
+    "\n\n**** Yamaha Datalogger ****\n",
+    "Enter a command :",
+    "\n**** Gear Ratio Control ****\n",
+    "Start the learn process whilst bike is on the stand!",
+    "1. Ratios - Display Ratios stored in RATIOS.TXT",
+    "2. Ratio Reset - wipe all saved gear ratios. WARNING!!",
+    "3. Gears - Start gear training",
+    "\n**** Spiffs Commands ****\n",
+    "4. Dir - List files",
+    "5. Rename <oldName> <newName> - Rename a file",
+    "6. Print <filename> - Print the contents of a file",
+    "7. Delete <filename> - Delete a file",
+    "8. Delete All - Delete all files from SPIFFS",
+    "9. Copy <filename> <newFilename> - Copy a file",
+    "10. Create <filename> - Create a new file",
+    "11. Q or Quit - Exit",
+    "\n**** Debug Functions ****\n",
+    "12. Debug Off - Turn off debug mode",
+    "13. Debug Rx - Turn on debug mode for receiving data",
+    "14. Debug Tx - Turn on debug mode for transmitting data",
+    "15. Debug Pid - Turn on debug mode for PID calculations",
+    "16. Bike On - Disable bike timer, all flags will not reset",
+    "17. Bike Off - Enable bike timer, enable normal startup",
+    "18. Menu - Print a list of all commands",
+    "19. Reset - Restart the ESP",
+    "20. Credits - Thanks",
+    "21. Boot - Show boot timing",
+    "22. Lock On/Off - Decode a running stream without the IMMO preamble",
+    "23. Trace [count] - Show the newest trace events (Debug Yam adds raw K-line bytes)",
+    "24. Trace Clear - Empty the trace buffer",
+    "25. Elm Stats - ELM requests answered and reply queue drops",
+    "26. Longpoll On/Off - Hold PID requests for the next K-line frame",
+    "27. Link - BLE connection interval, PHY and data length",
+    "28. Usb Elm On/Off - ELM327 on the USB serial port instead of this menu",
+    "29. Wifi Elm On/Off - ELM327 on TCP port 35000, soft-AP " ELM_TCP_SSID " at 192.168.0.10",
+    "30. Stats - Last second and minute min/max/mean, time in RPM and coolant bands, peaks",
+    "31. Stats Reset - Clear the ride stats and the saved top speed",
+    "32. Sleep [On/Off] - Light sleep while the bike is off, wake timing",
+    "33. Power [On/Off] - CPU frequency scaling between frames, decode lag",
+    "34. Dtc [Clear] - Fault codes as OBD DTCs, freeze frames in DTC<code>.CSV",
+    "35. Trigger [Rpm/Coolant/Speed <value> | Gear | Del <n> | Clear] - Full rate capture around an event, TRIG<n>.CSV",
+    "36. Gear Adapt [On/Off] - Refine gear ratios while riding, saved to RATIOS.TXT",
+    "37. Sniff [On/Off/Dump] - Every raw K-line byte with its timestamp to SNIFF.BIN, Dump prints it as hex",
+    "38. Log [On/Off | Dump <n>] - Compact session logs LOG<n>.BIN, Dump prints one as hex for tools/log_convert",
+    "39. Log Query <n> <from s> <to s> <channel> [step ms] - One channel of a log over a time range, decimated",
+    "40. History [<channel> <from s ago> <to s ago> [step ms]] - Every frame of the last minutes in RAM, one channel over a window",
+};
 
-  
-  // Gear Ratios Options
-sendResponse("\n**** Gear Ratio Control ****\n");
-  sendResponse("Start the learn process whilst bike is on the stand!");
-sendResponse("1. Ratios - Display Ratios stored in RATIOS.TXT");
-sendResponse("2. Ratio Reset - wipe all saved gear ratios. WARNING!!");
-sendResponse("3. Gears - Start gear training");
-
-// Spiffs Commands
-sendResponse("\n**** Spiffs Commands ****\n");
-sendResponse("4. Dir - List files");
-sendResponse("5. Rename <oldName> <newName> - Rename a file");
-sendResponse("6. Print <filename> - Print the contents of a file");
-sendResponse("7. Delete <filename> - Delete a file");
-sendResponse("8. Delete All - Delete all files from SPIFFS");
-sendResponse("9. Copy <filename> <newFilename> - Copy a file");
-sendResponse("10. Create <filename> - Create a new file");
-sendResponse("11. Q or Quit - Exit");
+void sendLines(const char *const *lines, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        sendResponse(lines[i], strlen(lines[i]));
+    }
+}
 
-// Debug Functions
-sendResponse("\n**** Debug Functions ****\n");
-sendResponse("12. Debug Off - Turn off debug mode");
-sendResponse("13. Debug Rx - Turn on debug mode for receiving data");
-sendResponse("14. Debug Tx - Turn on debug mode for transmitting data");
-sendResponse("15. Debug Pid - Turn on debug mode for PID calculations");
-sendResponse("16. Bike On - Disable bike timer, all flags will not reset");
-sendResponse("17. Bike Off - Enable bike timer, enable normal startup");
-sendResponse("18. Menu - Print a list of all commands");
-sendResponse("19. Reset - Restart the ESP");
-sendResponse("20. Credits - Thanks");
+void menu(std::string command) {
+    sendLines(menuText, sizeof(menuText) / sizeof(menuText[0]));
 }
 
 void receiveResponse(std::string message)
@@ -93,7 +137,7 @@ void receiveResponse(std::string message)
         Debug_RX = false;
         Debug_TX = false;
     } else if (message == "DEBUG YAM") {
-        sendResponse("Command Received: Debug YAM");
+        sendResponse("Command Received: Debug YAM, raw bytes and frames are traced, read them with TRACE");
         Debug_YAM = true;
         Debug_RX = false;
         Debug_TX = false;
@@ -115,6 +159,136 @@ void receiveResponse(std::string message)
         ESP.restart();
     } else if (message == "CREDITS") {
         credits();
+    } else if (message == "BOOT") {
+        bootReport();
+    } else if (message == "LOCK ON") {
+        sendResponse("Command Received: Mid-stream lock enabled");
+        setMidStreamLock(true);
+    } else if (message == "STATS") {
+        showStats();
+    } else if (message == "SLEEP") {
+        sendResponse(parkReport());
+    } else if (message == "SLEEP ON") {
+        sendResponse("Command Received: Light sleep while the bike is off");
+        parkEnabled = true;
+    } else if (message == "SLEEP OFF") {
+        sendResponse("Command Received: Stay awake while the bike is off");
+        parkEnabled = false;
+    } else if (message == "GEAR ADAPT") {
+        sendResponse(std::string("Gear adaptation ") + (gearAdapting ? "on" : "off"));
+        for (size_t i = 0; i < gearAdaptStats.size(); ++i) {
+            sendResponse(gearAdaptReport(i));
+        }
+    } else if (message == "GEAR ADAPT ON") {
+        sendResponse("Command Received: Gear ratios adapt while riding");
+        gearAdapting = true;
+    } else if (message == "GEAR ADAPT OFF") {
+        sendResponse("Command Received: Gear ratios fixed");
+        saveAdaptedRatios(true);
+        gearAdapting = false;
+    } else if (message == "HISTORY") {
+        showHistory();
+    } else if (message == "LOG") {
+        showSessionLogs();
+    } else if (message == "LOG ON") {
+        sendResponse("Command Received: Rides are logged to LOG<n>.BIN");
+        sessionLog.enabled = true;
+    } else if (message == "LOG OFF") {
+        sendResponse("Command Received: Session log off");
+        sessionLog.enabled = false;
+        sessionLog.end();
+    } else if (message == "SNIFF") {
+        sendResponse(sniffReport());
+    } else if (message == "SNIFF ON") {
+        sendResponse(sniffStart() ? "Command Received: Starting the sniffer"
+                                  : "Sniffer already running, SNIFF OFF first");
+    } else if (message == "SNIFF OFF") {
+        sendResponse("Command Received: Stopping the sniffer");
+        sniffStop();
+    } else if (message == "SNIFF DUMP") {
+        sniffDump();
+    } else if (message == "DTC") {
+        showDtcs();
+    } else if (message == "DTC CLEAR") {
+        sendResponse("Command Received: Fault codes and freeze frames cleared");
+        dtcLog.clear();
+    } else if (message == "POWER") {
+        sendResponse(pmReport());
+    } else if (message == "POWER ON") {
+        sendResponse(pmConfigure(true) ? "Command Received: CPU scales down between frames"
+                                       : "CPU frequency scaling unavailable in this build");
+    } else if (message == "POWER OFF") {
+        pmConfigure(false);
+        sendResponse("Command Received: CPU fixed at full clock");
+    } else if (message == "STATS RESET") {
+        sendResponse("Command Received: Ride stats and top speed cleared");
+        resetStats();
+    } else if (message == "ELM STATS") {
+        Device &device = Device::getInstance();
+        {
+            std::lock_guard<std::mutex> lock(device.clientsMutex);
+            for (const BleClient &client : device.clients) {
+                if (client.active) {
+                    sendResponse("Client " + std::to_string(client.connId) +
+                                 " ELM requests: " + std::to_string(client.elmRequests) +
+                                 ", queued: " + std::to_string(client.elmTxQueue.size()) +
+                                 ", dropped: " + std::to_string(client.elmTxDrops));
+                }
+            }
+        }
+        sendResponse("Long-poll " + std::string(elmLongPoll.enabled ? "on" : "off") +
+                     ", held: " + std::to_string(elmLongPoll.held) +
+                     ", fresh: " + std::to_string(elmLongPoll.fresh) +
+                     ", timed out: " + std::to_string(elmLongPoll.expired) +
+                     ", frame period: " + std::to_string(ecuFramePeriodUs) + " us");
+        sendResponse("Console ring " + std::to_string(device.uartTXRing.used()) + "/" +
+                     std::to_string(device.uartTXRing.capacity()) + " bytes, dropped: " +
+                     std::to_string(device.uartTXRing.dropped));
+        sendResponse("USB ELM " + std::string(usbElmMode ? "on" : "off") +
+                     ", requests: " + std::to_string(usbElmRequests));
+        for (const ElmTcpClient &client : elmTcpClients) {
+            if (client.stream.requests) {
+                sendResponse("TCP client ELM requests: " + std::to_string(client.stream.requests) +
+                             ", input overflows: " + std::to_string(client.stream.overflows));
+            }
+        }
+        sendResponse("WiFi ELM " + std::string(elmTcpRunning ? "on" : "off") +
+                     ", TCP clients: " + std::to_string(elmTcpConnected()) +
+                     ", refused: " + std::to_string(elmTcpRejected));
+    } else if (message == "LINK") {
+        Device &device = Device::getInstance();
+        if (!device.clientConnected) {
+            sendResponse("Link: no client connected");
+        }
+        std::lock_guard<std::mutex> lock(device.clientsMutex);
+        for (const BleClient &client : device.clients) {
+            const BleLink *link = client.active ? bleLinkFind(client.peer) : nullptr;
+            if (link) {
+                sendResponse("Link " + std::to_string(client.connId) + ": " + bleLinkReport(*link));
+            }
+        }
+    } else if (message == "USB ELM ON") {
+        setUsbElm(true);
+    } else if (message == "USB ELM OFF") {
+        setUsbElm(false);
+    } else if (message == "WIFI ELM ON") {
+        if (elmTcpStart()) {
+            sendResponse("Command Received: WiFi ELM on, join " ELM_TCP_SSID " and connect to 192.168.0.10:35000");
+        } else {
+            sendResponse("Failed to start WiFi ELM");
+        }
+    } else if (message == "WIFI ELM OFF") {
+        sendResponse("Command Received: WiFi ELM off");
+        elmTcpStop();
+    } else if (message == "LONGPOLL ON") {
+        sendResponse("Command Received: Long-poll enabled, PID requests wait for the next frame");
+        elmLongPoll.enabled = true;
+    } else if (message == "LONGPOLL OFF") {
+        sendResponse("Command Received: Long-poll disabled");
+        elmLongPoll.enabled = false;
+    } else if (message == "LOCK OFF") {
+        sendResponse("Command Received: Mid-stream lock disabled, waiting for IMMO preamble");
+        setMidStreamLock(false);
     } else {
         // Determine the action and arguments for more complex commands
         size_t spaceIndex = message.find(' ');
@@ -156,6 +330,62 @@ void handleActionWithArgs(const std::string& action, const std::string& args) {
         }
     } else if (action == "CREATE") {
         createFile(args);
+    } else if (action == "TRIGGER") {
+        size_t spacePos = args.find(' ');
+        std::string name = args.substr(0, spacePos);
+        std::string value = spacePos == std::string::npos ? "" : args.substr(spacePos + 1);
+        TriggerKind kind = triggerKind(name);
+        // Thresholds are int16_t, a value that does not fit would wrap and fire on every frame
+        char *end = nullptr;
+        long threshold = std::strtol(value.c_str(), &end, 10);
+        bool thresholdValid = !value.empty() && *end == '\0' && threshold >= 0 && threshold <= INT16_MAX;
+        if (args.empty()) {
+            showTriggers();
+        } else if (name == "CLEAR") {
+            triggerCapture.clear();
+            sendResponse("Command Received: Triggers cleared");
+        } else if (name == "DEL") {
+            sendResponse(triggerCapture.remove(std::strtoul(value.c_str(), nullptr, 10)) ? "Trigger deleted"
+                                                                                          : "No such trigger");
+        } else if (kind == TRIGGER_KINDS || (kind != TRIGGER_GEAR && !thresholdValid)) {
+            sendResponse("Invalid TRIGGER command format. Usage: TRIGGER RPM|COOLANT|SPEED <value 0-" +
+                         std::to_string(INT16_MAX) + ">, TRIGGER GEAR");
+        } else if (!triggerCapture.add(kind, kind == TRIGGER_GEAR ? 0 : threshold)) {
+            sendResponse("All " + std::to_string(TRIGGER_MAX) + " triggers in use, delete one first");
+        } else {
+            sendResponse("Command Received: Trigger " + triggerCapture.describe(triggerCapture.triggers[triggerCapture.count - 1]));
+        }
+    } else if (action == "LOG") {
+        unsigned long session = 0;
+        unsigned long stepMs = 0;
+        float fromS = 0, toS = 0;
+        char channel[16];
+        if (sscanf(args.c_str(), "DUMP %lu", &session) == 1) {
+            dumpSessionLog(session);
+        } else if (sscanf(args.c_str(), "QUERY %lu %f %f %15s %lu", &session, &fromS, &toS, channel, &stepMs) >= 4 &&
+                   fromS <= toS) {
+            querySessionLog(session, fromS, toS, channel, stepMs);
+        } else {
+            sendResponse("Invalid LOG command format. Usage: LOG, LOG ON, LOG OFF, LOG DUMP <n>, "
+                         "LOG QUERY <n> <from s> <to s> <channel> [step ms]");
+        }
+    } else if (action == "HISTORY") {
+        unsigned long stepMs = 0;
+        float fromS = 0, toS = 0;
+        char channel[16];
+        if (sscanf(args.c_str(), "%15s %f %f %lu", channel, &fromS, &toS, &stepMs) >= 3 && fromS >= toS && toS >= 0) {
+            queryHistory(channel, fromS, toS, stepMs);
+        } else {
+            sendResponse("Invalid HISTORY command format. Usage: HISTORY, HISTORY <channel> <from s ago> <to s ago> [step ms]");
+        }
+    } else if (action == "TRACE") {
+        if (args == "CLEAR") {
+            traceClear();
+            sendResponse("Trace buffer cleared");
+        } else {
+            size_t count = args.empty() ? 40 : std::strtoul(args.c_str(), nullptr, 10);
+            traceDump(count, [](const std::string &line) { sendResponse(line); });
+        }
     } else {
         sendResponse("Invalid command. Please try again.");
     }
@@ -164,20 +394,24 @@ void handleActionWithArgs(const std::string& action, const std::string& args) {
 
 
 
+const char *const creditsText[] = {
+    "\n\n**** Yamaha Datalogger 2024 ****\n",
+    "Big thanks to:\n",
+    "    TriB : For the L9637D's and LOTS of wise advice\n    https://github.com/HerrRiebmann\n",
+    "    The Dude Discord: @skydiving123 : For Schooling me alot \n",
+    "    Unexpected Maker : for the Feather S3 \n    https://unexpectedmaker.com/\n",
+    "    Jani @RealDash : For a great dash implementation  \n    https://realdash.net/index.php\n",
+    "    Kevin Hope : for a large contribution to the XT660 Scene\n    https://www.facebook.com/kevin.hope.549\n",
+    "    Race Chrono : for the best Data Logger \n    https://racechrono.com/\n",
+    "    xt660x/r/z owners : All of you!\n    https://www.facebook.com/groups/1479421705713602\n",
+    "    Torque App Android\n    https://torque-bhp.com/\n",
+    "    For XDF help\n    https://www.motorcycle-tuning.com/\n",
+    "    Espressif team : for the esp32 s3! \n    https://www.espressif.com/\n",
+    "    Arduino team : For the Community\n    https://forum.arduino.cc/\n",
+    "    Sigrok team : for the software to decode the Yamaha\n    https://sigrok.org\n",
+    "    And a special thanks to the ChatGPT team at OpenAI\n",
+};
+
 void credits() {
-  sendResponse("\n\n**** Yamaha Datalogger 2024 ****\n");
-  sendResponse("Big thanks to:\n");
-  sendResponse("    TriB : For the L9637D's and LOTS of wise advice\n    https://github.com/HerrRiebmann\n");
-  sendResponse("    The Dude Discord: @skydiving123 : For Schooling me alot \n");
-  sendResponse("    Unexpected Maker : for the Feather S3 \n    https://unexpectedmaker.com/\n");
-  sendResponse("    Jani @RealDash : For a great dash implementation  \n    https://realdash.net/index.php\n");
-  sendResponse("    Kevin Hope : for a large contribution to the XT660 Scene\n    https://www.facebook.com/kevin.hope.549\n");
-  sendResponse("    Race Chrono : for the best Data Logger \n    https://racechrono.com/\n");
-  sendResponse("    xt660x/r/z owners : All of you!\n    https://www.facebook.com/groups/1479421705713602\n");
-  sendResponse("    Torque App Android\n    https://torque-bhp.com/\n");
-  sendResponse("    For XDF help\n    https://www.motorcycle-tuning.com/\n");
-  sendResponse("    Espressif team : for the esp32 s3! \n    https://www.espressif.com/\n");
-  sendResponse("    Arduino team : For the Community\n    https://forum.arduino.cc/\n");
-  sendResponse("    Sigrok team : for the software to decode the Yamaha\n    https://sigrok.org\n");
-  sendResponse("    And a special thanks to the ChatGPT team at OpenAI\n");
+    sendLines(creditsText, sizeof(creditsText) / sizeof(creditsText[0]));
 }
@@ -0,0 +1,182 @@
+#pragma once
+#include <stdint.h>
+#include <ecuprofile.h>
+
+// Rollups
+//
+// Per channel aggregates, updated from every decoded frame in fixed memory:
+// min, max, mean and variance of the newest complete second and minute,
+// time-in-band histograms for RPM and coolant, and ride peaks with the ride
+// time they were reached at. An app polling once a second still sees the
+// real extremes through the rollup PIDs instead of whichever frame its
+// request happened to land on.
+
+// Running sums for one window, mean and variance come from the sums
+struct RollupWindow
+{
+  uint32_t count = 0;
+  uint16_t min = 0;
+  uint16_t max = 0;
+  uint32_t sum = 0;
+  uint64_t sumSquares = 0;
+
+  void add(uint16_t value)
+  {
+    if (count == 0 || value < min)
+      min = value;
+    if (count == 0 || value > max)
+      max = value;
+    count++;
+    sum += value;
+    sumSquares += (uint32_t)value * value;
+  }
+
+  double mean() const
+  {
+    return count ? (double)sum / count : 0;
+  }
+
+  double variance() const
+  {
+    if (count < 2)
+    {
+      return 0;
+    }
+    double m = mean();
+    double v = (double)sumSquares / count - m * m;
+    return v > 0 ? v : 0;
+  }
+};
+
+struct RollupChannel
+{
+  RollupWindow second;     // Filling
+  RollupWindow minute;     // Filling
+  RollupWindow lastSecond; // Newest complete second
+  RollupWindow lastMinute; // Newest complete minute
+  uint16_t peak = 0;
+  uint32_t peakSecond = 0; // Ride time of the peak, s
+
+  void add(uint16_t value, uint32_t rideSeconds)
+  {
+    second.add(value);
+    minute.add(value);
+    if (value > peak)
+    {
+      peak = value;
+      peakSecond = rideSeconds;
+    }
+  }
+};
+
+// Time spent in each band in ms. Band 0 is everything below the first edge,
+// the last band everything from its edge up.
+template <uint8_t BANDS>
+struct BandHistogram
+{
+  static constexpr uint8_t COUNT = BANDS;
+  int16_t first; // Lower edge of band 1
+  int16_t width;
+  uint32_t ms[BANDS] = {};
+
+  BandHistogram(int16_t first, int16_t width) : first(first), width(width) {}
+
+  void add(int32_t value, uint32_t timeMs)
+  {
+    int32_t band = value < first ? 0 : (value - first) / width + 1;
+    ms[band < BANDS ? band : BANDS - 1] += timeMs;
+  }
+
+  int32_t lowerEdge(uint8_t band) const
+  {
+    return first + (band - 1) * width;
+  }
+};
+
+enum RollupChannelId : uint8_t
+{
+  ROLLUP_RPM,
+  ROLLUP_SPEED,
+  ROLLUP_COOLANT, // C, the decoder already applied COOLANT_OFFSET
+  ROLLUP_CHANNELS
+};
+
+const char *const rollupNames[ROLLUP_CHANNELS] = {"RPM", "Speed", "Coolant"};
+
+struct Rollups
+{
+  RollupChannel channels[ROLLUP_CHANNELS];
+  BandHistogram<14> rpmBands{1000, 1000};  // <1000, 1000-1999 ... 13000+ rpm
+  BandHistogram<11> coolantBands{40, 10}; // <40, 40-49 ... 130+ C
+  uint32_t rideSeconds = 0;               // Complete seconds of data
+
+  // One decoded frame, true when a second was closed
+  bool frame(uint32_t timeUs, uint16_t rpm, uint8_t speed, uint8_t coolant)
+  {
+    if (!started)
+    {
+      started = true;
+      secondStartUs = timeUs;
+      lastFrameUs = timeUs;
+    }
+
+    // Close the second first so this frame opens the next one. After a gap
+    // in the stream the clock restarts at this frame.
+    bool closed = false;
+    uint32_t elapsedUs = timeUs - secondStartUs;
+    if (elapsedUs >= 1000000)
+    {
+      closeSecond();
+      secondStartUs = elapsedUs < 2000000 ? secondStartUs + 1000000 : timeUs;
+      closed = true;
+    }
+
+    // Time in band counts the frame period, not the silence of a gap
+    uint32_t frameUs = timeUs - lastFrameUs;
+    lastFrameUs = timeUs;
+    if (frameUs < EcuProfile::PREAMBLE_GAP_US)
+    {
+      bandUs += frameUs;
+      rpmBands.add(rpm, bandUs / 1000);
+      coolantBands.add(coolant, bandUs / 1000);
+      bandUs %= 1000;
+    }
+
+    channels[ROLLUP_RPM].add(rpm, rideSeconds);
+    channels[ROLLUP_SPEED].add(speed, rideSeconds);
+    channels[ROLLUP_COOLANT].add(coolant, rideSeconds);
+    return closed;
+  }
+
+  void clear()
+  {
+    *this = Rollups();
+  }
+
+private:
+  bool started = false;
+  uint32_t secondStartUs = 0;
+  uint32_t lastFrameUs = 0;
+  uint32_t bandUs = 0; // Carried below a whole ms
+  uint8_t secondsInMinute = 0;
+
+  void closeSecond()
+  {
+    bool minuteDone = ++secondsInMinute == 60;
+    for (RollupChannel &channel : channels)
+    {
+      channel.lastSecond = channel.second;
+      channel.second = RollupWindow();
+      if (minuteDone)
+      {
+        channel.lastMinute = channel.minute;
+        channel.minute = RollupWindow();
+      }
+    }
+    if (minuteDone)
+    {
+      secondsInMinute = 0;
+    }
+    rideSeconds++;
+  }
+};
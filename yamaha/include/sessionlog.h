@@ -0,0 +1,337 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <ecuprofile.h>
+
+// Session logs
+//
+// Every normal frame of a ride goes into LOG<n>.BIN, one file per session
+// from the first frame to Bike Off. Frames are packed into blocks of up to
+// LOG_BLOCK_RECORDS records; inside a block each channel is its own column of
+// zigzag varints holding the change from the previous record (time: change of
+// the interval, the frame cadence makes that 0 or +-1 ms), so a ride costs a
+// few bytes per frame. A block starts from zero and decodes on its own, its
+// header holds its time span and column lengths so a reader can skip blocks
+// outside a time range and columns it does not need. Next to each log,
+// LOG<n>.IDX holds one LogIndexEntry per block, so a query on the logger
+// finds the block holding a time without reading the log up to it. Little
+// endian like the ESP32. Read natively by tools/log_convert, the flash side
+// lives in spifffs.h.
+
+#define LOG_MAGIC 0x474F4C4BUL  // "KLOG"
+#define LOG_BLOCK_MAGIC 0x4B42U // "BK"
+#define LOG_VERSION 1
+
+enum LogChannel : uint8_t
+{
+  LOG_TIME, // ms from the start of the session
+  LOG_RPM,
+  LOG_SPEED,   // km/h
+  LOG_COOLANT, // C
+  LOG_ERROR,   // Yamaha fault code
+  LOG_GEAR,
+  LOG_CHANNELS
+};
+
+struct __attribute__((packed)) LogChannelInfo
+{
+  char name[11];
+  uint8_t order; // 1 = deltas, 2 = deltas of deltas
+};
+
+const LogChannelInfo logChannels[LOG_CHANNELS] = {{"time", 2},    {"rpm", 1},   {"speed", 1},
+                                                  {"coolant", 1}, {"error", 1}, {"gear", 1}};
+
+struct __attribute__((packed)) LogFileHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint8_t channels;
+  uint8_t reserved;
+  uint16_t blockRecords; // Most records in a block
+  uint16_t reserved2;
+  uint32_t session;
+  uint32_t startMs;  // Logger uptime when the session started
+  char profile[12];  // EcuProfile::NAME
+  LogChannelInfo channel[LOG_CHANNELS];
+};
+
+struct __attribute__((packed)) LogBlockHeader
+{
+  uint16_t magic;
+  uint16_t records;
+  uint32_t firstMs; // Time of the first and last record
+  uint32_t lastMs;
+  uint16_t columnBytes[LOG_CHANNELS]; // Columns follow in channel order
+};
+
+// Sparse time index, one entry per block
+struct __attribute__((packed)) LogIndexEntry
+{
+  uint32_t firstMs;
+  uint32_t offset; // Block header in LOG<n>.BIN
+};
+
+static_assert(sizeof(LogFileHeader) == 104, "log header layout");
+static_assert(sizeof(LogBlockHeader) == 24, "log block layout");
+static_assert(sizeof(LogIndexEntry) == 8, "log index layout");
+
+const uint16_t LOG_BLOCK_RECORDS = 256; // ~3.6 s at 70 frames/s
+const size_t LOG_VARINT_MAX = 5;        // Bytes of a 32-bit varint
+
+inline uint32_t zigzag(int32_t value)
+{
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+inline int32_t unzigzag(uint32_t value)
+{
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+inline size_t putVarint(uint8_t *out, uint32_t value)
+{
+  size_t length = 0;
+  while (value >= 0x80)
+  {
+    out[length++] = (uint8_t)value | 0x80;
+    value >>= 7;
+  }
+  out[length++] = (uint8_t)value;
+  return length;
+}
+
+// Bytes used, 0 when the varint runs past the end
+inline size_t getVarint(const uint8_t *in, size_t length, uint32_t &value)
+{
+  value = 0;
+  for (size_t i = 0; i < length && i < LOG_VARINT_MAX; ++i)
+  {
+    value |= (uint32_t)(in[i] & 0x7F) << (7 * i);
+    if (!(in[i] & 0x80))
+    {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// One column back to values, returns how many were decoded
+inline size_t logDecodeColumn(const uint8_t *in, size_t length, uint8_t order, int32_t *out, size_t count)
+{
+  int32_t value = 0, delta = 0;
+  size_t used = 0;
+  for (size_t i = 0; i < count; ++i)
+  {
+    uint32_t coded;
+    size_t n = getVarint(in + used, length - used, coded);
+    if (n == 0)
+    {
+      return i;
+    }
+    used += n;
+    if (order == 2)
+    {
+      delta += unzigzag(coded);
+      value += delta;
+    }
+    else
+    {
+      value += unzigzag(coded);
+    }
+    out[i] = value;
+  }
+  return count;
+}
+
+// Channel from a command word, LOG_CHANNELS when unknown
+LogChannel logChannel(const char *name)
+{
+  for (uint8_t c = 0; c < LOG_CHANNELS; ++c)
+  {
+    if (strcasecmp(name, logChannels[c].name) == 0)
+    {
+      return (LogChannel)c;
+    }
+  }
+  return LOG_CHANNELS;
+}
+
+// Samples of a range query, at most one per stepMs on a grid from fromMs,
+// every record when stepMs is 0
+struct LogDecimator
+{
+  int32_t fromMs;
+  int32_t toMs;
+  uint32_t stepMs;
+  int64_t nextMs;
+
+  LogDecimator(int32_t from, int32_t to, uint32_t step) : fromMs(from), toMs(to), stepMs(step), nextMs(from) {}
+
+  bool take(int32_t timeMs)
+  {
+    if (timeMs < nextMs || timeMs > toMs)
+    {
+      return false;
+    }
+    nextMs = stepMs ? fromMs + ((int64_t)(timeMs - fromMs) / stepMs + 1) * stepMs : timeMs;
+    return true;
+  }
+
+  bool done(int32_t timeMs) const
+  {
+    return timeMs > toMs;
+  }
+};
+
+// A block being filled, columns are encoded as the records come in
+struct LogBlock
+{
+  LogBlockHeader header;
+  uint8_t columns[LOG_CHANNELS][LOG_BLOCK_RECORDS * LOG_VARINT_MAX];
+
+  void reset()
+  {
+    memset(&header, 0, sizeof(header));
+    header.magic = LOG_BLOCK_MAGIC;
+    memset(last, 0, sizeof(last));
+    lastDelta = 0;
+  }
+
+  // True once the block is full
+  bool add(const int32_t *values)
+  {
+    for (uint8_t c = 0; c < LOG_CHANNELS; ++c)
+    {
+      int32_t delta = values[c] - last[c];
+      int32_t coded = delta;
+      if (logChannels[c].order == 2)
+      {
+        coded = delta - lastDelta;
+        lastDelta = delta;
+      }
+      last[c] = values[c];
+      header.columnBytes[c] += putVarint(columns[c] + header.columnBytes[c], zigzag(coded));
+    }
+    if (header.records == 0)
+    {
+      header.firstMs = values[LOG_TIME];
+    }
+    header.lastMs = values[LOG_TIME];
+    return ++header.records == LOG_BLOCK_RECORDS;
+  }
+
+  size_t bytes() const
+  {
+    size_t total = sizeof(header);
+    for (uint16_t length : header.columnBytes)
+    {
+      total += length;
+    }
+    return total;
+  }
+
+private:
+  int32_t last[LOG_CHANNELS];
+  int32_t lastDelta; // Time channel
+};
+
+// Session state on the decode side, the main loop opens, writes and closes
+// the file
+struct SessionLog
+{
+  bool enabled = false; // Set once SPIFFS is mounted
+  bool active = false;  // Frames are going into a session
+  bool opening = false; // File still to be created
+  bool ending = false;  // Bike Off, flush and close
+  uint32_t session = 0; // Number of the open session
+  uint32_t next = 1;    // Number for the next one
+
+  LogBlock blocks[2];
+  uint8_t fill = 0;           // Block taking records
+  bool full[2] = {};          // Waiting for the main loop
+  uint32_t startMs = 0;       // Uptime when the file was opened
+  uint64_t elapsedUs = 0;     // Frame time since the first frame
+  uint32_t lastUs = 0;
+
+  uint32_t records = 0; // This session
+  uint32_t blocksWritten = 0;
+  uint32_t bytesWritten = 0;
+  uint32_t missed = 0; // Records dropped, a block was still waiting or the file failed
+
+  void frame(uint32_t timeUs, const int32_t *channels)
+  {
+    if (!enabled || ending)
+    {
+      return;
+    }
+    if (!active)
+    {
+      active = true;
+      opening = true;
+      session = next++;
+      elapsedUs = 0;
+      lastUs = timeUs;
+      records = blocksWritten = bytesWritten = missed = 0;
+      fill = 0;
+      full[0] = full[1] = false;
+      blocks[0].reset();
+    }
+    elapsedUs += timeUs - lastUs;
+    lastUs = timeUs;
+
+    int32_t values[LOG_CHANNELS];
+    values[LOG_TIME] = elapsedUs / 1000;
+    memcpy(values + 1, channels, sizeof(int32_t) * (LOG_CHANNELS - 1));
+    records++;
+    if (!blocks[fill].add(values))
+    {
+      return;
+    }
+
+    uint8_t other = fill ^ 1;
+    if (full[other])
+    {
+      // The main loop has not written the last one yet
+      missed += blocks[fill].header.records;
+      blocks[fill].reset();
+      return;
+    }
+    full[fill] = true;
+    fill = other;
+    blocks[fill].reset();
+  }
+
+  // Bike Off or "Log Off", the main loop writes what is left
+  void end()
+  {
+    if (active)
+    {
+      ending = true;
+    }
+  }
+
+  // Main loop, once the file is closed
+  void closed()
+  {
+    active = opening = ending = false;
+    full[0] = full[1] = false;
+  }
+
+  void header(LogFileHeader &out) const
+  {
+    memset(&out, 0, sizeof(out));
+    out.magic = LOG_MAGIC;
+    out.version = LOG_VERSION;
+    out.channels = LOG_CHANNELS;
+    out.blockRecords = LOG_BLOCK_RECORDS;
+    out.session = session;
+    out.startMs = startMs;
+    strncpy(out.profile, EcuProfile::NAME, sizeof(out.profile));
+    memcpy(out.channel, logChannels, sizeof(logChannels));
+  }
+};
+
+SessionLog sessionLog;
@@ -0,0 +1,357 @@
+#pragma once
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <atomic>
+#include <string>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include <ecuprofile.h>
+#include <kcapture.h>
+#include <snifffile.h>
+#include <spifffs.h>
+
+// K-line sniffer
+//
+// Every raw byte with its capture timestamp goes into SNIFF.BIN at line rate,
+// IMMO and diag traffic included. loop() fills one of two RAM buffers, a full
+// buffer is handed to a writer task on core 0 and loop() carries on with the
+// other, so flash latency never stalls the decoder. The file is appended to,
+// SPIFFS writes each page once that way; the capture is sized to the free
+// space when it starts and stops by itself once that is used. The writer
+// task never prints, it posts what happened and the loop reports it.
+// "Sniff Dump" streams the file over USB as hex lines that tools/sniff_convert
+// turns back into the binary file and the replay format.
+
+#ifndef SNIFF_FILE_BYTES
+#define SNIFF_FILE_BYTES (1024 * 1024) // ~110 s at 16040 baud
+#endif
+
+const char *const SNIFF_PATH = "/SNIFF.BIN";
+const size_t SNIFF_BUFFER_RECORDS = 680;  // ~0.4 s of traffic, 4 KB
+const uint8_t SNIFF_STOP = 0xFF;          // Queue entry that closes the file
+
+extern void sendResponse(const std::string &message);
+
+enum SniffState : uint8_t
+{
+  SNIFF_OFF,
+  SNIFF_PREPARING, // Creating the file
+  SNIFF_RUNNING,
+  SNIFF_STOPPING
+};
+
+// Writer task to loop(), see sniffNotify()
+enum SniffNotice : uint8_t
+{
+  SNIFF_NOTICE_RUNNING,
+  SNIFF_NOTICE_NO_SPACE,
+  SNIFF_NOTICE_STOPPED,
+  SNIFF_NOTICE_FULL
+};
+
+struct SniffBuffer
+{
+  SniffRecord records[SNIFF_BUFFER_RECORDS];
+  size_t count = 0;
+  std::atomic<bool> writing{false}; // Owned by the writer task
+};
+
+// Each counter has one owner, the other core only reads it
+struct SniffStats
+{
+  // Writer task
+  std::atomic<uint32_t> records{0};     // Written to the file
+  std::atomic<uint32_t> capacity{0};    // Records that fit
+  std::atomic<uint32_t> writerLost{0};  // Handed over after the file filled up
+  std::atomic<uint32_t> worstWriteMs{0};
+  std::atomic<bool> full{false};
+  // loop()
+  std::atomic<uint32_t> loopLost{0}; // Both buffers busy, or the capture ring overflowed
+  std::atomic<uint32_t> buffers{0};  // Handed to the writer
+
+  uint32_t lost() const
+  {
+    return loopLost.load() + writerLost.load();
+  }
+
+  // From the writer task before the capture runs, loop() does not count yet
+  void reset()
+  {
+    records = 0;
+    capacity = 0;
+    writerLost = 0;
+    worstWriteMs = 0;
+    full = false;
+    loopLost = 0;
+    buffers = 0;
+  }
+};
+
+std::atomic<uint8_t> sniffState(SNIFF_OFF);
+SniffBuffer sniffBuffers[2];
+uint8_t sniffFill = 0;        // Buffer loop() appends to
+bool sniffLostBefore = false; // Flag the next record
+uint32_t sniffCaptureOverflows = 0;
+SniffStats sniffStats;
+QueueHandle_t sniffQueue = nullptr;
+QueueHandle_t sniffNotices = nullptr;
+File sniffFile;
+
+void sniffWriteBuffer(SniffBuffer &buffer)
+{
+  uint32_t room = sniffStats.capacity - sniffStats.records;
+  uint32_t count = std::min<uint32_t>(buffer.count, room);
+  uint32_t startMs = millis();
+  size_t written = sniffFile.write(reinterpret_cast<const uint8_t *>(buffer.records), count * sizeof(SniffRecord));
+  sniffStats.worstWriteMs = std::max(sniffStats.worstWriteMs.load(), (uint32_t)(millis() - startMs));
+  if (written != count * sizeof(SniffRecord))
+  {
+    // Something else took the space meanwhile, the capture ends here
+    count = written / sizeof(SniffRecord);
+    sniffStats.capacity = sniffStats.records + count;
+  }
+  sniffStats.records += count;
+  sniffStats.writerLost += buffer.count - count;
+  buffer.count = 0;
+  buffer.writing.store(false, std::memory_order_release);
+}
+
+void sniffClose()
+{
+  // Count and losses into the header
+  uint32_t counts[2] = {sniffStats.records.load(), sniffStats.lost()};
+  sniffFile.seek(offsetof(SniffHeader, recordCount));
+  sniffFile.write(reinterpret_cast<const uint8_t *>(counts), sizeof(counts));
+  sniffFile.close();
+  sniffState.store(SNIFF_OFF, std::memory_order_release);
+}
+
+bool sniffPrepare()
+{
+  // The previous capture's space counts as free
+  SPIFFS.remove(SNIFF_PATH);
+  size_t fileBytes = std::min<size_t>(SNIFF_FILE_BYTES, SPIFFS.totalBytes() - SPIFFS.usedBytes());
+  fileBytes = fileBytes > 16 * 1024 ? fileBytes - 16 * 1024 : 0; // SPIFFS needs spare pages
+  sniffStats.reset();
+  sniffStats.capacity = fileBytes > sizeof(SniffHeader) ? (fileBytes - sizeof(SniffHeader)) / sizeof(SniffRecord) : 0;
+  if (sniffStats.capacity < SNIFF_BUFFER_RECORDS)
+  {
+    return false;
+  }
+
+  sniffFile = SPIFFS.open(SNIFF_PATH, "w");
+  if (!sniffFile)
+  {
+    return false;
+  }
+  SniffHeader header = {SNIFF_MAGIC, SNIFF_VERSION, sizeof(SniffRecord), EcuProfile::BAUD, 0xFFFFFFFF, 0, {}};
+  strncpy(header.profile, EcuProfile::NAME, sizeof(header.profile));
+  if (sniffFile.write(reinterpret_cast<const uint8_t *>(&header), sizeof(header)) != sizeof(header))
+  {
+    sniffFile.close();
+    return false;
+  }
+  return true;
+}
+
+void sniffNotice(SniffNotice notice)
+{
+  xQueueSend(sniffNotices, &notice, 0);
+}
+
+// Writer task, creates the file on start and then writes whatever is handed over
+void sniffWriter(void *)
+{
+  for (;;)
+  {
+    uint8_t index;
+    if (xQueueReceive(sniffQueue, &index, portMAX_DELAY) != pdTRUE)
+    {
+      continue;
+    }
+
+    if (sniffState.load(std::memory_order_acquire) == SNIFF_PREPARING)
+    {
+      if (sniffPrepare())
+      {
+        sniffState.store(SNIFF_RUNNING, std::memory_order_release);
+        sniffNotice(SNIFF_NOTICE_RUNNING);
+      }
+      else
+      {
+        sniffState.store(SNIFF_OFF, std::memory_order_release);
+        sniffNotice(SNIFF_NOTICE_NO_SPACE);
+      }
+      continue;
+    }
+
+    if (index == SNIFF_STOP)
+    {
+      sniffClose();
+      sniffNotice(SNIFF_NOTICE_STOPPED);
+      continue;
+    }
+
+    if (sniffState.load() == SNIFF_OFF)
+    {
+      // Handed over just as the file filled up
+      sniffBuffers[index].count = 0;
+      sniffBuffers[index].writing.store(false, std::memory_order_release);
+      continue;
+    }
+
+    sniffWriteBuffer(sniffBuffers[index]);
+    if (sniffStats.records == sniffStats.capacity && sniffState.load() == SNIFF_RUNNING)
+    {
+      sniffStats.full = true;
+      sniffClose();
+      sniffNotice(SNIFF_NOTICE_FULL);
+    }
+  }
+}
+
+bool sniffStart()
+{
+  if (sniffState.load() != SNIFF_OFF)
+  {
+    return false;
+  }
+  if (!sniffQueue)
+  {
+    sniffQueue = xQueueCreate(4, sizeof(uint8_t));
+    sniffNotices = xQueueCreate(4, sizeof(uint8_t));
+    xTaskCreatePinnedToCore(sniffWriter, "sniffWriter", 4096, nullptr, 1, nullptr, 0);
+  }
+  for (SniffBuffer &buffer : sniffBuffers)
+  {
+    buffer.count = 0;
+    buffer.writing.store(false);
+  }
+  sniffFill = 0;
+  sniffLostBefore = false;
+  sniffCaptureOverflows = kCaptureOverflows.load();
+  sniffState.store(SNIFF_PREPARING);
+  uint8_t prepare = 0;
+  xQueueSend(sniffQueue, &prepare, portMAX_DELAY);
+  return true;
+}
+
+void sniffHandOver()
+{
+  SniffBuffer &buffer = sniffBuffers[sniffFill];
+  if (buffer.count == 0)
+  {
+    return;
+  }
+  buffer.writing.store(true, std::memory_order_release);
+  xQueueSend(sniffQueue, &sniffFill, portMAX_DELAY);
+  sniffStats.buffers++;
+  sniffFill ^= 1;
+}
+
+void sniffStop()
+{
+  if (sniffState.load() != SNIFF_RUNNING)
+  {
+    return;
+  }
+  sniffState.store(SNIFF_STOPPING);
+  sniffHandOver();
+  xQueueSend(sniffQueue, &SNIFF_STOP, portMAX_DELAY);
+}
+
+// From loop(), prints what the writer task posted
+void sniffNotify()
+{
+  uint8_t notice;
+  while (sniffNotices && xQueueReceive(sniffNotices, &notice, 0) == pdTRUE)
+  {
+    switch (notice)
+    {
+    case SNIFF_NOTICE_RUNNING:
+      sendResponse("Sniffer running, " + std::to_string(sniffStats.capacity * sizeof(SniffRecord) / 1024) +
+                   " KB for " + std::to_string(sniffStats.capacity / (EcuProfile::BAUD / 10)) + " s of traffic");
+      break;
+    case SNIFF_NOTICE_NO_SPACE:
+      sendResponse("Sniffer: not enough SPIFFS space for SNIFF.BIN");
+      break;
+    case SNIFF_NOTICE_STOPPED:
+      sendResponse("Sniffer stopped, " + std::to_string(sniffStats.records) + " bytes in SNIFF.BIN, lost " +
+                   std::to_string(sniffStats.lost()));
+      break;
+    case SNIFF_NOTICE_FULL:
+      sendResponse("Sniffer stopped, SNIFF.BIN is full (" + std::to_string(sniffStats.records) + " bytes)");
+      break;
+    }
+  }
+}
+
+// Every byte loop() takes from the capture ring
+void sniffByte(uint8_t value, uint32_t timeUs, uint8_t flags = 0)
+{
+  if (sniffState.load(std::memory_order_acquire) != SNIFF_RUNNING)
+  {
+    return;
+  }
+
+  uint32_t overflows = kCaptureOverflows.load(std::memory_order_relaxed);
+  if (overflows != sniffCaptureOverflows)
+  {
+    sniffStats.loopLost += overflows - sniffCaptureOverflows;
+    sniffCaptureOverflows = overflows;
+    sniffLostBefore = true;
+  }
+
+  SniffBuffer &buffer = sniffBuffers[sniffFill];
+  if (buffer.writing.load(std::memory_order_acquire))
+  {
+    // The writer still has both buffers
+    sniffStats.loopLost++;
+    sniffLostBefore = true;
+    return;
+  }
+
+  buffer.records[buffer.count++] = {timeUs, value, (uint8_t)(flags | (sniffLostBefore ? SNIFF_LOST : 0))};
+  sniffLostBefore = false;
+  if (buffer.count == SNIFF_BUFFER_RECORDS)
+  {
+    sniffHandOver();
+  }
+}
+
+// Hex lines over USB, "SNIFF <offset> <hex>", only the part holding records
+void sniffDump()
+{
+  if (sniffState.load() != SNIFF_OFF)
+  {
+    sendResponse("Stop the sniffer first");
+    return;
+  }
+
+  File file = SPIFFS.open(SNIFF_PATH, "r");
+  SniffHeader header;
+  if (!file || file.read(reinterpret_cast<uint8_t *>(&header), sizeof(header)) != sizeof(header) ||
+      header.magic != SNIFF_MAGIC)
+  {
+    sendResponse("No capture in SNIFF.BIN");
+    return;
+  }
+
+  size_t records = header.recordCount == 0xFFFFFFFF ? (file.size() - sizeof(header)) / sizeof(SniffRecord)
+                                                    : header.recordCount;
+  size_t length = sizeof(header) + records * sizeof(SniffRecord);
+  file.seek(0);
+  dumpFileHex(file, length, "SNIFF");
+  file.close();
+}
+
+std::string sniffReport()
+{
+  static const char *const states[] = {"off", "preparing", "running", "stopping"};
+  char line[200];
+  snprintf(line, sizeof(line), "Sniffer %s, %u of %u bytes, lost %u, buffers %u, worst write %u ms%s",
+           states[sniffState.load()], sniffStats.records.load(), sniffStats.capacity.load(), sniffStats.lost(),
+           sniffStats.buffers.load(), sniffStats.worstWriteMs.load(), sniffStats.full ? ", file full" : "");
+  return line;
+}
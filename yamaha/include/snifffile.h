@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Sniff file format
+//
+// SNIFF.BIN written by sniffer.h and read by tools/sniff_convert: a fixed
+// header followed by one packed record per raw K-line byte. recordCount is
+// filled in when the capture stops; a capture cut short by a reset is read
+// to the end of the file, or up to the first 0xFF record in files from
+// firmware that preallocated them.
+// Little endian like the ESP32.
+
+#define SNIFF_MAGIC 0x464E534BUL // "KSNF"
+#define SNIFF_VERSION 1
+
+enum SniffFlags : uint8_t
+{
+  SNIFF_TX = 0x01,   // Logger -> ECU, otherwise ECU -> logger
+  SNIFF_LOST = 0x02, // Bytes were lost right before this one
+};
+
+struct __attribute__((packed)) SniffHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t recordSize;
+  uint32_t baud;
+  uint32_t recordCount; // 0xFFFFFFFF while the capture runs
+  uint32_t lost;        // Bytes dropped, capture ring or writer overflow
+  char profile[12];     // EcuProfile::NAME
+};
+
+struct __attribute__((packed)) SniffRecord
+{
+  uint32_t timeUs; // Capture timestamp, wraps after 71 minutes
+  uint8_t value;
+  uint8_t flags; // SniffFlags
+};
+
+static_assert(sizeof(SniffHeader) == 32, "sniff header layout");
+static_assert(sizeof(SniffRecord) == 6, "sniff record layout");
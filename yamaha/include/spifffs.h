@@ -4,6 +4,9 @@
 #include <string>
 #include <iostream>
 #include <sstream>
+#include <dtc.h>
+#include <triggers.h>
+#include <sessionlog.h>
 
 // Function prototypes
 void menu(std::string command);
@@ -16,10 +19,29 @@ void copyFile(std::string filename, std::string newFilename);
 void createFile(std::string filename);
 extern void sendResponse(const std::string &message);
 void showRATIOS();
+void loadTopSpeed();
+void saveTopSpeed();
+void loadStoredDtcs();
+void saveFreezeFrame();
+void deleteFreezeFrames();
+void saveTriggerCapture();
+void loadSessionLogs();
+void saveSessionLog();
+void dumpSessionLog(uint32_t session);
+void querySessionLog(uint32_t session, float fromS, float toS, const char *channelName, uint32_t stepMs);
+void serviceSessionQuery();
+extern size_t consoleRoom();
+extern bool usbElmMode;
+extern bool historyQueryRunning();
+void dumpFileHex(File &file, size_t length, const char *tag);
 
 // External constant vector declaration
 extern std::vector <float> constRatios;
 
+// Top speed, persisted in TOPSPEED.TXT
+extern uint8_t Max_Speed_PID;
+uint8_t savedTopSpeed = 0;
+
 
 void dir() {
   sendResponse("Listing files:");
@@ -134,9 +156,9 @@ void deleteAll() {
     String filePath = String("/") + file.name(); // Ensure the file path starts with '/'
     file.close(); // Close the file before attempting to delete
     if (SPIFFS.remove(filePath)) {
-      Serial.println("Removed file: " + filePath); // Print the name of the file removed
+      sendResponse(("Removed file: " + filePath).c_str()); // Print the name of the file removed
     } else {
-      Serial.println("Failed to remove file: " + filePath); // Print if the file removal failed
+      sendResponse(("Failed to remove file: " + filePath).c_str()); // Print if the file removal failed
     }
   }
   sendResponse("All files deleted successfully.");
@@ -312,3 +334,521 @@ void loadSpiffRatios() {
 
   sendResponse("SPIFFS ratios loaded successfully.");
 }
+
+void loadTopSpeed() {
+  File file = SPIFFS.open("/TOPSPEED.TXT", "r");
+  if (!file) {
+    return; // Nothing saved yet
+  }
+  savedTopSpeed = file.readStringUntil('\n').toInt();
+  file.close();
+  if (savedTopSpeed > Max_Speed_PID) {
+    Max_Speed_PID = savedTopSpeed;
+  }
+}
+
+// Only writes when the top speed changed, called on bike off
+void saveTopSpeed() {
+  if (Max_Speed_PID == savedTopSpeed) {
+    return;
+  }
+  File file = SPIFFS.open("/TOPSPEED.TXT", "w");
+  if (!file) {
+    sendResponse("Failed to open TOPSPEED.TXT for writing.");
+    return;
+  }
+  file.println(Max_Speed_PID);
+  file.close();
+  savedTopSpeed = Max_Speed_PID;
+}
+
+// Freeze frames, one DTC<code>.CSV per stored code, see dtc.h
+std::string freezeFileName(uint8_t code) {
+  return "/DTC" + std::to_string(code) + ".CSV";
+}
+
+// Yamaha code of a freeze file name, 0 if it is none
+uint8_t freezeFileCode(const char *name) {
+  unsigned code = 0;
+  if (*name == '/') {
+    name++;
+  }
+  if (sscanf(name, "DTC%u.CSV", &code) != 1 || code > 255) {
+    return 0;
+  }
+  return code;
+}
+
+// Codes with a freeze frame on flash are stored DTCs again after a restart
+void loadStoredDtcs() {
+  File root = SPIFFS.open("/");
+  if (!root) {
+    return;
+  }
+  for (File file = root.openNextFile(); file; file = root.openNextFile()) {
+    dtcLog.restore(freezeFileCode(file.name()));
+  }
+}
+
+// Called from the main loop, the decode path only copies the ring
+void saveFreezeFrame() {
+  if (!dtcLog.snapshotPending) {
+    return;
+  }
+  dtcLog.snapshotPending = false;
+
+  uint8_t code = dtcLog.snapshotCode;
+  std::string filename = freezeFileName(code);
+  File file = SPIFFS.open(filename.c_str(), "w");
+  if (!file) {
+    sendResponse("Failed to open " + filename + " for writing.");
+    return;
+  }
+
+  // Time is relative to the frame that reported the code
+  uint32_t triggerUs = dtcLog.snapshotUs;
+  size_t first = channelHistory.lowerBound(triggerUs - FREEZE_SECONDS * 1000000UL);
+  size_t last = channelHistory.upperBound(triggerUs);
+  size_t count = last - first;
+  char line[80];
+  snprintf(line, sizeof(line), "# Yamaha %u %s %s", code, dtcText(dtcFor(code)).c_str(), faultName(code));
+  file.println(line);
+  file.println("ms,rpm,speed,coolant,error,gear");
+  for (size_t i = first; i < last; ++i) {
+    ChannelSample s = channelHistory.sample(i);
+    snprintf(line, sizeof(line), "%ld,%u,%u,%u,%u,%u", -(long)((triggerUs - s.timeUs) / 1000), s.rpm, s.speed,
+             s.coolant, s.error, s.gear);
+    file.println(line);
+  }
+  file.close();
+  sendResponse("Fault " + dtcText(dtcFor(code)) + " (Yamaha " + std::to_string(code) + "), " +
+               std::to_string(count) + " samples saved to " + filename);
+}
+
+// Mode 04 or "Dtc Clear"
+void deleteFreezeFrames() {
+  if (!dtcLog.clearPending) {
+    return;
+  }
+  dtcLog.clearPending = false;
+
+  std::vector<std::string> names;
+  File root = SPIFFS.open("/");
+  if (!root) {
+    return;
+  }
+  for (File file = root.openNextFile(); file; file = root.openNextFile()) {
+    uint8_t code = freezeFileCode(file.name());
+    if (code) {
+      names.push_back(freezeFileName(code));
+    }
+  }
+  root.close();
+  for (const std::string &name : names) {
+    SPIFFS.remove(name.c_str());
+  }
+}
+
+// Trigger capture windows, TRIG0.CSV - TRIG7.CSV round robin, see triggers.h
+void saveTriggerCapture() {
+  if (!triggerCapture.pending) {
+    return;
+  }
+  triggerCapture.pending = false;
+
+  std::string filename = "/TRIG" + std::to_string(triggerCapture.sequence++ % TRIGGER_FILES) + ".CSV";
+  File file = SPIFFS.open(filename.c_str(), "w");
+  if (!file) {
+    sendResponse("Failed to open " + filename + " for writing.");
+    return;
+  }
+
+  // Time is relative to the frame that fired, raw bytes as on the line
+  uint32_t triggerUs = triggerCapture.triggerUs;
+  size_t first = channelHistory.lowerBound(triggerUs - TRIGGER_PRE_SECONDS * 1000000UL);
+  size_t last = channelHistory.upperBound(triggerUs + TRIGGER_POST_SECONDS * 1000000UL);
+  std::string trigger = triggerCapture.describe(triggerCapture.firedBy);
+  char line[80];
+  snprintf(line, sizeof(line), "# Trigger %s, value %ld", trigger.c_str(), (long)triggerCapture.firedValue);
+  file.println(line);
+  file.println("us,raw,rpm,speed_raw,error,coolant"); // Speed is summed over SPEED_FRAMES frames
+  for (size_t i = first; i < last; ++i) {
+    const uint8_t *b = channelHistory.frame(i);
+    int length = snprintf(line, sizeof(line), "%ld,", (long)(int32_t)(channelHistory.time(i) - triggerUs));
+    for (uint8_t j = 0; j < EcuProfile::FRAME_LENGTH; ++j) {
+      length += snprintf(line + length, sizeof(line) - length, "%02X", b[j]);
+    }
+    snprintf(line + length, sizeof(line) - length, ",%u,%u,%u,%d", b[EcuProfile::RPM_INDEX] * EcuProfile::RPM_SCALE,
+             b[EcuProfile::SPEED_INDEX], b[EcuProfile::ERROR_INDEX],
+             b[EcuProfile::COOLANT_INDEX] + EcuProfile::COOLANT_OFFSET);
+    file.println(line);
+  }
+  file.close();
+  sendResponse("Trigger " + trigger + ", " + std::to_string(last - first) + " frames saved to " +
+               filename);
+}
+
+// Session logs, LOG<n>.BIN and its index LOG<n>.IDX, see sessionlog.h
+const size_t LOG_RESERVE_BYTES = 256 * 1024; // Left free for ratios, freeze frames, triggers and sniffs
+const uint16_t LOG_QUERY_MAX = 2000;         // Samples a query prints
+const uint8_t QUERY_LINES_PER_LOOP = 16;     // Query lines printed per loop, see serviceSessionQuery()
+const size_t QUERY_SUMMARY_BYTES = 128;      // Console room the closing line waits for
+File sessionFile;
+File sessionIndex;
+
+std::string sessionFileName(uint32_t session) {
+  return "/LOG" + std::to_string(session) + ".BIN";
+}
+
+std::string sessionIndexName(uint32_t session) {
+  return "/LOG" + std::to_string(session) + ".IDX";
+}
+
+// Session number of a log file name, 0 if it is none
+uint32_t sessionFileNumber(const char *name) {
+  unsigned long session = 0;
+  int end = 0;
+  if (*name == '/') {
+    name++;
+  }
+  if (sscanf(name, "LOG%lu.BIN%n", &session, &end) != 1 || end == 0 || name[end] != 0) {
+    return 0;
+  }
+  return session;
+}
+
+// Numbering carries on from the newest log on flash
+void loadSessionLogs() {
+  File root = SPIFFS.open("/");
+  if (!root) {
+    return;
+  }
+  for (File file = root.openNextFile(); file; file = root.openNextFile()) {
+    uint32_t session = sessionFileNumber(file.name());
+    if (session >= sessionLog.next) {
+      sessionLog.next = session + 1;
+    }
+  }
+}
+
+// Oldest sessions go when flash runs low, never the one being written
+bool pruneSessionLogs() {
+  while (SPIFFS.totalBytes() - SPIFFS.usedBytes() < LOG_RESERVE_BYTES) {
+    uint32_t oldest = 0;
+    File root = SPIFFS.open("/");
+    for (File file = root ? root.openNextFile() : File(); file; file = root.openNextFile()) {
+      uint32_t session = sessionFileNumber(file.name());
+      if (session && session != sessionLog.session && (oldest == 0 || session < oldest)) {
+        oldest = session;
+      }
+    }
+    if (oldest == 0) {
+      return false;
+    }
+    SPIFFS.remove(sessionFileName(oldest).c_str());
+    SPIFFS.remove(sessionIndexName(oldest).c_str());
+    sendResponse("Flash low, deleted " + sessionFileName(oldest).substr(1));
+  }
+  return true;
+}
+
+bool writeLogBlock(LogBlock &block) {
+  if (block.header.records == 0) {
+    return true;
+  }
+  size_t written = 0;
+  LogIndexEntry entry = {block.header.firstMs, sessionLog.bytesWritten};
+  if (sessionFile) {
+    written = sessionFile.write(reinterpret_cast<const uint8_t *>(&block.header), sizeof(block.header));
+    for (uint8_t c = 0; c < LOG_CHANNELS; ++c) {
+      written += sessionFile.write(block.columns[c], block.header.columnBytes[c]);
+    }
+  }
+  if (written != block.bytes()) {
+    sessionLog.missed += block.header.records;
+    return false;
+  }
+  sessionLog.blocksWritten++;
+  sessionLog.bytesWritten += written;
+  if (sessionIndex) {
+    sessionIndex.write(reinterpret_cast<const uint8_t *>(&entry), sizeof(entry));
+  }
+  return true;
+}
+
+// Called from the main loop, the decode path only fills blocks
+void saveSessionLog() {
+  if (!sessionLog.active) {
+    return;
+  }
+
+  if (sessionLog.opening) {
+    sessionLog.opening = false;
+    sessionLog.startMs = millis();
+    std::string filename = sessionFileName(sessionLog.session);
+    if (pruneSessionLogs()) {
+      sessionFile = SPIFFS.open(filename.c_str(), "w");
+    }
+    if (!sessionFile) {
+      sendResponse("Failed to open " + filename + " for writing, session not logged.");
+    } else {
+      LogFileHeader header;
+      sessionLog.header(header);
+      sessionLog.bytesWritten = sessionFile.write(reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+      sessionIndex = SPIFFS.open(sessionIndexName(sessionLog.session).c_str(), "w");
+    }
+  }
+
+  // The full block is older than the one still filling
+  for (uint8_t b = 0; b < 2; ++b) {
+    if (sessionLog.full[b]) {
+      if ((!writeLogBlock(sessionLog.blocks[b]) || !pruneSessionLogs()) && sessionFile) {
+        sessionFile.close();
+        sessionIndex.close();
+        sendResponse("Flash full, " + sessionFileName(sessionLog.session).substr(1) + " stopped early");
+      }
+      sessionLog.full[b] = false;
+    }
+  }
+
+  if (sessionLog.ending) {
+    writeLogBlock(sessionLog.blocks[sessionLog.fill]);
+    sessionIndex.close();
+    if (sessionFile) {
+      sessionFile.close();
+      sendResponse("Session saved to " + sessionFileName(sessionLog.session).substr(1) + ", " +
+                   std::to_string(sessionLog.records) + " frames in " + std::to_string(sessionLog.bytesWritten / 1024) +
+                   " KB, missed " + std::to_string(sessionLog.missed));
+    }
+    sessionLog.closed();
+  }
+}
+
+// Binary files as hex lines over USB, "<tag> BEGIN <bytes>", "<tag> <offset>
+// <hex>" and "<tag> END", turned back into the file by the host tools
+// Raw over USB, the port only carries ELM replies in USB ELM mode
+void dumpFileHex(File &file, size_t length, const char *tag) {
+  if (usbElmMode) {
+    sendResponse(std::string(tag) + " dump is over USB, switch USB ELM off first");
+    return;
+  }
+  const size_t lineBytes = 48;
+  uint8_t data[lineBytes];
+  char line[24 + 2 * lineBytes];
+  Serial.printf("%s BEGIN %u\n", tag, (unsigned)length);
+  for (size_t offset = 0; offset < length; offset += lineBytes) {
+    size_t count = file.read(data, std::min(lineBytes, length - offset));
+    int used = snprintf(line, sizeof(line), "%s %06X ", tag, (unsigned)offset);
+    for (size_t i = 0; i < count; ++i) {
+      used += snprintf(line + used, sizeof(line) - used, "%02X", data[i]);
+    }
+    Serial.println(line);
+  }
+  Serial.printf("%s END\n", tag);
+}
+
+void dumpSessionLog(uint32_t session) {
+  std::string filename = sessionFileName(session);
+  if (sessionLog.active && session == sessionLog.session) {
+    sendResponse(filename.substr(1) + " is still being written");
+    return;
+  }
+  File file = SPIFFS.open(filename.c_str(), "r");
+  if (!file) {
+    sendResponse("No " + filename.substr(1));
+    return;
+  }
+  dumpFileHex(file, file.size(), "LOG");
+  file.close();
+}
+
+// Offset of the block holding fromMs, or the last block starting before it
+uint32_t seekSessionLog(uint32_t session, File &log, int32_t fromMs) {
+  uint32_t offset = sizeof(LogFileHeader);
+  File index = SPIFFS.open(sessionIndexName(session).c_str(), "r");
+  if (index) {
+    // Binary search, entries are in time order
+    size_t low = 0, high = index.size() / sizeof(LogIndexEntry);
+    while (low < high) {
+      size_t middle = (low + high) / 2;
+      LogIndexEntry entry;
+      index.seek(middle * sizeof(entry));
+      if (index.read(reinterpret_cast<uint8_t *>(&entry), sizeof(entry)) != sizeof(entry)) {
+        break;
+      }
+      if ((int32_t)entry.firstMs <= fromMs) {
+        offset = entry.offset;
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    index.close();
+    return offset;
+  }
+
+  // Logs without an index, walk the block headers
+  LogBlockHeader block;
+  while (log.seek(offset) && log.read(reinterpret_cast<uint8_t *>(&block), sizeof(block)) == sizeof(block) &&
+         block.magic == LOG_BLOCK_MAGIC && (int32_t)block.lastMs < fromMs) {
+    offset += sizeof(block);
+    for (uint8_t c = 0; c < LOG_CHANNELS; ++c) {
+      offset += block.columnBytes[c];
+    }
+  }
+  return offset;
+}
+
+// A "Log Query" in progress. It is printed a few lines per loop and only
+// while the console has room, so a BLE terminal gets every line instead of
+// the console ring dropping the oldest ones
+struct SessionQuery {
+  bool active = false;
+  bool headerSent = false;
+  bool finished = false;
+  bool truncated = false;
+  File log;
+  LogChannel channel = LOG_RPM;
+  LogDecimator pick{0, 0, 0};
+  uint32_t offset = 0;
+  uint32_t endOffset = 0; // File size when the query started
+  uint16_t index = 0;     // Next record of the decoded block
+  uint16_t records = 0;   // Records in the decoded block
+  uint16_t samples = 0;
+  uint16_t blocks = 0;
+  uint32_t startMs = 0;
+  int32_t times[LOG_BLOCK_RECORDS];
+  int32_t values[LOG_BLOCK_RECORDS];
+  uint8_t column[LOG_BLOCK_RECORDS * LOG_VARINT_MAX];
+};
+SessionQuery sessionQuery; // Global, the loop task stack is small
+
+// "Log Query", one channel over a time range straight from flash, decimated
+// to one sample per stepMs. serviceSessionQuery() prints it
+void querySessionLog(uint32_t session, float fromS, float toS, const char *channelName, uint32_t stepMs) {
+  LogChannel channel = logChannel(channelName);
+  if (channel == LOG_CHANNELS || channel == LOG_TIME) {
+    sendResponse(std::string("Unknown channel ") + channelName + ", one of RPM SPEED COOLANT ERROR GEAR");
+    return;
+  }
+  if (sessionQuery.active || historyQueryRunning()) {
+    sendResponse("A query is still printing");
+    return;
+  }
+
+  // The open session can be read up to its last written block
+  if (sessionLog.active && session == sessionLog.session) {
+    sessionFile.flush();
+    sessionIndex.flush();
+  }
+  std::string filename = sessionFileName(session);
+  File log = SPIFFS.open(filename.c_str(), "r");
+  LogFileHeader header;
+  if (!log || log.read(reinterpret_cast<uint8_t *>(&header), sizeof(header)) != sizeof(header) ||
+      header.magic != LOG_MAGIC || header.version != LOG_VERSION || header.channels != LOG_CHANNELS) {
+    sendResponse("No " + filename.substr(1));
+    return;
+  }
+
+  SessionQuery &query = sessionQuery;
+  query.startMs = millis();
+  query.log = log;
+  query.channel = channel;
+  query.pick = LogDecimator(fromS * 1000, toS * 1000, stepMs);
+  query.offset = seekSessionLog(session, log, query.pick.fromMs);
+  // Blocks the open session writes from here on are not part of the query
+  query.endOffset = log.size();
+  query.index = query.records = 0;
+  query.samples = query.blocks = 0;
+  query.headerSent = query.finished = query.truncated = false;
+  query.active = true;
+}
+
+// Decodes the next block with records in the range, false at the end
+bool nextQueryBlock(SessionQuery &query) {
+  LogBlockHeader block;
+  while (query.offset < query.endOffset && query.log.seek(query.offset) &&
+         query.log.read(reinterpret_cast<uint8_t *>(&block), sizeof(block)) == sizeof(block) &&
+         block.magic == LOG_BLOCK_MAGIC && block.records <= LOG_BLOCK_RECORDS && !query.pick.done(block.firstMs)) {
+    uint32_t next = query.offset + sizeof(block);
+    uint32_t channelOffset = next + block.columnBytes[LOG_TIME];
+    for (uint8_t c = 0; c < LOG_CHANNELS; ++c) {
+      next += block.columnBytes[c];
+      if (c > LOG_TIME && c < query.channel) {
+        channelOffset += block.columnBytes[c];
+      }
+    }
+    query.offset = next;
+    if ((int32_t)block.lastMs < query.pick.fromMs) {
+      continue;
+    }
+    query.blocks++;
+
+    // Time column right after the header, then only the wanted channel
+    uint16_t timeBytes = block.columnBytes[LOG_TIME];
+    uint16_t channelBytes = block.columnBytes[query.channel];
+    if (query.log.read(query.column, timeBytes) != timeBytes ||
+        logDecodeColumn(query.column, timeBytes, logChannels[LOG_TIME].order, query.times, block.records) !=
+            block.records ||
+        !query.log.seek(channelOffset) || query.log.read(query.column, channelBytes) != channelBytes ||
+        logDecodeColumn(query.column, channelBytes, logChannels[query.channel].order, query.values, block.records) !=
+            block.records) {
+      return false;
+    }
+    query.index = 0;
+    query.records = block.records;
+    return true;
+  }
+  return false;
+}
+
+// From loop(), up to QUERY_LINES_PER_LOOP lines and one block read per call
+void serviceSessionQuery() {
+  SessionQuery &query = sessionQuery;
+  if (!query.active) {
+    return;
+  }
+
+  char line[32];
+  bool blockRead = false;
+  uint8_t lines = 0;
+  while (!query.finished && lines < QUERY_LINES_PER_LOOP && consoleRoom() > sizeof(line)) {
+    if (!query.headerSent) {
+      sendResponse(std::string("time,") + logChannels[query.channel].name);
+      query.headerSent = true;
+      lines++;
+      continue;
+    }
+    if (query.index == query.records) {
+      if (blockRead) {
+        break;
+      }
+      blockRead = true;
+      query.finished = !nextQueryBlock(query);
+      continue;
+    }
+
+    uint16_t i = query.index++;
+    if (!query.pick.take(query.times[i])) {
+      continue;
+    }
+    if (query.samples == LOG_QUERY_MAX) {
+      query.truncated = query.finished = true;
+      break;
+    }
+    snprintf(line, sizeof(line), "%ld.%03ld,%ld", (long)(query.times[i] / 1000), (long)(query.times[i] % 1000),
+             (long)query.values[i]);
+    sendResponse(line);
+    query.samples++;
+    lines++;
+  }
+  if (!query.finished || consoleRoom() < QUERY_SUMMARY_BYTES) {
+    return;
+  }
+
+  query.log.close();
+  query.active = false;
+  sendResponse("# " + std::to_string(query.samples) + " samples from " + std::to_string(query.blocks) + " blocks in " +
+               std::to_string((uint32_t)(millis() - query.startMs)) + " ms" +
+               (query.truncated ? ", stopped at " + std::to_string(LOG_QUERY_MAX) + ", use a larger step" : ""));
+}
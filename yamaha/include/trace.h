@@ -0,0 +1,164 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#ifdef ARDUINO
+#include "esp_timer.h"
+#else
+#include <chrono>
+#endif
+
+// Binary trace ring
+//
+// Hot paths record a 12 byte event (timestamp, id, level, two args) into a
+// RAM ring instead of building strings. Nothing is formatted until a host
+// asks for the buffer with the TRACE menu command. Levels above TRACE_LEVEL
+// compile to nothing, set it with -D TRACE_LEVEL=x in platformio.ini. The
+// per-byte and per-frame DEBUG events are also only recorded under DEBUG YAM,
+// at ~70 frames a second they would push everything else out of the ring.
+
+#define TRACE_LEVEL_OFF 0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO 2
+#define TRACE_LEVEL_DEBUG 3
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_DEBUG
+#endif
+
+#define TRACE_SIZE 1024 // Power of two
+#define TRACE_MASK (TRACE_SIZE - 1)
+
+enum TraceEvent : uint8_t
+{
+  TRACE_YAM_RX,
+  TRACE_FRAME,
+  TRACE_IMMO_START,
+  TRACE_NORMAL_START,
+  TRACE_DIAG_START,
+  TRACE_LOCKED,
+  TRACE_BIKE_OFF,
+  TRACE_CAPTURE_OVERFLOW,
+  TRACE_ELM_DROP,
+  TRACE_BLE_LINK,
+  TRACE_WAKE,
+  TRACE_EVENT_COUNT
+};
+
+struct TraceRecord
+{
+  uint32_t timeUs;
+  uint8_t event;
+  uint8_t level;
+  uint16_t arg0;
+  uint32_t arg1;
+};
+
+// Names and formats, only used when the buffer is read
+struct TraceFormat
+{
+  const char *name;
+  const char *format;
+};
+
+const TraceFormat traceFormats[TRACE_EVENT_COUNT] = {
+    {"YAM_RX", "%02x"},
+    {"FRAME", "rpm %u speed %u"},
+    {"IMMO_START", ""},
+    {"NORMAL_START", ""},
+    {"DIAG_START", ""},
+    {"LOCKED", "after %u ms"},
+    {"BIKE_OFF", "silent %u ms"},       // arg0 saturates at 65535
+    {"CAPTURE_OVERFLOW", "total %u"},   // arg0 saturates at 65535
+    {"ELM_DROP", "queued %u total %u"},
+    {"BLE_LINK", "interval %u x1.25 ms status %u"}, // Requested interval and status when rejected
+    {"WAKE", "first byte %02x after %u us"},
+};
+
+TraceRecord traceBuffer[TRACE_SIZE];
+std::atomic<uint32_t> traceHead(0);
+
+inline uint32_t traceNowUs()
+{
+#ifdef ARDUINO
+  return esp_timer_get_time();
+#else
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// timeUs for events that happened before they are recorded, e.g. a byte on the wire
+inline void traceRecord(TraceEvent event, uint8_t level, uint16_t arg0, uint32_t arg1, uint32_t timeUs = traceNowUs())
+{
+  uint32_t slot = traceHead.fetch_add(1, std::memory_order_relaxed) & TRACE_MASK;
+  TraceRecord &record = traceBuffer[slot];
+  record.timeUs = timeUs;
+  record.event = event;
+  record.level = level;
+  record.arg0 = arg0;
+  record.arg1 = arg1;
+}
+
+#if TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_ERROR(event, arg0, arg1) traceRecord(event, TRACE_LEVEL_ERROR, arg0, arg1)
+#else
+#define TRACE_ERROR(event, arg0, arg1) do {} while (0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(event, arg0, arg1) traceRecord(event, TRACE_LEVEL_INFO, arg0, arg1)
+#else
+#define TRACE_INFO(event, arg0, arg1) do {} while (0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(event, arg0, arg1) traceRecord(event, TRACE_LEVEL_DEBUG, arg0, arg1)
+#define TRACE_DEBUG_AT(timeUs, event, arg0, arg1) traceRecord(event, TRACE_LEVEL_DEBUG, arg0, arg1, timeUs)
+#else
+#define TRACE_DEBUG(event, arg0, arg1) do {} while (0)
+#define TRACE_DEBUG_AT(timeUs, event, arg0, arg1) do {} while (0)
+#endif
+
+// Format one record, lazily
+inline std::string traceFormat(const TraceRecord &record)
+{
+  static const char levels[] = "-EID";
+  char line[64];
+  int n = snprintf(line, sizeof(line), "%lu.%06lu %c ", (unsigned long)(record.timeUs / 1000000),
+                   (unsigned long)(record.timeUs % 1000000), levels[record.level & 3]);
+
+  if (record.event >= TRACE_EVENT_COUNT)
+  {
+    snprintf(line + n, sizeof(line) - n, "EVENT_%u %u %lu", record.event, record.arg0, (unsigned long)record.arg1);
+    return line;
+  }
+
+  const TraceFormat &format = traceFormats[record.event];
+  n += snprintf(line + n, sizeof(line) - n, "%s ", format.name);
+  snprintf(line + n, sizeof(line) - n, format.format, record.arg0, (unsigned)record.arg1);
+  return line;
+}
+
+// Hand the newest count records to output, oldest first
+template <typename Output>
+void traceDump(size_t count, Output output)
+{
+  uint32_t head = traceHead.load(std::memory_order_relaxed);
+  size_t available = head < TRACE_SIZE ? head : TRACE_SIZE;
+  if (count > available)
+  {
+    count = available;
+  }
+
+  for (uint32_t i = head - count; i != head; ++i)
+  {
+    output(traceFormat(traceBuffer[i & TRACE_MASK]));
+  }
+}
+
+inline void traceClear()
+{
+  traceHead.store(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,180 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <ecuprofile.h>
+#include <channelhistory.h>
+
+// Capture triggers
+//
+// Full rate windows around the moments that matter without logging the
+// whole ride. Every trigger is evaluated on every normal frame. When a
+// trigger's condition becomes true its time is noted, and once
+// TRIGGER_POST_SECONDS have passed the main loop writes the raw frames from
+// TRIGGER_PRE_SECONDS before to TRIGGER_POST_SECONDS after it, taken from
+// the channel history, to TRIG0.CSV - TRIG7.CSV, round robin from boot. A
+// trigger fires on the edge only, it re-arms once its condition has been
+// false for a frame. The flash side lives in spifffs.h.
+
+enum TriggerKind : uint8_t
+{
+  TRIGGER_RPM,     // RPM above the threshold
+  TRIGGER_COOLANT, // Coolant above the threshold, C
+  TRIGGER_SPEED,   // Speed above the threshold, km/h
+  TRIGGER_GEAR,    // Any change between two known gears
+  TRIGGER_KINDS
+};
+
+const char *const triggerNames[TRIGGER_KINDS] = {"RPM", "COOLANT", "SPEED", "GEAR"};
+
+struct Trigger
+{
+  TriggerKind kind;
+  int16_t threshold;
+  bool active = false; // Condition held on the last frame
+  uint32_t fired = 0;
+};
+
+const uint8_t TRIGGER_MAX = 4;
+const uint8_t TRIGGER_PRE_SECONDS = 2;
+const uint8_t TRIGGER_POST_SECONDS = 2;
+const uint8_t TRIGGER_FILES = 8;
+static_assert(TRIGGER_PRE_SECONDS + TRIGGER_POST_SECONDS < HISTORY_FALLBACK_SECONDS,
+              "trigger window longer than the history");
+
+struct TriggerCapture
+{
+  Trigger triggers[TRIGGER_MAX];
+  uint8_t count = 0;
+
+  // Capture window, cut out of the channel history by the main loop
+  uint32_t triggerUs = 0; // Frame that fired
+  Trigger firedBy;        // Copy, the slot may be deleted while collecting
+  int32_t firedValue = 0;
+  bool collecting = false;
+  bool pending = false; // Complete, waiting for the main loop to write it
+
+  uint32_t captures = 0; // Windows completed since boot
+  uint32_t missed = 0;   // Fired while a window was still open or unwritten
+  uint16_t sequence = 0; // Next file number
+
+  bool add(TriggerKind kind, int16_t threshold)
+  {
+    if (count == TRIGGER_MAX)
+    {
+      return false;
+    }
+    triggers[count] = Trigger();
+    triggers[count].kind = kind;
+    triggers[count].threshold = threshold;
+    count++;
+    return true;
+  }
+
+  // 1 based like the TRIGGER listing
+  bool remove(uint8_t number)
+  {
+    if (number == 0 || number > count)
+    {
+      return false;
+    }
+    for (uint8_t i = number; i < count; ++i)
+    {
+      triggers[i - 1] = triggers[i];
+    }
+    count--;
+    return true;
+  }
+
+  void clear()
+  {
+    count = 0;
+  }
+
+  // Called for every normal frame from the decode path
+  void frame(const ChannelSample &values)
+  {
+    if (collecting && values.timeUs - triggerUs >= TRIGGER_POST_SECONDS * 1000000UL)
+    {
+      collecting = false;
+      pending = true;
+      captures++;
+    }
+
+    for (uint8_t i = 0; i < count; ++i)
+    {
+      Trigger &trigger = triggers[i];
+      int32_t value = 0;
+      bool condition = evaluate(trigger, values, value);
+      bool rising = condition && !trigger.active;
+      trigger.active = condition;
+      if (!rising)
+      {
+        continue;
+      }
+
+      trigger.fired++;
+      if (collecting || pending)
+      {
+        missed++;
+        continue;
+      }
+
+      triggerUs = values.timeUs;
+      firedBy = trigger;
+      firedValue = value;
+      collecting = true;
+    }
+    lastGear = values.gear;
+  }
+
+  // "RPM > 9000", "GEAR change"
+  std::string describe(const Trigger &trigger) const
+  {
+    if (trigger.kind == TRIGGER_GEAR)
+    {
+      return "GEAR change";
+    }
+    return std::string(triggerNames[trigger.kind]) + " > " + std::to_string(trigger.threshold);
+  }
+
+private:
+  uint8_t lastGear = 0;
+
+  bool evaluate(const Trigger &trigger, const ChannelSample &values, int32_t &value) const
+  {
+    switch (trigger.kind)
+    {
+    case TRIGGER_RPM:
+      value = values.rpm;
+      return value > trigger.threshold;
+    case TRIGGER_COOLANT:
+      value = values.coolant;
+      return value > trigger.threshold;
+    case TRIGGER_SPEED:
+      value = values.speed;
+      return value > trigger.threshold;
+    case TRIGGER_GEAR:
+      value = values.gear;
+      return values.gear != 0 && lastGear != 0 && values.gear != lastGear;
+    default:
+      return false;
+    }
+  }
+};
+
+TriggerCapture triggerCapture;
+
+// Kind from a command word, TRIGGER_KINDS when unknown
+TriggerKind triggerKind(const std::string &name)
+{
+  for (uint8_t kind = 0; kind < TRIGGER_KINDS; ++kind)
+  {
+    if (name == triggerNames[kind])
+    {
+      return (TriggerKind)kind;
+    }
+  }
+  return TRIGGER_KINDS;
+}
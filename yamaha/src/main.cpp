@@ -1,9 +1,18 @@
 #include <Arduino.h>
 #include <elm327command.h>
 #include <BLE.h>
+#include <elmtcp.h>
 #include <gear.h>
 #include <spifffs.h>
 #include <responsecommand.h>
+#include <ecuprofile.h>
+#include <kline.h>
+#include <kcapture.h>
+#include <parkmode.h>
+#include <powerscale.h>
+#include <sniffer.h>
+#include <trace.h>
+#include <ecudata.h>
 #include <vector>
 #include <unordered_map>
 #include "esp_timer.h"
@@ -38,9 +47,36 @@ extern bool Debug_PIDS;
 extern bool Debug_YAM;
 bool DisableBikeOff_Flag = false;
 
+// Fast boot, set once the deferred init task has finished
+volatile bool bootComplete = false;
+int64_t bootCompleteUs = 0;
+
 // BLE Connected bool
 extern bool clientConnected;
 
+// USB ELM327 mode, the USB serial port speaks ELM instead of the menu
+#ifndef USB_ELM_ON_BOOT
+#define USB_ELM_ON_BOOT false
+#endif
+bool usbElmMode = USB_ELM_ON_BOOT;
+ElmSession usbElm;
+uint32_t usbElmRequests = 0;
+
+// WiFi ELM327 on TCP port 35000, see elmtcp.h
+#ifndef WIFI_ELM_ON_BOOT
+#define WIFI_ELM_ON_BOOT false
+#endif
+
+// CPU frequency scaling between frames, see powerscale.h
+#ifndef PM_SCALING_ON_BOOT
+#define PM_SCALING_ON_BOOT true
+#endif
+
+// Session logs to LOG<n>.BIN, see sessionlog.h
+#ifndef SESSION_LOG_ON_BOOT
+#define SESSION_LOG_ON_BOOT true
+#endif
+
 // Time thresholds and timeouts
 uint32_t Time = esp_timer_get_time() / 1000;
 const uint16_t BIKE_OFF_TIMEOUT_TIMER = 5000; // 5 seconds in microseconds
@@ -56,82 +92,31 @@ const uint16_t sendIntervalUartRX = 2;
 const uint16_t sendIntervalElmTX = 3;
 const uint16_t sendIntervalElmRX = 4;
 
-// Magic numbers
-const byte DIAG_START_BYTE = 0xCD;
-
-// Buffer sizes
-#define VEHICLE_SPEED_RAW_BUFFER_SIZE 8
-#define ECU_BUFFER_SIZE 5
-
-// Yamaha RX Buffers
-using t_buffer_item = uint8_t;
-using t_buffer = std::vector<t_buffer_item>;
-byte Vehicle_Speed_Raw_Buffer[VEHICLE_SPEED_RAW_BUFFER_SIZE];
-byte ECU_Buffer[ECU_BUFFER_SIZE];
-
-// Immo discarded bytes
-static uint32_t discardedBytesCount = 0;
-
-// Buffer indices and time variables
-byte VehicleSpeedRawBufferIndex = 0;
-byte ECUBufferIndex = 0;
-byte IMMOIndex = 0;
-
-// Immo flags
-bool is3E = false;
-bool isIMMOHandled = false;
-
-// ECU Mode
-bool NormalData = false;
-bool frameEndDetected = false;
-bool diagMenu = false;
 
 // Gears
-uint8_t gear_speed = 0;
-uint16_t gear_rpm = 0;
-bool Gear_Speed_Ready = false;
-bool Gear_RPM_Ready = false;
 extern bool gearLearning;
 extern bool ratioReset;
 extern std::vector <float> constRatios;
 
-// Top Speed
-byte MaxSpeed = 0;
-
 // BLE Arrays
 std::queue<std::string> MyCallbacks::bleUartRxQue;
-std::queue<std::string> MyCallbacks::bleElmRxQueue;
-
-// PIDS
-uint16_t RPM_PID;        // RPM * 50 = RAW
-uint8_t Speed_PID;       // RAW km/h
-uint8_t Coolant_PID;     // Temp = -30
-uint8_t Error_PID;       // Error code
-uint8_t Gear_PID = 0;    // RAW 
-uint8_t Temp_PID;        // MCU Temp C
-uint8_t CPU_PID;         // CPU Freq mhz
-uint8_t RAM_Free_PID;    // Free Ram kb
-uint8_t Max_Speed_PID;   // Max Speed Reached
-uint16_t MCU_Uptime_PID; // Seconds
 
 // Function declarations
 void setup();
+void deferredInit(void *);
+void bootBanner();
+void bootReport();
 void loop();
 void mainTime();
 void YamahaRX();
-void processIMMOSequence(t_buffer &buffer, t_buffer_item receivedByte);
-void alignedFrame(const t_buffer &buffer);
-void handleDiagData(const t_buffer &buffer);
-void handleNormalData(const t_buffer &buffer);
 void sendResponse(const std::string &message);
+void sendResponse(const char *message, size_t length);
 void serialRX();
+void usbElmRX();
+void usbElmRelease();
+void setUsbElm(bool enabled);
 extern void receiveResponse(std::string message);
 void handleBikeOffCondition();
-void calculateRPM(t_buffer_item rpmByte);
-void calculateVehicleSpeed(t_buffer_item speedByte);
-void extractErrorCode(t_buffer_item Error);
-void calculateCoolantTemp(t_buffer_item Temp);
-void maximumSpeed();
 void updateMcuPidValues();
 void debugPIDS();
 void toUpperCaseInPlace(std::string &str);
@@ -140,14 +125,82 @@ extern void gears();
 extern void menu(std::string command);
 void bleTimers();
 extern void loadSpiffRatios();
+extern void loadTopSpeed();
+extern void saveTopSpeed();
+void showStats();
+void resetStats();
+void showDtcs();
+void showTriggers();
+void showSessionLogs();
+void beginHistory();
+void showHistory();
+void queryHistory(const char *channelName, float fromSAgo, float toSAgo, uint32_t stepMs);
+void serviceHistoryQuery();
+size_t consoleRoom();
 
 
 // Setup
 void setup()
 {
+  // Arm K-line capture before anything else so the IMMO preamble is buffered
+  kCaptureBegin(YAM_RX, YAM_TX);
+  parkBegin(YAM_RX);
   Serial.begin(115200);
-  Serial1.begin(16040, SERIAL_8N1, YAM_RX, YAM_TX);
+  // Before the first frame is decoded, the loop feeds it from then on
+  beginHistory();
+
+  // Everything else initialises in the background while bytes are buffered
+  xTaskCreatePinnedToCore(deferredInit, "deferredInit", 8192, nullptr, 1, nullptr, 0);
+}
+
+void deferredInit(void *)
+{
+  if (!usbElmMode)
+  {
+    bootBanner();
+  }
+  Wire.begin(MY_SDA_PIN, MY_SCL_PIN);
+  u8g2.begin();
+  MyCallbacks *myCallbacks = new MyCallbacks();
+  bool success = Device::getInstance().start(myCallbacks);
+  if (!success)
+  {
+    sendResponse("Failed to start BLE");
+  }
+  if (!SPIFFS.begin())
+  {
+    sendResponse("SPIFFS mount failed");
+  }
+  else
+  {
+    // Init the Gear ratios from the spiffs
+    loadSpiffRatios();
+    loadTopSpeed();
+    loadStoredDtcs();
+    loadSessionLogs();
+    sessionLog.enabled = SESSION_LOG_ON_BOOT;
+  }
+  if (!pmConfigure(PM_SCALING_ON_BOOT))
+  {
+    sendResponse("CPU frequency scaling unavailable, running at " + std::to_string(getCpuFrequencyMhz()) + " MHz");
+  }
+  if (WIFI_ELM_ON_BOOT && !elmTcpStart())
+  {
+    sendResponse("Failed to start WiFi ELM");
+  }
+  showHistory();
+  menu("MENU");
+
+  bootCompleteUs = esp_timer_get_time();
+  bootComplete = true;
+  vTaskDelete(nullptr);
+}
+
+void bootBanner()
+{
   Serial.println("Yamaha ELM327 Datalogger");
+  Serial.print("ECU Profile: ");
+  Serial.println(EcuProfile::NAME);
   Serial.print("MCU Temperature: ");
   Serial.print(temperatureRead());
   Serial.println(" °C");
@@ -160,35 +213,68 @@ void setup()
   Serial.print("Max Alloc Heap: ");
   Serial.print(ESP.getMaxAllocHeap());
   Serial.println(" bytes");
-  Wire.begin(MY_SDA_PIN, MY_SCL_PIN);
-  u8g2.begin();
-  MyCallbacks *myCallbacks = new MyCallbacks();
-  bool success = Device::getInstance().start(myCallbacks);
-  if (!success)
-  {
-    sendResponse("Failed to start BLE");
-  }
-  if (!SPIFFS.begin())
+}
+
+void bootReport()
+{
+  sendResponse("Boot: capture armed " + std::to_string(kCaptureArmedUs / 1000) + " ms, init done " +
+               std::to_string(bootCompleteUs / 1000) + " ms");
+  if (!kCaptureSeen.load(std::memory_order_acquire))
   {
-    sendResponse("SPIFFS mount failed");
+    sendResponse("Boot: no K-line bytes captured yet");
     return;
   }
-  // Init the Gear ratios from the spiffs
-  loadSpiffRatios();
-  menu("MENU");
+  sendResponse("Boot: first K-line byte " + std::to_string(kCaptureFirstByteUs / 1000) + " ms, overflows " +
+               std::to_string(kCaptureOverflows.load()));
 }
 
 void loop()
 {
   mainTime();
+
+  // Capture keeps buffering until the background init is done
+  if (!bootComplete)
+  {
+    delay(1);
+    return;
+  }
+
+  // Report boot timing once the first byte has been seen
+  static bool bootReported = false;
+  if (!bootReported && kCaptureSeen.load(std::memory_order_acquire))
+  {
+    bootReport();
+    bootReported = true;
+  }
+
   bleTimers();
   handleBikeOffCondition();
   YamahaRX();
+  MyCallbacks::releaseElmLongPoll();
+  usbElmRelease();
+  elmTcpService();
   displayData();
   serialRX();
   debugPIDS();
   updateMcuPidValues();
   gears();
+
+  // Freeze frame, trigger capture and session log files, written here
+  // rather than in the decode path
+  deleteFreezeFrames();
+  saveFreezeFrame();
+  saveTriggerCapture();
+  saveSessionLog();
+
+  sniffNotify();
+
+  // Query output, paced to what the console can take
+  serviceSessionQuery();
+  serviceHistoryQuery();
+
+  // Light sleep while parked, unless a client or the USB host is attached
+  parkService(Device::getInstance().clientConnected || usbElmMode || elmTcpRunning || DisableBikeOff_Flag ||
+              (bool)Serial);
 }
 
 void mainTime(){
@@ -197,261 +283,486 @@ void mainTime(){
 
 void YamahaRX()
 {
-  static t_buffer buffer;
-
-  if (!Serial1.available())
+  // Full clock from the first byte of a frame until the line goes quiet
+  // after it, one clock switch per frame rather than per byte
+  static bool frameBurst = false;
+  static uint32_t lastByteUs = 0;
+
+  // Drain every byte in the capture ring
+  uint8_t receivedByte;
+  uint32_t byteTimeUs;
+  while (kCaptureRead(receivedByte, byteTimeUs))
   {
-    return;
-  }
+    if (!frameBurst)
+    {
+      pmBurstBegin(PM_BURST_KLINE);
+      frameBurst = true;
+    }
+    pmRecordLag(byteTimeUs);
+    lastByteUs = byteTimeUs;
+
+    // Bike off times out from the byte on the line, not from when the loop got to it
+    int64_t nowUs = esp_timer_get_time();
+    lastByteTime = (nowUs - (uint32_t)((uint32_t)nowUs - byteTimeUs)) / 1000;
 
-  // Update lastByteTime with esp_timer_get_time()
-  lastByteTime = esp_timer_get_time() / 1000;
+    // Raw bytes go to the trace ring, read back with the TRACE command
+    if (Debug_YAM)
+    {
+      TRACE_DEBUG_AT(byteTimeUs, TRACE_YAM_RX, receivedByte, 0);
+    }
+
+    sniffByte(receivedByte, byteTimeUs);
+    decodeByte(receivedByte, byteTimeUs);
+  }
 
-  // Read a byte from Serial1
-  t_buffer_item receivedByte = Serial1.read();
+  if (frameBurst && (uint32_t)esp_timer_get_time() - lastByteUs >= PM_FRAME_GAP_US)
+  {
+    pmBurstEnd(PM_BURST_KLINE);
+    frameBurst = false;
+  }
+}
 
-if (Debug_YAM)
+// Console bytes that can be sent without the BLE ring dropping a line, USB
+// output blocks instead
+size_t consoleRoom()
 {
-    std::stringstream ss;
-    ss << "Yam RX: " << std::setw(2) << std::setfill('0') << std::hex << static_cast<int>(receivedByte);
-    // Get the string representation without the "0x" prefix
-    std::string output = ss.str().substr(2);
-    sendResponse(output);
+  return Device::getInstance().bleUartRoom();
 }
 
+void sendResponse(const std::string &message)
+{
+  sendResponse(message.data(), message.size());
+}
 
-  // Check and handle the first byte of the IMMO sequence immediately
-  if (!is3E && receivedByte == 0x3E)
+// Console output without a std::string, text in flash goes straight to the
+// USB port and the BLE console ring
+void sendResponse(const char *message, size_t length)
+{
+  // Print the message, the USB port carries ELM replies only in USB ELM mode
+  if (!usbElmMode)
   {
-    is3E = true;
-    buffer.push_back(receivedByte);
-    sendResponse("Starting IMMO sequence.");
-    return;
+    Serial.write(reinterpret_cast<const uint8_t *>(message), length);
+    Serial.println();
   }
 
-  if (is3E && !isIMMOHandled)
-  {
-    // Continue handling the IMMO sequence
-    processIMMOSequence(buffer, receivedByte);
-  }
-  else if (isIMMOHandled)
+  // Check for empty command
+  if (length == 0)
   {
-    // Ensure buffer does not exceed 5 bytes
-    if (buffer.size() >= 5)
+    if (!usbElmMode)
     {
-      buffer.erase(buffer.begin());
+      Serial.println("Empty command received.");
     }
-    buffer.push_back(receivedByte);
+    return; // Exit if the command is empty
+  }
 
-    // Process only when buffer is exactly 5 bytes
-    if (buffer.size() == 5)
-    {
-      bool allZero = std::all_of(buffer.begin(), buffer.end(), [](uint32_t i)
-                                 { return i == 0; });
-
-      if (!allZero)
-      {
-        t_buffer_item sum = std::accumulate(buffer.begin(), buffer.end() - 1, 0);
-        if (sum == buffer.back())
-        {
-          alignedFrame(buffer);
-          buffer.clear(); // Clear the buffer for the next frame
+  Device::getInstance().bleUartQue(message, length);
+}
+
+std::string serialRXBuffer;  // Buffer to accumulate characters
+
+void serialRX() {
+    // Check if the serial connection is still active
+    if (!Serial) {
+        return;
+    }
+
+    if (usbElmMode) {
+        usbElmRX();
+        return;
+    }
+
+    if (Serial.available() > 0) {  // Check if there is data to process
+        char ch = Serial.read();  // Read one character from the serial
+
+        if (ch == '\n') {  // Check if the character is a newline
+            if (!serialRXBuffer.empty()) {
+                receiveResponse(serialRXBuffer);  // Process the accumulated input
+                serialRXBuffer.clear();  // Clear the buffer after processing
+            }
+        } else {
+            serialRXBuffer += ch;  // Add character to buffer if not newline
         }
-      }
     }
-  }
 }
 
-void processIMMOSequence(t_buffer &buffer, t_buffer_item receivedByte)
+// USB ELM327 endpoint
+//
+// Same handleCommand() path and ElmSession as the BLE ELM service, but the
+// reply is written the moment the command line is complete instead of
+// waiting for the ELM timers and the next connection event, so a laptop
+// logger gets sub-millisecond round trips. Commands end with CR like on a
+// real ELM327, "USB ELM OFF" on the port returns it to the menu.
+void usbElmRX()
 {
-  // Push the received byte into the buffer
-  buffer.push_back(receivedByte);
+  // ELM is strictly request/response, nothing is read while a request is held
+  if (usbElm.holding())
+  {
+    return;
+  }
 
-  if (buffer.size() == 61)
+  if (Serial.available() == 0)
   {
+    return;
+  }
 
-    if (buffer.back() == 0xCD)
+  PmLock lock(PM_BURST_ELM);
+  while (Serial.available() > 0)
+  {
+    char ch = Serial.read();
+    if (ch != '\r' && ch != '\n')
     {
-      diagMenu = true; // Diag menu init
-      buffer.clear();
-      sendResponse("Diag start initiated.");
+      serialRXBuffer += ch;
+      continue;
     }
-    else
+
+    std::string command = serialRXBuffer;
+    serialRXBuffer.clear();
+    trimInPlace(command);
+    toUpperCaseInPlace(command);
+    if (command.empty())
     {
-      buffer.clear();
+      continue;
     }
 
-    isIMMOHandled = true;
-    sendResponse("Normal start initiated.");
+    if (command == "USB ELM OFF")
+    {
+      setUsbElm(false);
+      return;
+    }
+
+    usbElmRequests++;
+    if (usbElm.hold(command, micros()))
+    {
+      return;
+    }
+
+    std::string reply = usbElm.reply(command);
+    Serial.write(reinterpret_cast<const uint8_t *>(reply.data()), reply.size());
+    return;
   }
 }
 
-void alignedFrame(const t_buffer &buffer)
+// Answer a held long-poll request straight after its frame decoded
+void usbElmRelease()
 {
-  // First, ensure that the buffer size is as expected.
-  if (buffer.size() != 5)
+  std::string reply;
+  if (usbElmMode && usbElm.release(micros(), reply))
   {
-    return;
+    PmLock lock(PM_BURST_ELM);
+    Serial.write(reinterpret_cast<const uint8_t *>(reply.data()), reply.size());
   }
+}
 
-  if (diagMenu)
+void setUsbElm(bool enabled)
+{
+  if (enabled)
   {
-    handleDiagData(buffer);
+    sendResponse("USB ELM mode: the USB port now speaks ELM327, send \"USB ELM OFF\" to return");
   }
-  else
+  serialRXBuffer.clear();
+  usbElm = ElmSession();
+  usbElmMode = enabled;
+  if (!enabled)
   {
-    handleNormalData(buffer);
+    sendResponse("USB ELM mode off, USB port back to the menu");
   }
 }
 
-void handleDiagData(const t_buffer &buffer)
+// Rollups from rollup.h, coolant shown in C
+std::string rollupWindowText(const RollupWindow &window)
 {
-  sendResponse("Diag menu!");
+  if (window.count == 0)
+  {
+    return "-";
+  }
+  char text[96];
+  snprintf(text, sizeof(text), "min %u max %u mean %.1f sd %.1f", window.min, window.max, window.mean(),
+           sqrt(window.variance()));
+  return text;
 }
 
-void handleNormalData(const t_buffer &buffer)
+template <uint8_t BANDS>
+std::string bandText(const BandHistogram<BANDS> &bands, const char *units)
 {
-
-  maximumSpeed();
-
-  if (buffer.size() != 5)
+  std::string text;
+  for (uint8_t band = 0; band < BANDS; ++band)
   {
-    return;
+    if (bands.ms[band] == 0)
+    {
+      continue;
+    }
+    std::string edge = band == 0 ? "<" + std::to_string(bands.lowerEdge(1))
+                                 : std::to_string(bands.lowerEdge(band)) + (band == BANDS - 1 ? "+" : "");
+    text += " " + edge + units + " " + std::to_string((bands.ms[band] + 500) / 1000) + "s";
   }
-
-  calculateRPM(buffer[0]);
-  calculateVehicleSpeed(buffer[1]);
-  extractErrorCode(buffer[2]);
-  calculateCoolantTemp(buffer[3]);
+  return text.empty() ? " no data" : text;
 }
 
-void sendResponse(const std::string &message)
+void showStats()
 {
-  // Print the message
-  Serial.println(message.c_str());
-
-  // Check for empty command
-  if (message.length() == 0)
+  sendResponse("Ride time " + std::to_string(rollups.rideSeconds) + " s, top speed " +
+               std::to_string(Max_Speed_PID) + " km/h (saved " + std::to_string(savedTopSpeed) + ")");
+  for (uint8_t id = 0; id < ROLLUP_CHANNELS; ++id)
   {
-    Serial.println("Empty command received.");
-    return; // Exit if the command is empty
+    const RollupChannel &channel = rollups.channels[id];
+    sendResponse(std::string(rollupNames[id]) + " 1s: " + rollupWindowText(channel.lastSecond) +
+                 " | 1m: " + rollupWindowText(channel.lastMinute) + " | peak " + std::to_string(channel.peak) +
+                 " at " + std::to_string(channel.peakSecond) + " s");
   }
+  sendResponse("RPM bands:" + bandText(rollups.rpmBands, ""));
+  sendResponse("Coolant bands:" + bandText(rollups.coolantBands, "C"));
+}
 
-  Device::getInstance().bleUartQue(message);
+void resetStats()
+{
+  rollups.clear();
+  Max_Speed_PID = 0;
+  saveTopSpeed();
 }
 
-std::string serialRXBuffer;  // Buffer to accumulate characters
+void showDtcs()
+{
+  if (dtcLog.active)
+  {
+    sendResponse("Active: " + dtcText(dtcFor(dtcLog.active)) + " Yamaha " + std::to_string(dtcLog.active) + " " +
+                 faultName(dtcLog.active));
+  }
+  if (dtcLog.storedCount == 0)
+  {
+    sendResponse("No stored fault codes");
+  }
+  for (uint8_t i = 0; i < dtcLog.storedCount; ++i)
+  {
+    uint8_t code = dtcLog.stored[i];
+    sendResponse("Stored: " + dtcText(dtcFor(code)) + " Yamaha " + std::to_string(code) + " " + faultName(code) +
+                 ", freeze frame " + freezeFileName(code));
+  }
+  sendResponse("Freeze frames taken " + std::to_string(dtcLog.freezeFrames) + ", missed " +
+               std::to_string(dtcLog.missed) + ", " + std::to_string(FREEZE_SECONDS) + " s before the fault");
+}
 
-void serialRX() {
-    // Check if the serial connection is still active
-    if (!Serial) {
-        return;
-    }
+void showTriggers()
+{
+  if (triggerCapture.count == 0)
+  {
+    sendResponse("No triggers set");
+  }
+  for (uint8_t i = 0; i < triggerCapture.count; ++i)
+  {
+    const Trigger &trigger = triggerCapture.triggers[i];
+    sendResponse(std::to_string(i + 1) + ". " + triggerCapture.describe(trigger) + ", fired " +
+                 std::to_string(trigger.fired));
+  }
+  sendResponse("Captures " + std::to_string(triggerCapture.captures) + ", missed " +
+               std::to_string(triggerCapture.missed) + ", " + std::to_string(TRIGGER_PRE_SECONDS) + " s before and " +
+               std::to_string(TRIGGER_POST_SECONDS) + " s after" + (triggerCapture.collecting ? ", capturing now" : ""));
+}
 
-    if (Serial.available() > 0) {  // Check if there is data to process
-        char ch = Serial.read();  // Read one character from the serial
+void showSessionLogs()
+{
+  if (sessionLog.active)
+  {
+    sendResponse("Logging to " + sessionFileName(sessionLog.session).substr(1) + ", " +
+                 std::to_string(sessionLog.records) + " frames, " + std::to_string(sessionLog.bytesWritten / 1024) +
+                 " KB, missed " + std::to_string(sessionLog.missed));
+  }
+  else
+  {
+    sendResponse(std::string("Session log ") + (sessionLog.enabled ? "on, waiting for frames" : "off"));
+  }
 
-        if (ch == '\n') {  // Check if the character is a newline
-            if (!serialRXBuffer.empty()) {
-                receiveResponse(serialRXBuffer);  // Process the accumulated input
-                serialRXBuffer.clear();  // Clear the buffer after processing
-            }
-        } else {
-            serialRXBuffer += ch;  // Add character to buffer if not newline
-        }
+  File root = SPIFFS.open("/");
+  for (File file = root ? root.openNextFile() : File(); file; file = root.openNextFile())
+  {
+    if (sessionFileNumber(file.name()))
+    {
+      sendResponse(std::string(file.name()) + " " + std::to_string(file.size() / 1024) + " KB");
     }
+  }
 }
 
-void handleBikeOffCondition()
+// PSRAM when the board has it, otherwise a short history in internal RAM
+void beginHistory()
 {
-  // Early return if the bike off condition handling is disabled or lastByteTime is zero
-  if (DisableBikeOff_Flag || lastByteTime == 0)
+  size_t bytes = ChannelHistory::records(HISTORY_SECONDS) * ChannelHistory::RECORD_BYTES;
+  void *memory = psramFound() ? ps_malloc(bytes) : nullptr;
+  bool psram = memory != nullptr;
+  if (!psram)
   {
-    return;
+    bytes = ChannelHistory::records(HISTORY_FALLBACK_SECONDS) * ChannelHistory::RECORD_BYTES;
+    memory = malloc(bytes);
   }
-      // Get the current time in microseconds
-  uint64_t timeElapsed = Time - lastByteTime; // Calculate time elapsed since the last byte received
+  channelHistory.begin(memory, bytes, psram);
+}
 
-  if (timeElapsed > BIKE_OFF_TIMEOUT_TIMER)
+void showHistory()
+{
+  if (channelHistory.capacity == 0)
   {
-    // Reset flags and variables related to bike off condition
-    is3E = false;
-    isIMMOHandled = false;
-    NormalData = false;
-    frameEndDetected = false;
-    diagMenu = false;
-    ECUBufferIndex = 0;
-    lastByteTime = 0;
-    Gear_PID = 0;
-    Coolant_PID = 0;
-    RPM_PID = 0;
-    Speed_PID = 0;
-    Error_PID = 0;
-    // Reset Gear
-    ratioArray.clear();
-    sendResponse("\nBike Off Detected");
+    sendResponse("Channel history unavailable, no memory");
+    return;
   }
+  uint32_t seconds = channelHistory.capacity * EcuProfile::FRAME_PERIOD_US / 1000000;
+  sendResponse("Channel history " + std::to_string(seconds) + " s (" + std::to_string(channelHistory.capacity) +
+               " frames) in " + (channelHistory.inPsram ? "PSRAM" : "internal RAM") + ", holding " +
+               std::to_string(channelHistory.spanUs() / 1000000) + " s");
 }
 
-void calculateRPM(t_buffer_item rpmByte)
+// A "History" query in progress, printed by serviceHistoryQuery() like a
+// "Log Query". Frames keep arriving meanwhile, the query walks by frame time
+struct HistoryQuery
 {
+  bool active = false;
+  bool headerSent = false;
+  bool started = false;  // lastUs is a frame already looked at
+  bool finished = false;
+  bool truncated = false;
+  bool overrun = false;  // The frames still to print were dropped from the ring
+  LogChannel channel = LOG_RPM;
+  LogDecimator pick{0, 0, 0};
+  uint32_t newestUs = 0; // Times are relative to the newest frame when the query started
+  uint32_t lastUs = 0;
+  uint16_t samples = 0;
+};
+HistoryQuery historyQuery;
+
+bool historyQueryRunning()
+{
+  return historyQuery.active;
+}
 
-  uint8_t RPM = rpmByte;
+// Time is seconds before the newest frame, e.g. "HISTORY RPM 60 0" is the last minute
+void queryHistory(const char *channelName, float fromSAgo, float toSAgo, uint32_t stepMs)
+{
+  LogChannel channel = logChannel(channelName);
+  if (channel == LOG_CHANNELS || channel == LOG_TIME)
+  {
+    sendResponse(std::string("Unknown channel ") + channelName + ", one of RPM SPEED COOLANT ERROR GEAR");
+    return;
+  }
+  if (historyQuery.active || sessionQuery.active)
+  {
+    sendResponse("A query is still printing");
+    return;
+  }
+  size_t count = channelHistory.size();
+  if (count == 0)
+  {
+    sendResponse("Channel history is empty");
+    return;
+  }
 
-  // Assign the RPM value directly to RPM_PID and gear_rpm.
-  RPM_PID = RPM * 50; // Correct up to 12500
-  gear_rpm = RPM_PID;
+  // Nothing older than the history is held, this also keeps the window in 32-bit us
+  float spanS = channelHistory.spanUs() / 1e6f;
+  fromSAgo = std::min(fromSAgo, spanS);
+  toSAgo = std::min(toSAgo, fromSAgo);
+  historyQuery = HistoryQuery();
+  historyQuery.channel = channel;
+  historyQuery.pick = LogDecimator(-fromSAgo * 1000, -toSAgo * 1000, stepMs);
+  historyQuery.newestUs = channelHistory.time(count - 1);
+  historyQuery.lastUs = historyQuery.newestUs - (uint32_t)-historyQuery.pick.fromMs * 1000;
+  historyQuery.active = true;
 }
 
-void calculateVehicleSpeed(t_buffer_item speedByte)
+// From loop(), up to QUERY_LINES_PER_LOOP lines and LOG_BLOCK_RECORDS frames per call
+void serviceHistoryQuery()
 {
-
-  if (VehicleSpeedRawBufferIndex < VEHICLE_SPEED_RAW_BUFFER_SIZE)
+  HistoryQuery &query = historyQuery;
+  if (!query.active)
   {
-    Vehicle_Speed_Raw_Buffer[VehicleSpeedRawBufferIndex++] = speedByte;
+    return;
   }
 
-  // Check if the buffer is full.
-  if (VehicleSpeedRawBufferIndex == VEHICLE_SPEED_RAW_BUFFER_SIZE)
+  size_t count = channelHistory.size();
+  size_t i = channelHistory.lowerBound(query.lastUs);
+  if (query.started)
   {
-    int totalSpeed = 0;
-    for (int i = 0; i < VEHICLE_SPEED_RAW_BUFFER_SIZE; ++i)
+    // Carry on after the last frame, unless the ring has moved past it
+    if (i == count || channelHistory.time(i) != query.lastUs)
     {
-      totalSpeed += Vehicle_Speed_Raw_Buffer[i]; // Accumulate speed data.
+      query.overrun = query.finished = true;
     }
+    i++;
+  }
 
-    // Process the accumulated speed data.
-    Speed_PID = totalSpeed;
-    MaxSpeed = totalSpeed;
-
-    gear_speed = Speed_PID;
-
-    // Keep sync of Speed/RPM
-    Gear_Speed_Ready = true;
-    Gear_RPM_Ready = true;
+  char line[32];
+  uint8_t lines = 0;
+  for (size_t frames = 0; !query.finished && lines < QUERY_LINES_PER_LOOP && frames < LOG_BLOCK_RECORDS &&
+                          consoleRoom() > sizeof(line);
+       ++frames)
+  {
+    if (!query.headerSent)
+    {
+      sendResponse(std::string("time,") + logChannels[query.channel].name);
+      query.headerSent = true;
+      lines++;
+      continue;
+    }
+    if (i >= count)
+    {
+      query.finished = true;
+      break;
+    }
 
-    // Reset the buffer index to 0 for the next frame.
-    VehicleSpeedRawBufferIndex = 0;
+    int32_t timeMs = (int32_t)(channelHistory.time(i) - query.newestUs) / 1000;
+    if (query.pick.done(timeMs))
+    {
+      query.finished = true;
+      break;
+    }
+    query.lastUs = channelHistory.time(i);
+    query.started = true;
+    if (!query.pick.take(timeMs))
+    {
+      i++;
+      continue;
+    }
+    if (query.samples == LOG_QUERY_MAX)
+    {
+      query.truncated = query.finished = true;
+      break;
+    }
+    snprintf(line, sizeof(line), "%s%ld.%03ld,%ld", timeMs < 0 ? "-" : "", (long)(-timeMs / 1000),
+             (long)(-timeMs % 1000), (long)channelHistory.value(i, query.channel));
+    sendResponse(line);
+    query.samples++;
+    lines++;
+    i++;
+  }
+  if (!query.finished || consoleRoom() < QUERY_SUMMARY_BYTES)
+  {
+    return;
   }
-}
 
-void extractErrorCode(t_buffer_item Error)
-{
-  Error_PID = Error;
+  query.active = false;
+  sendResponse("# " + std::to_string(query.samples) + " samples" +
+               (query.truncated ? ", stopped at " + std::to_string(LOG_QUERY_MAX) + ", use a larger step" : "") +
+               (query.overrun ? ", the rest left the history before it was printed" : ""));
 }
 
-void calculateCoolantTemp(t_buffer_item Temp)
+void handleBikeOffCondition()
 {
-  Coolant_PID = Temp - 30;
-}
+  // Early return if the bike off condition handling is disabled or lastByteTime is zero
+  if (DisableBikeOff_Flag || lastByteTime == 0)
+  {
+    return;
+  }
+      // Get the current time in microseconds
+  uint64_t timeElapsed = Time - lastByteTime; // Calculate time elapsed since the last byte received
 
-void maximumSpeed()
-{
-  static byte topSpeed = 10; // Static variable initialization
-  if (Speed_PID > topSpeed)
+  if (timeElapsed > BIKE_OFF_TIMEOUT_TIMER)
   {
-    topSpeed = Speed_PID; // Update if the current Speed_PID is greater
-    Max_Speed_PID = topSpeed;
+    TRACE_INFO(TRACE_BIKE_OFF, std::min<uint64_t>(timeElapsed, 0xFFFF), 0);
+    // Reset flags and variables related to bike off condition
+    resetEcuData();
+    saveTopSpeed();
+    saveAdaptedRatios(true);
+    sessionLog.end();
+    lastByteTime = 0;
+    // Reset Gear
+    ratioArray.clear();
+    sendResponse("\nBike Off Detected");
+    parkEnter();
   }
 }
 
@@ -476,6 +787,11 @@ void updateMcuPidValues()
 
     // Update free RAM PID value, converting bytes to kilobytes
     RAM_Free_PID = ESP.getFreeHeap() / 1024;
+
+    // Fragmentation: largest block malloc can still hand out, and the
+    // lowest free heap since boot
+    Heap_Largest_PID = ESP.getMaxAllocHeap() / 1024;
+    Heap_Min_PID = ESP.getMinFreeHeap() / 1024;
   }
 }
 
@@ -483,16 +799,16 @@ void debugPIDS()
 {
   if (Debug_PIDS)
   {
-    sendResponse(std::string("RPM: ") + std::to_string(RPM_PID) + "\n" +
-                 "Vehicle Speed: " + std::to_string(Speed_PID) + "\n" +
-                 "Current Gear: " + std::to_string(Gear_PID) + "\n" +
-                 "Coolant Temp: " + std::to_string(Coolant_PID) + "\n" +
-                 "Error Code: " + std::to_string(Error_PID) + "\n" +
-                 "MCU Temp: " + std::to_string(Temp_PID) + "\n" +
-                 "CPU Mhz: " + std::to_string(CPU_PID) + "\n" +
-                 "Ram Free: " + std::to_string(RAM_Free_PID) + "\n" +
-                 "Max Speed: " + std::to_string(Max_Speed_PID) + "\n" +
-                 "MCU Uptime Seconds: " + std::to_string(MCU_Uptime_PID) + "\n");
+    // Formatted in place, this runs every loop while enabled
+    static char text[384];
+    int length = snprintf(text, sizeof(text),
+                          "RPM: %u\nVehicle Speed: %u\nCurrent Gear: %u\nCoolant Temp: %u\nError Code: %u\n"
+                          "MCU Temp: %u\nCPU Mhz: %u\nRam Free: %u\nHeap Largest/Min: %u/%u\nMax Speed: %u\n"
+                          "MCU Uptime Seconds: %u\nRPM 1s Max/Min: %u/%u\n",
+                          RPM_PID, Speed_PID, Gear_PID, Coolant_PID, Error_PID, Temp_PID, CPU_PID, RAM_Free_PID,
+                          Heap_Largest_PID, Heap_Min_PID, Max_Speed_PID, MCU_Uptime_PID, RPM_Max_1s_PID,
+                          RPM_Min_1s_PID);
+    sendResponse(text, std::min((size_t)length, sizeof(text) - 1));
   }
 }
 
@@ -552,6 +868,7 @@ void bleTimers()
   // NEW: Elm RX queue processing
   if (Time - lastSendTimeElmRX >= sendIntervalElmRX)
   {
+    PmLock lock(PM_BURST_ELM);
     MyCallbacks::processElmRxQueue();
     lastSendTimeElmRX = Time;
   }